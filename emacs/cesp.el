@@ -40,8 +40,42 @@ you are editing with them"
   :group 'cespconf
   :type '(string))
 
+(defcustom cesp-room ""
+  "Session to join on the Cesp server.
+Every room has its own host and users, the empty
+string joins the server's default room"
+  :group 'cespconf
+  :type '(string))
+
 ;;; Internal variables
 
+(defcustom cesp-messages-per-tick 32
+  "Messages handled at a time before letting Emacs redisplay.
+The rest are handled on the next idle timer."
+  :group 'cespconf
+  :type '(integer))
+
+(defcustom cesp-batch-delay 0.01
+  "Seconds to collect buffer changes before sending them together."
+  :group 'cespconf
+  :type '(number))
+
+(defvar cesp--queued-changes
+  nil
+  "Changes waiting to be sent, an alist of (path . changes).
+Changes of each path are newest first.")
+
+(defvar cesp--send-timer
+  nil
+  "Timer that sends queued changes, if one is scheduled.")
+
+(defconst cesp--input-buffer " *cesp-input*"
+  "Hidden buffer where received data waits to be parsed.")
+
+(defvar cesp--input-timer
+  nil
+  "Idle timer that handles received messages, if one is scheduled.")
+
 (defvar cesp-is-host
   nil
   "Am I the host?")
@@ -89,8 +123,8 @@ name as per the variable"
 								 :filter 'cesp--filter
 								 :sentinel 'cesp--sentinel))
 		;; Perform handshake
-		(cesp--send `((event . "handshake") (name . "Jaakko") (host . ,(or owner
-																		  :false)))))
+		(cesp--send `((event . "handshake") (name . ,cesp-name) (room . ,cesp-room)
+					  (host . ,(or owner :false)))))
 	(error "You are already connected to a server!")))
 
 (defun cesp-disconnect()
@@ -152,61 +186,190 @@ into a string.
 			(setq file-list (cons (concat dir "/" (car entry)) file-list)))))
 	file-list))
 
-(defun cesp--send-update(beg end len)
-  "Sends an update_content event when buffer is updated."
-  (let ((lines (vconcat (split-string (buffer-substring-no-properties beg end) "
-" t))) ;; Newline regex
-		(first (line-number-at-pos beg))
-		(old_last (line-number-at-pos end)))
-	(cesp--send `((event . "update_content") (path . ,(buffer-name))
-				  (changes . ((first . ,first) (old_last . ,old_last) (lines . ,lines))) ))))
+(defvar-local cesp--shared nil
+  "Non-nil in buffers of shared Cesp files, only their changes are sent.")
+
+(defvar-local cesp--old-text nil
+  "Text that the change in progress replaces, saved by `cesp--save-old-text'.")
+
+(defvar-local cesp--old-lines nil
+  "Lines the change in progress replaces, saved by `cesp--save-old-text'.
+A list of the 0-based first line, exclusive last line and the number
+of characters after the changed region.")
+
+(defun cesp--save-old-text(beg end)
+  "Saves text between BEG and END before it is changed."
+  (setq cesp--old-text (buffer-substring-no-properties beg end))
+  (setq cesp--old-lines (list (1- (line-number-at-pos beg))
+							  (line-number-at-pos end)
+							  (- (point-max) end))))
 
+(defun cesp--send-update(beg end len)
+  "Queues an update_content change when buffer is updated.
+Changes inside one line are sent as text changes with byte columns,
+others as line changes."
+  (when cesp--shared
+	(cesp--send-change beg end len)))
+
+(defun cesp--send-change(beg end len)
+  "Queues the change between BEG and END that replaced LEN characters."
+  (let ((text (buffer-substring-no-properties beg end)))
+	(if (and cesp--old-text
+			 (= (length cesp--old-text) len)
+			 (not (string-match-p "\n" cesp--old-text))
+			 (not (string-match-p "\n" text)))
+		(cesp--queue-change
+		 (list (cons 'first (1- (line-number-at-pos beg)))
+			   (cons 'col (- (position-bytes beg)
+							 (position-bytes (save-excursion
+											   (goto-char beg)
+											   (line-beginning-position)))))
+			   (cons 'delete (string-bytes cesp--old-text))
+			   (cons 'text text)))
+	  (cesp--send-line-update beg end len))))
+
+(defun cesp--send-line-update(beg end len)
+  "Queues an update_content change with whole lines.
+Lines touched by the change are replaced, first is 0-based and
+old_last exclusive like in text changes and the Neovim client.
+Old lines come from `cesp--save-old-text', whose region can be
+larger than BEG and END."
+  (let* ((old (or cesp--old-lines
+				  (list (1- (line-number-at-pos beg)) (line-number-at-pos beg)
+						(- (point-max) end))))
+		 (first (nth 0 old))
+		 ;; Text after the old region is unchanged, it ends the new one
+		 (new-end (max end (- (point-max) (nth 2 old))))
+		 (lines (vconcat (split-string
+						  (buffer-substring-no-properties
+						   (save-excursion
+							 (goto-char (point-min))
+							 (forward-line first)
+							 (point))
+						   (save-excursion (goto-char new-end) (line-end-position)))
+						  "\n"))))
+	(cesp--queue-change `((first . ,first) (old_last . ,(nth 1 old))
+						  (lines . ,lines)))))
+
+(defun cesp--merge-change(last change)
+  "Appends text CHANGE to LAST if it continues typing right after it.
+Both are text change alists, LAST is modified. Returns nil if they
+can't be merged."
+  (when (and (assq 'text last) (assq 'text change)
+			 (= (alist-get 'first last) (alist-get 'first change))
+			 (= (alist-get 'delete change) 0)
+			 (= (alist-get 'col change)
+				(+ (alist-get 'col last) (string-bytes (alist-get 'text last)))))
+	(setf (alist-get 'text last) (concat (alist-get 'text last) (alist-get 'text change)))
+	t))
+
+(defun cesp--queue-change(change)
+  "Queues CHANGE of the current buffer.
+Queued changes are sent together as one update_content per buffer
+after `cesp-batch-delay' seconds."
+  (let* ((path (buffer-name))
+		 (queued (assoc path cesp--queued-changes)))
+	(if (not queued)
+		(push (list path change) cesp--queued-changes)
+	  (unless (cesp--merge-change (cadr queued) change)
+		;; Newest first, reversed when sent
+		(setcdr queued (cons change (cdr queued))))))
+  (unless cesp--send-timer
+	(setq cesp--send-timer (run-with-timer cesp-batch-delay nil #'cesp--send-queued))))
+
+(defun cesp--send-queued()
+  "Sends queued changes, one update_content per buffer."
+  (setq cesp--send-timer nil)
+  (let ((queued (nreverse cesp--queued-changes)))
+	(setq cesp--queued-changes nil)
+	(when (and cesp-server-process (process-live-p cesp-server-process))
+	  (dolist (entry queued)
+		(let ((changes (reverse (cdr entry))))
+		  (cesp--send `((event . "update_content") (path . ,(car entry))
+						(changes . ,(if (cdr changes)
+										(vconcat changes)
+									  (car changes))))))))))
+
+(remove-hook 'before-change-functions 'cesp--save-old-text)
+(add-hook 'before-change-functions 'cesp--save-old-text)
 (remove-hook 'after-change-functions 'cesp--send-update)
 (add-hook 'after-change-functions 'cesp--send-update)
   
 ;;;; Handlers
 
 (defun cesp--filter(proc msg)
-  "Main function which parses Cesp input.
+  "Main function which receives Cesp input.
 This function recieves all of the date recieved
-by the tcp connection, and calls other functions,
-as appropriate."
-  (message "STRING: %s :STRING"  msg)
-  ;; Split by newlines since sometimes multiple messages
-  ;; come at once :shrug: Maybe TODO message buffer?
-  (dolist (string (split-string msg "
-" t) ) ;; Newline regex :DDDD
-	(message "MESSAGE: %s" string)
-	;; Event handling
-	(let* ((json (json-parse-string string
-									:object-type 'alist
-									:array-type 'list))
-		   (event (cdr (assoc 'event json))))
-	  (message (concat "Event is: " event))
-	  (cond
-	   ((string= "response_files" event)
-		;; TODO: Check if already open, and if so, just update
-		(cesp--open-file-manager (cdr (assoc 'files json)) )
-		)
-	   ((string= "response_file" event)
-		(cesp--open-remote-file
-		 (cdr (assoc 'path json))
-		 (cdr (assoc 'content json))))
-	   ((string= "update_content" event)
-		(cesp--update-content
-		 (cdr (assoc 'path json))
-		 (cdr (assoc 'changes json))))
-	   ((string= "cursor_move" event)
-		(cesp--render-cursor
-		 (cdr (assoc 'from_id json))
-		 (cdr (assoc 'position json))
-		 (cdr (assoc 'path json))
-		 (cdr (assoc 'name json))))
-	   ((string= "handshake_response" event)
-		(or (and (cdr (assoc 'is_host json))
-				 (setq cesp-is-host t))
-			(setq cesp-is-host nil)))
-	   ))))
+by the tcp connection. It only appends MSG to the input
+buffer, messages are parsed and handled by `cesp--process-input'
+when Emacs is idle, so large payloads don't block redisplay."
+  (with-current-buffer (get-buffer-create cesp--input-buffer)
+	(goto-char (point-max))
+	;; Not an edit to send
+	(let ((inhibit-modification-hooks t))
+	  (insert msg)))
+  (unless cesp--input-timer
+	(setq cesp--input-timer (run-with-idle-timer 0 nil #'cesp--process-input))))
+
+(defun cesp--process-input()
+  "Parses and handles complete messages from the input buffer.
+At most `cesp-messages-per-tick' messages are handled at a time,
+the rest are left for the next idle timer."
+  (setq cesp--input-timer nil)
+  (let ((messages nil)
+		(count 0))
+	(with-current-buffer (get-buffer-create cesp--input-buffer)
+	  (goto-char (point-min))
+	  ;; Messages are newline delimited, parse them in place
+	  (while (and (< count cesp-messages-per-tick)
+				  (search-forward "\n" nil t))
+		(let ((end (point)))
+		  (goto-char (point-min))
+		  (skip-chars-forward " \t\r\n" end)
+		  (when (< (point) end)
+			(condition-case nil
+				(push (json-parse-buffer :object-type 'plist
+										 :array-type 'list
+										 :null-object nil
+										 :false-object nil)
+					  messages)
+			  (json-error nil)))
+		  ;; Handled text is dropped, only partial messages stay
+		  (let ((inhibit-modification-hooks t))
+			(delete-region (point-min) end))
+		  (setq count (1+ count))))
+	  (goto-char (point-min))
+	  ;; More complete messages for the next tick
+	  (when (search-forward "\n" nil t)
+		(setq cesp--input-timer (run-with-idle-timer 0 nil #'cesp--process-input))))
+	(dolist (json (nreverse messages))
+	  (cesp--handle-message json))))
+
+(defun cesp--handle-message(json)
+  "Calls the handler of the event in JSON, a plist."
+  (let ((event (plist-get json :event)))
+	(cond
+	 ((equal "response_files" event)
+	  ;; TODO: Check if already open, and if so, just update
+	  (cesp--open-file-manager (plist-get json :files)))
+	 ((equal "response_file" event)
+	  (cesp--open-remote-file
+	   (plist-get json :path)
+	   (plist-get json :content)
+	   (plist-get json :offset)))
+	 ((equal "update_content" event)
+	  (let ((changes (plist-get json :changes)))
+		;; One change, or a list of sequential ones
+		(dolist (change (if (keywordp (car changes)) (list changes) changes))
+		  (cesp--update-content (plist-get json :path) change))))
+	 ((equal "cursor_move" event)
+	  (cesp--render-cursor
+	   (plist-get json :from_id)
+	   (plist-get json :position)
+	   (plist-get json :path)
+	   (plist-get json :name)))
+	 ((equal "handshake_response" event)
+	  (setq cesp-is-host (and (plist-get json :is_host) t))))))
 
 (defun cesp--sentinel(proc msg)
   "Sentinel function which handless statues changes in connection."
@@ -239,18 +402,29 @@ FILES should be a list of file paths (strings)."
 	  )))
 
 
-(defun cesp--open-remote-file(path content)
+(defun cesp--open-remote-file(path content &optional offset)
   "Handler functon which opens a buffer with CONTENT.
 This will create a buffer with the Cesp minor mode
 instantiated, which means the buffers contents are
 synchronized across the Cesp server.
 
+Large files arrive in parts, OFFSET is where CONTENT
+starts in the file. Part with zero or no OFFSET starts
+the file over, others are appended.
+
 If the buffer already exists, this will refresh the
 contents."
   (switch-to-buffer (get-buffer-create path))
-  ;; Replace everything
-  (kill-region (point-min) (point-max))
-  (insert content))
+  ;; Content comes from the host, it isn't sent back
+  (let ((inhibit-modification-hooks t))
+	(if (and offset (> offset 0))
+		(save-excursion
+		  (goto-char (point-max))
+		  (insert content))
+	  ;; Replace everything
+	  (kill-region (point-min) (point-max))
+	  (insert content)))
+  (setq cesp--shared t))
 
 (defun cesp--render-cursor(id position buffer name)
   "Renders cursor ID at POSITION in BUFFER.
@@ -279,22 +453,38 @@ buffer."
 If the specified buffer is not currently open, then
 the changes are not applied.
 
-CHANGES is a alist with the changes specified as such:
+CHANGES is a plist with the changes specified as such:
 - first: First line (with 0 as the first line)
 - old_last: Last line I guess?
-- lines: List of lines the lines as they are now"
+- lines: List of lines the lines as they are now
+
+Text changes have col, delete and text instead of old_last and lines:
+DELETE bytes at byte COL of line FIRST are replaced with TEXT."
   (if (equal (buffer-name) path) ;; If correct buffer
-	  (save-excursion ;; THIS ENTIRE BLOCK IS SUBJECT TO OPTIMIZATION
-		(let ((beg (cdr (assoc 'first changes)) )
-			  (end (cdr (assoc 'old_last changes)) )
-			  (lines (cdr (assoc 'lines changes)) ))
-		  ;; Goto first line
-		  (goto-char (point-min))
-		  (forward-line beg)
-		  ;; Replace lines iteratively
-		  (kill-line  (- end beg) )
-		  (dolist (line lines)
-			(insert (concat line "\n")))))))
+	  ;; Remote edits aren't sent back
+	  (let ((inhibit-modification-hooks t))
+		(if (plist-member changes :text)
+			(save-excursion
+			  (goto-char (point-min))
+			  (forward-line (plist-get changes :first))
+			  (let* ((bol (position-bytes (point)))
+					 (eol (position-bytes (line-end-position)))
+					 (beg (min (+ bol (plist-get changes :col)) eol))
+					 (end (min (+ beg (plist-get changes :delete)) eol)))
+				(delete-region (byte-to-position beg) (byte-to-position end))
+				(goto-char (byte-to-position beg))
+				(insert (plist-get changes :text))))
+		  (save-excursion ;; THIS ENTIRE BLOCK IS SUBJECT TO OPTIMIZATION
+			(let ((beg (plist-get changes :first) )
+				  (end (plist-get changes :old_last) )
+				  (lines (plist-get changes :lines) ))
+			  ;; Goto first line
+			  (goto-char (point-min))
+			  (forward-line beg)
+			  ;; Replace lines iteratively
+			  (kill-line  (- end beg) )
+			  (dolist (line lines)
+				(insert (concat line "\n")))))))))
 
 ;;; _
 (provide 'cesp)
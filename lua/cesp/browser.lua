@@ -87,48 +87,94 @@ function M.open_file_browser(files, on_select)
 	end
 end
 
-function M.open_remote_file(path, content, on_complete)
+-- Files that are still being received, path -> { buf, written, partial }
+local incoming = {}
+
+-- Finds buffer for remote file or creates one
+local function get_remote_buf(path)
 	local utils = require("cesp.utils")
+	local target_rel_path = path
 
-	vim.schedule(function()
-		local target_rel_path = path
+	-- Search for existing buffers
+	local buf = utils.find_buffer_by_rel_path(path)
+	if buf then
+		return buf
+	end
 
-		-- Search for existing buffers
-		local buf = utils.find_buffer_by_rel_path(path)
+	-- If not found, create one
+	buf = vim.api.nvim_create_buf(true, true)
+	pcall(vim.api.nvim_buf_set_name, buf, target_rel_path)
 
-		-- If not found, create one
-		if not buf then
-			buf = vim.api.nvim_create_buf(true, true)
-			pcall(vim.api.nvim_buf_set_name, buf, target_rel_path)
+	vim.bo[buf].buftype = "acwrite"
+	vim.bo[buf].swapfile = false
+	vim.bo[buf].bufhidden = "hide"
 
-			vim.bo[buf].buftype = "acwrite"
-			vim.bo[buf].swapfile = false
-			vim.bo[buf].bufhidden = "hide"
+	local ft = vim.filetype.match({ filename = target_rel_path })
+	if ft then
+		vim.bo[buf].filetype = ft
+	end
 
-			local ft = vim.filetype.match({ filename = target_rel_path })
-			if ft then
-				vim.bo[buf].filetype = ft
-			end
+	-- This needs to be a acwrite buf to listen for write events
+	-- but it should never complain about not written files
+	-- TODO: Get rid of this nasty piece of code
+	vim.api.nvim_create_autocmd({ "TextChanged", "TextChangedI" }, {
+		buffer = buf,
+		callback = function()
+			vim.bo[buf].modified = false
+		end,
+	})
+
+	-- TODO: Try to forcibly attach lsp to the buffer
+	return buf
+end
+
+-- Fills remote file's buffer with one part of its content. Part with offset
+-- 0 (or nil) starts the file over, on_complete is called after the part
+-- without opts.more
+function M.open_remote_file(path, content, opts, on_complete)
+	vim.schedule(function()
+		local file = incoming[path]
+		if not file or not opts.offset or opts.offset == 0 then
+			file = { buf = get_remote_buf(path), written = 0, partial = "" }
+			incoming[path] = file
+			vim.api.nvim_set_current_buf(file.buf)
+		end
 
-			-- This needs to be a acwrite buf to listen for write events
-			-- but it should never complain about not written files
-			-- TODO: Get rid of this nasty piece of code
-			vim.api.nvim_create_autocmd({ "TextChanged", "TextChangedI" }, {
-				buffer = buf,
-				callback = function()
-					vim.bo[buf].modified = false
-				end,
-			})
-
-			-- TODO: Try to forcibly attach lsp to the buffer
+		if not vim.api.nvim_buf_is_valid(file.buf) then
+			incoming[path] = nil
+			return
 		end
 
-		local lines = vim.split(content, "\n", { plain = true })
-		vim.api.nvim_buf_set_lines(buf, 0, -1, false, lines)
-		vim.api.nvim_set_current_buf(buf)
+		-- Only complete lines are written, rest waits for the next part
+		local lines =
+			vim.split(file.partial .. content, "\n", { plain = true })
+		file.partial = opts.more and table.remove(lines) or ""
+
+		-- A buffer fetched again is already attached, this isn't a local edit
+		local buffer = require("cesp.buffer")
+		buffer.is_applying = true
+		local ok, err = pcall(
+			vim.api.nvim_buf_set_lines,
+			file.buf,
+			file.written,
+			-1,
+			false,
+			lines
+		)
+		buffer.is_applying = false
+		if not ok then
+			print("Error filling remote file: " .. tostring(err))
+			return
+		end
+		file.written = file.written + #lines
+
+		if opts.more then
+			return
+		end
 
+		incoming[path] = nil
 		if on_complete then
-			on_complete(buf)
+			on_complete(file.buf)
 		end
 	end)
 end
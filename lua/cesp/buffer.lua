@@ -4,39 +4,122 @@ local M = {}
 M.attached = {}
 -- True if buffer changes are happening
 M.is_applying = false
--- List of pending changes from other clients on non-open buffers
+-- Changes from other clients on non-open buffers, path -> { buf, size }.
+-- They are applied to a hidden scratch buffer as they arrive, so the pending
+-- content is always ready and takes only as much memory as the file
 M.pending = {}
-
+-- Bytes of all pending content
+M.pending_size = 0
+-- Paths whose pending content was dropped for max_pending_size, path ->
+-- true. Their content is unknown until the file is handed to us again, so
+-- edits to them are ignored and they aren't served
+M.dropped = {}
+
+local trace = require("cesp.trace")
 local utils = require("cesp.utils")
 
--- Applies a single change object to a buffer
-function M.apply_change(buf, change)
+-- Applies a single change object to a buffer without sending it. Stamps of
+-- a traced update are recorded after it
+function M.apply_change(buf, change, stamps)
 	if not vim.api.nvim_buf_is_valid(buf) then
 		return
 	end
 
 	M.is_applying = true
-	local ok, err = pcall(
-		vim.api.nvim_buf_set_lines,
-		buf,
-		change.first,
-		change.old_last,
-		false,
-		change.lines
-	)
+	local ok, err = pcall(utils.apply_change, buf, change)
 	M.is_applying = false
 
 	if not ok then
 		print("Error applying change: " .. tostring(err))
+	elseif stamps then
+		trace.applied("update", stamps)
 	end
 end
 
--- Adds changes to pending
+-- Creates pending content of path in a hidden scratch buffer
+local function new_pending(path, content)
+	local buf = vim.api.nvim_create_buf(false, true)
+	vim.bo[buf].undolevels = -1
+	vim.api.nvim_buf_set_lines(
+		buf,
+		0,
+		-1,
+		false,
+		vim.split(content, "\n", { plain = true })
+	)
+	local pending = { buf = buf, size = 0 }
+	M.pending[path] = pending
+	return pending
+end
+
+-- Returns the largest pending path other than path, or path if it's the
+-- only one
+local function largest_pending(path)
+	local largest = nil
+	for other, pending in pairs(M.pending) do
+		if
+			other ~= path
+			and (not largest or pending.size > M.pending[largest].size)
+		then
+			largest = other
+		end
+	end
+	return largest or path
+end
+
+-- Counts size of pending content of path, and drops the largest pending
+-- files while all pending content is too large
+local function update_size(path, pending)
+	local lines = vim.api.nvim_buf_line_count(pending.buf)
+	local size = vim.api.nvim_buf_get_offset(pending.buf, lines)
+	M.pending_size = M.pending_size + size - pending.size
+	pending.size = size
+
+	local max = require("cesp.config").config.max_pending_size
+	while max and M.pending_size > max and next(M.pending) do
+		-- Others still have the changes, they're only lost from disk. Server
+		-- serves the file from its cache instead of us
+		local dropped = largest_pending(path)
+		M.drop_pending(dropped)
+		M.dropped[dropped] = true
+		require("cesp.ot").reset(dropped)
+		print("Too many pending changes, dropped the ones to " .. dropped)
+	end
+end
+
+-- Applies change to pending content of path, starting from disk
 function M.add_pending(path, change)
-	if not M.pending[path] then
-		M.pending[path] = {}
+	if M.dropped[path] then
+		return
+	end
+	local pending = M.pending[path]
+	if not pending then
+		local content = utils.read_file(utils.get_abs_path(path)) or ""
+		pending = new_pending(path, content)
+	end
+
+	pcall(utils.apply_change, pending.buf, change)
+	update_size(path, pending)
+end
+
+-- Replaces pending content of path, for files handed over from the server
+function M.set_pending(path, content)
+	M.drop_pending(path)
+	M.dropped[path] = nil
+	update_size(path, new_pending(path, content))
+end
+
+-- Forgets pending content of path
+function M.drop_pending(path)
+	local pending = M.pending[path]
+	if not pending then
+		return
+	end
+	M.pending[path] = nil
+	M.pending_size = M.pending_size - pending.size
+	if vim.api.nvim_buf_is_valid(pending.buf) then
+		vim.api.nvim_buf_delete(pending.buf, { force = true })
 	end
-	table.insert(M.pending[path], change)
 end
 
 -- Opens diff between disk and pending content
@@ -134,7 +217,7 @@ function M.review_pending()
 			-- Apply (write to disk)
 			local final_content = utils.get_file_content(path, M.pending[path])
 			utils.write_file(path, final_content)
-			M.pending[path] = nil
+			M.drop_pending(path)
 
 			-- Also update the loaded buffer if it exists, otherwise neovim
 			-- will complain that the file changed on disk :D
@@ -157,7 +240,7 @@ function M.review_pending()
 				"\n"
 			)
 
-			M.pending[path] = nil
+			M.drop_pending(path)
 
 			-- Get the truth from disk
 			-- TODO: Make this a utility
@@ -173,15 +256,10 @@ function M.review_pending()
 					vim.api.nvim_buf_set_lines(bufnr, 0, -1, false, disk_lines)
 				end
 
-				local events = require("cesp.events")
-				events.send_event({
-					event = "update_content",
-					path = path,
-					changes = {
-						first = 0,
-						old_last = remote_line_count,
-						lines = disk_lines,
-					},
+				require("cesp.ot").local_change(path, {
+					first = 0,
+					old_last = remote_line_count,
+					lines = disk_lines,
 				})
 				print("Discarded changes for " .. path)
 			end
@@ -220,19 +298,22 @@ function M.attach_buf_listener(buf, on_change)
 	-- Check for pending changes and apply them before attaching listener
 	-- This brings the buffer up to date with the server
 	if M.pending[path] then
-		local changes = M.pending[path]
-		-- Applies change one by one
-		-- This is little inefficient, but neovim can take care of
-		-- it very fast so it rarely becomes a bottleneck
-		for _, change in ipairs(changes) do
-			M.apply_change(buf, change)
-		end
-		M.pending[path] = nil
+		local lines =
+			vim.api.nvim_buf_get_lines(M.pending[path].buf, 0, -1, false)
+		M.apply_change(buf, { first = 0, old_last = -1, lines = lines })
+		M.drop_pending(path)
 		print("Applied pending changes for " .. path)
 	end
 
-	vim.api.nvim_buf_attach(buf, false, {
-		on_lines = function(_, _, _, first, old_last, new_last)
+	local config = require("cesp.config").config
+	local callbacks = {
+		on_detach = function()
+			M.attached[buf] = nil
+		end,
+	}
+
+	if config.delta == "lines" then
+		callbacks.on_lines = function(_, _, _, first, old_last, new_last)
 			-- Prevent echoing back changes we just applied from the server
 			if M.is_applying then
 				return
@@ -248,11 +329,61 @@ function M.attach_buf_listener(buf, on_change)
 				-- Content in between
 				lines = lines,
 			})
-		end,
-		on_detach = function()
-			M.attached[buf] = nil
-		end,
-	})
+		end
+	else
+		-- Extents are relative to start, end columns are byte counts when
+		-- change stays on one row
+		callbacks.on_bytes = function(
+			_,
+			_,
+			_,
+			start_row,
+			start_col,
+			_,
+			old_end_row,
+			old_end_col,
+			_,
+			new_end_row,
+			new_end_col
+		)
+			if M.is_applying then
+				return
+			end
+
+			if old_end_row == 0 and new_end_row == 0 then
+				-- Only the typed bytes are sent
+				local text = vim.api.nvim_buf_get_text(
+					buf,
+					start_row,
+					start_col,
+					start_row,
+					start_col + new_end_col,
+					{}
+				)
+				on_change(path, {
+					first = start_row,
+					col = start_col,
+					delete = old_end_col,
+					text = text[1] or "",
+				})
+				return
+			end
+
+			-- Changes across lines are sent as the lines they touched
+			on_change(path, {
+				first = start_row,
+				old_last = start_row + old_end_row + 1,
+				lines = vim.api.nvim_buf_get_lines(
+					buf,
+					start_row,
+					start_row + new_end_row + 1,
+					false
+				),
+			})
+		end
+	end
+
+	vim.api.nvim_buf_attach(buf, false, callbacks)
 	M.attached[buf] = true
 end
 
@@ -0,0 +1,64 @@
+-- zlib compression for length-prefixed frames, through LuaJIT's ffi. If
+-- ffi or libz is missing compression is just not negotiated
+local M = {}
+
+local ok_ffi, ffi = pcall(require, "ffi")
+local zlib = nil
+
+if ok_ffi then
+	-- cdef fails if something else has already declared these
+	pcall(
+		ffi.cdef,
+		[[
+		unsigned long compressBound(unsigned long sourceLen);
+		int compress2(uint8_t *dest, unsigned long *destLen,
+			const uint8_t *source, unsigned long sourceLen, int level);
+		int uncompress(uint8_t *dest, unsigned long *destLen,
+			const uint8_t *source, unsigned long sourceLen);
+	]]
+	)
+
+	for _, name in ipairs({ "z", "libz.so.1" }) do
+		local ok, lib = pcall(ffi.load, name)
+		if ok then
+			zlib = lib
+			break
+		end
+	end
+end
+
+-- Smaller messages (like cursors) are not worth compressing
+M.min_size = 1024
+
+function M.available()
+	return zlib ~= nil
+end
+
+-- Returns zlib stream of str, or nil if it didn't get any smaller
+function M.compress(str)
+	local bound = zlib.compressBound(#str)
+	local dest = ffi.new("uint8_t[?]", bound)
+	local dest_len = ffi.new("unsigned long[1]", bound)
+	-- Level 1, text compresses well even with the fastest level
+	if zlib.compress2(dest, dest_len, str, #str, 1) ~= 0 then
+		return nil
+	end
+
+	local n = tonumber(dest_len[0])
+	if n >= #str then
+		return nil
+	end
+	return ffi.string(dest, n)
+end
+
+-- Inflates zlib stream data to its known size
+function M.decompress(data, size)
+	local dest = ffi.new("uint8_t[?]", math.max(size, 1))
+	local dest_len = ffi.new("unsigned long[1]", size)
+	if zlib.uncompress(dest, dest_len, data, #data) ~= 0 then
+		return nil
+	end
+	return ffi.string(dest, tonumber(dest_len[0]))
+end
+
+return M
@@ -4,10 +4,49 @@ local M = {}
 M.config = {
 	port = 8080,
 	name = "lentava_pomeranian",
+	-- Session to join on the server, nil joins the default one
+	room = nil,
+	-- "length" uses length-prefixed frames after handshake, nil keeps
+	-- newline-delimited json
+	framing = "length",
+	-- "zlib" compresses large frames if libz is found, nil disables
+	compression = "zlib",
+	-- "resync" asks server to drop messages instead of disconnecting if they
+	-- come faster than we read them, then open files are requested again
+	overflow = "resync",
+	-- Take over as host if the host leaves. Server hands over the files it
+	-- has cached, others keep editing without getting them again
+	standby = false,
+	-- Times to try joining again after losing connection, 0 disables. Open
+	-- files are resumed from their versions, so only missed edits are sent
+	reconnect_attempts = 5,
+	-- Ms before the first attempt, doubled for every next one
+	reconnect_delay = 500,
+	-- "text" sends edits inside a line as the changed bytes, "lines" sends
+	-- whole lines like older clients
+	delta = "text",
+	-- Ms to collect changes before sending them in one update_content, 0
+	-- sends every change right away
+	batch_delay = 10,
+	-- Max bytes of pending content of unopened files (host only)
+	max_pending_size = 64 * 1024 * 1024,
+	-- Max directories watched for the file index where watchers aren't
+	-- recursive (Linux)
+	max_watchers = 256,
+	-- Adds timestamps to edits and cursor moves for :CespTrace latency
+	-- percentiles. Every client has to enable it, and machines' clocks
+	-- should be synced
+	trace = false,
+	-- Files in one response_files part
+	files_page_size = 5000,
+	-- Max bytes of file content in one response_file part
+	file_chunk_size = 64 * 1024,
 	-- TODO: Make more editable
 	cursor = {
 		pos = "eol",
 		hl_group = "Cursor",
+		-- Ms to collect remote cursor moves before drawing them together
+		redraw_delay = 16,
 	},
 }
 
@@ -1,4 +1,5 @@
 local events = require("cesp.events")
+local trace = require("cesp.trace")
 local utils = require("cesp.utils")
 
 local M = {}
@@ -15,11 +16,29 @@ local function safe_del_mark(buf, id)
 	end
 end
 
+-- Buffer each remote cursor is drawn in, from_id -> buf
+local drawn = {}
+-- Latest cursor_move of each user waiting to be drawn, from_id -> payload
+local queued = {}
+local redraw_scheduled = false
+
+-- Removes user's cursor from the buffer it's drawn in
+local function erase(from_id)
+	local buf = drawn[from_id]
+	if buf then
+		safe_del_mark(buf, from_id + 1)
+		safe_del_mark(buf, from_id + RANGE_OFFSET)
+		drawn[from_id] = nil
+	end
+end
+
 -- Clears all cursors
 function M.clear_all_remote_cursors()
 	for _, buf in ipairs(vim.api.nvim_list_bufs()) do
 		vim.api.nvim_buf_clear_namespace(buf, CURSOR_NS, 0, -1)
 	end
+	drawn = {}
+	queued = {}
 end
 
 function M.handle_cursor_leave(payload)
@@ -27,18 +46,13 @@ function M.handle_cursor_leave(payload)
 		return
 	end
 
-	-- Extmarks are 0-indexed and nvim requires them to be positive
-	local cursor_id = payload.from_id + 1
-	local select_id = payload.from_id + RANGE_OFFSET
-
-	-- Clear this user's cursor from all buffers
-	for _, buf in ipairs(vim.api.nvim_list_bufs()) do
-		safe_del_mark(buf, cursor_id)
-		safe_del_mark(buf, select_id)
-	end
+	queued[payload.from_id] = nil
+	erase(payload.from_id)
 end
 
 function M.start_cursor_tracker()
+	-- Started again when reconnecting
+	vim.api.nvim_clear_autocmds({ group = CURSOR_GROUP })
 	vim.api.nvim_create_autocmd({ "CursorMoved", "CursorMovedI", "BufEnter" }, {
 		group = CURSOR_GROUP,
 		callback = function()
@@ -69,7 +83,7 @@ function M.start_cursor_tracker()
 				}
 			end
 
-			events.send_event(payload)
+			events.send_event(trace.stamp(payload))
 		end,
 	})
 
@@ -83,11 +97,8 @@ function M.start_cursor_tracker()
 	})
 end
 
-function M.handle_cursor_move(payload)
-	if not payload.from_id or not payload.path then
-		return
-	end
-
+-- Draws cursor, only touching the buffer it was in and the one it's in now
+local function draw(payload)
 	-- Extmarks are 0-indexed and nvim requires them to be positive
 	local cursor_id = payload.from_id + 1
 	local select_id = payload.from_id + RANGE_OFFSET
@@ -98,69 +109,84 @@ function M.handle_cursor_move(payload)
 	local name = payload.name or "???"
 
 	-- Find the specific buffer this cursor belongs to
-	local target_buf = utils.find_buffer_by_rel_path(payload.path)
+	local buf = utils.find_buffer_by_rel_path(payload.path)
 	local config = require("cesp.config").config
 
-	-- Iterate all buffers to ensure we clear ghosts from previous files
-	-- while updating the correct file
-	for _, buf in ipairs(vim.api.nvim_list_bufs()) do
-		if vim.api.nvim_buf_is_valid(buf) then
-			-- If this is not the target buffer, remove the cursor (client likely switched files)
-			if buf ~= target_buf then
-				safe_del_mark(buf, cursor_id)
-				safe_del_mark(buf, select_id)
-			else
-				-- Draw regular cursor
-				local cursor_opts = {
-					id = cursor_id,
-					hl_group = "TermCursor",
-					virt_text = { { " " .. name, config.cursor.hl_group } },
-					virt_text_pos = config.cursor.pos,
-					end_row = row,
-					end_col = col + 1,
-					strict = false,
-				}
-				pcall(
-					vim.api.nvim_buf_set_extmark,
-					buf,
-					CURSOR_NS,
-					row,
-					col,
-					cursor_opts
-				)
-
-				-- Draw visual election (if exists)
-				if payload.selection then
-					local s_row = payload.selection.start_pos[1]
-					local s_col = payload.selection.start_pos[2]
-
-					-- Swap, start must be before end
-					local r1, c1, r2, c2 = row, col, s_row, s_col
-					if r1 > r2 or (r1 == r2 and c1 > c2) then
-						r1, c1, r2, c2 = r2, c2, r1, c1
-					end
-
-					local sel_opts = {
-						id = select_id,
-						hl_group = "Visual",
-						end_row = r2,
-						end_col = c2 + 1,
-						strict = false,
-					}
-					pcall(
-						vim.api.nvim_buf_set_extmark,
-						buf,
-						CURSOR_NS,
-						r1,
-						c1,
-						sel_opts
-					)
-				else
-					-- If no selection make sure to clear any old selection
-					safe_del_mark(buf, select_id)
-				end
-			end
+	-- Client likely switched files, remove the ghost from the previous one
+	if drawn[payload.from_id] ~= buf then
+		erase(payload.from_id)
+	end
+	if not buf then
+		return
+	end
+	drawn[payload.from_id] = buf
+
+	-- Draw regular cursor
+	local cursor_opts = {
+		id = cursor_id,
+		hl_group = "TermCursor",
+		virt_text = { { " " .. name, config.cursor.hl_group } },
+		virt_text_pos = config.cursor.pos,
+		end_row = row,
+		end_col = col + 1,
+		strict = false,
+	}
+	pcall(vim.api.nvim_buf_set_extmark, buf, CURSOR_NS, row, col, cursor_opts)
+
+	-- Draw visual election (if exists)
+	if payload.selection then
+		local s_row = payload.selection.start_pos[1]
+		local s_col = payload.selection.start_pos[2]
+
+		-- Swap, start must be before end
+		local r1, c1, r2, c2 = row, col, s_row, s_col
+		if r1 > r2 or (r1 == r2 and c1 > c2) then
+			r1, c1, r2, c2 = r2, c2, r1, c1
 		end
+
+		local sel_opts = {
+			id = select_id,
+			hl_group = "Visual",
+			end_row = r2,
+			end_col = c2 + 1,
+			strict = false,
+		}
+		pcall(vim.api.nvim_buf_set_extmark, buf, CURSOR_NS, r1, c1, sel_opts)
+	else
+		-- If no selection make sure to clear any old selection
+		safe_del_mark(buf, select_id)
+	end
+
+	trace.applied("cursor", payload.trace)
+end
+
+local function redraw()
+	redraw_scheduled = false
+	local moves = queued
+	queued = {}
+	for _, payload in pairs(moves) do
+		draw(payload)
+	end
+end
+
+-- Queues cursor to be drawn. Cursors that move within redraw_delay ms are
+-- drawn together, at their latest position
+function M.handle_cursor_move(payload)
+	if not payload.from_id or not payload.path or not payload.position then
+		return
+	end
+
+	queued[payload.from_id] = payload
+	if redraw_scheduled then
+		return
+	end
+	redraw_scheduled = true
+
+	local delay = require("cesp.config").config.cursor.redraw_delay or 0
+	if delay > 0 then
+		vim.defer_fn(redraw, delay)
+	else
+		vim.schedule(redraw)
 	end
 end
 
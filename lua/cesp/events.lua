@@ -1,5 +1,8 @@
 local browser = require("cesp.browser")
 local buffer = require("cesp.buffer")
+local compress = require("cesp.compress")
+local ot = require("cesp.ot")
+local trace = require("cesp.trace")
 local utils = require("cesp.utils")
 
 local M = {}
@@ -7,6 +10,14 @@ local M = {}
 M.state = {}
 -- Are writes from client allowed (scary)
 M.allow_remote_write = false
+-- Files being requested, path -> update_content events received meanwhile
+M.requested = {}
+-- Pages of response_files received so far
+M.received_files = {}
+-- Parts of handoff_files received so far, path -> list of contents
+M.handoff = {}
+-- Set while joining again after losing connection
+M.resuming = false
 
 -- Sends event to the server
 function M.send_event(event_table)
@@ -14,17 +25,138 @@ function M.send_event(event_table)
 
 	-- Don't try to write to non-existing handle/pipe
 	if not network.handle or network.handle:is_closing() then
-		print("Unable to send the event, maybe join?")
+		-- Changes are sent again after reconnecting
+		if not network.reconnecting then
+			print("Unable to send the event, maybe join?")
+		end
 		return
 	end
 
 	local event_str = utils.encode_json(event_table)
-	if event_str then
+	if not event_str then
+		return
+	end
+
+	if M.state.framing == "length" then
+		-- Kind byte (0 json, 1 compressed json) and big-endian payload length
+		local kind, payload = 0, event_str
+		if
+			M.state.compression == "zlib"
+			and #event_str >= compress.min_size
+		then
+			local compressed = compress.compress(event_str)
+			if compressed then
+				-- Compressed payload starts with the uncompressed length
+				kind = 1
+				payload = utils.encode_uint32(#event_str) .. compressed
+			end
+		end
+		network.handle:write({
+			string.char(kind) .. utils.encode_uint32(#payload),
+			payload,
+		})
+	else
 		-- Server uses \n as delimeter
 		network.handle:write(event_str .. "\n")
 	end
 end
 
+-- Returns path -> version of our files for resuming, nil if there are none.
+-- Files still being received are requested again instead
+function M.resume_versions()
+	local versions = nil
+	for path, doc in pairs(ot.docs) do
+		if not M.requested[path] then
+			versions = versions or {}
+			versions[path] = doc.version
+		end
+	end
+	return versions
+end
+
+-- Requests file from host, changes to it are queued until it has arrived
+function M.request_file(path)
+	M.requested[path] = {}
+	require("cesp.viewport").requested(path)
+	M.send_event({
+		event = "request_file",
+		path = path,
+	})
+end
+
+-- Applies update_content event to the file's buffer, or to pending if it
+-- isn't loaded
+function M.apply_update(payload)
+	local path = payload.path
+	local changes = payload.changes
+	if not path or type(changes) ~= "table" then
+		return
+	end
+	-- One change or a list of sequential ones
+	if changes.first then
+		changes = { changes }
+	end
+	-- Content we had was dropped, edits would go to the wrong lines
+	if buffer.dropped[path] then
+		return
+	end
+	-- Events without version come from clients that don't track them
+	if payload.version then
+		changes = ot.remote_changes(path, payload.version, changes)
+	end
+
+	local bufnr = utils.find_buffer_by_rel_path(path)
+	local is_loaded = bufnr
+		and vim.api.nvim_buf_is_valid(bufnr)
+		and vim.api.nvim_buf_is_loaded(bufnr)
+
+	-- Apply directly if loaded, add to pending if not. Traced event is
+	-- recorded once its last change is applied
+	for i, change in ipairs(changes) do
+		if is_loaded then
+			buffer.apply_change(
+				bufnr,
+				change,
+				i == #changes and payload.trace or nil
+			)
+		elseif
+			buffer.pending[path]
+			or (M.state.is_host and not M.state.adopted)
+		then
+			-- Adopted host only has the files it was handed, and gets edits
+			-- of them before new_host while the rest are handed over
+			buffer.add_pending(path, change)
+		end
+	end
+end
+
+-- Compares loaded buffer to checkpoint hash of the server, and asks for the
+-- lines that differ if it doesn't match. Only makes sense when the buffer
+-- has nothing that server hasn't seen
+function M.check_hash(path, hash)
+	local bufnr = utils.find_buffer_by_rel_path(path)
+	if
+		not hash
+		or not bufnr
+		or not vim.api.nvim_buf_is_loaded(bufnr)
+		or not ot.is_idle(path)
+		or utils.get_buf_sha256(bufnr) == hash
+	then
+		return
+	end
+
+	local lines = vim.api.nvim_buf_get_lines(bufnr, 0, -1, false)
+	local head, tail = utils.get_block_hashes(lines)
+	M.send_event({
+		event = "sync_file",
+		path = path,
+		version = ot.get(path).version,
+		lines = #lines,
+		head = head,
+		tail = tail,
+	})
+end
+
 -- Handles every event received from server
 function M.handle_event(json_str)
 	local cursor = require("cesp.cursor")
@@ -48,8 +180,25 @@ function M.handle_event(json_str)
 			id = payload.id,
 			name = payload.name,
 			is_host = payload.is_host,
+			-- Server agreed to length-prefixed frames
+			framing = payload.framing,
+			compression = payload.compression,
 		}
 
+		if M.resuming then
+			M.resuming = false
+			-- Missed edits and acks came before this, so changes that are
+			-- still unacknowledged never reached the server
+			for path in pairs(ot.docs) do
+				ot.resend(path)
+			end
+			for path in pairs(M.requested) do
+				M.request_file(path)
+			end
+			print("Reconnected as " .. M.state.name)
+			return
+		end
+
 		print("Joined as " .. M.state.name)
 		return
 	end
@@ -65,6 +214,10 @@ function M.handle_event(json_str)
 		if payload.host_id == M.state.id then
 			print("You're the new host!")
 			M.state.is_host = true
+			-- Files come from the session, not from our disk
+			M.state.adopted = true
+			-- Server dropped our requests, files it had were handed over
+			M.requested = {}
 		else
 			print(payload.name .. " is the new host!")
 		end
@@ -72,30 +225,78 @@ function M.handle_event(json_str)
 		return
 	end
 
+	-- Cached file of the session, sent in parts before we are made host
+	if payload.event == "handoff_file" then
+		local path = payload.path
+		if not path or type(payload.content) ~= "string" then
+			return
+		end
+		local parts = M.handoff[path] or {}
+		M.handoff[path] = parts
+		table.insert(parts, payload.content)
+		if payload.more then
+			return
+		end
+		M.handoff[path] = nil
+
+		-- Open buffer is ahead of the server with our unacknowledged changes
+		local bufnr = utils.find_buffer_by_rel_path(path)
+		if bufnr and vim.api.nvim_buf_is_loaded(bufnr) then
+			return
+		end
+		buffer.set_pending(path, table.concat(parts))
+		ot.reset(path, payload.version)
+		return
+	end
+
 	-- Received request for filetree
 	if payload.event == "request_files" then
-		local file_list = utils.get_files()
-
-		M.send_event({
-			event = "response_files",
-			files = file_list,
-			request_id = payload.request_id,
-		})
+		-- Adopted host only knows the files of the session
+		if M.state.adopted then
+			local file_list = vim.tbl_keys(ot.docs)
+			table.sort(file_list)
+			M.send_event({
+				event = "response_files",
+				files = file_list,
+				request_id = payload.request_id,
+			})
+			return
+		end
+		-- Answered from the file index, in pages so that large projects fit
+		-- in the message limit. Every page but the last has more = true
+		require("cesp.files").get(function(file_list)
+			local config = require("cesp.config").config
+			local size = config.files_page_size
+			local pages = math.max(math.ceil(#file_list / size), 1)
+			for page = 1, pages do
+				M.send_event({
+					event = "response_files",
+					files = vim.list_slice(
+						file_list,
+						(page - 1) * size + 1,
+						page * size
+					),
+					more = page < pages or nil,
+					request_id = payload.request_id,
+				})
+			end
+		end)
 		return
 	end
 
-	-- Received response with filetree
+	-- Received response with filetree, possibly in pages
 	if payload.event == "response_files" then
+		vim.list_extend(M.received_files, payload.files or {})
+		if payload.more then
+			return
+		end
+		local file_list = M.received_files
+		M.received_files = {}
+
 		vim.schedule(function()
-			if payload.files and #payload.files > 0 then
+			if #file_list > 0 then
 				-- If files in response open explorer with them
-				browser.open_file_browser(payload.files, function(path)
-					-- On select request for selected file
-					M.send_event({
-						event = "request_file",
-						path = path,
-					})
-				end)
+				browser.open_file_browser(file_list, M.request_file)
 			else
 				print("No files received")
 			end
@@ -105,25 +306,49 @@ function M.handle_event(json_str)
 
 	-- Received request for spesific file contents
 	if payload.event == "request_file" then
-		-- Get content from open buffer, if no open buffer then pending, and if no
-		-- pending then disk
-		local buffer_util = require("cesp.buffer")
-		local content = utils.get_file_content(
-			payload.path,
-			buffer_util.pending[payload.path]
-		)
-
-		-- Don't send an empty file
-		if not content then
+		if M.state.adopted and not ot.docs[payload.path] then
 			return
 		end
+		-- Disk doesn't have the changes we dropped, server's cache (or an
+		-- error) answers instead
+		if buffer.dropped[payload.path] then
+			return
+		end
+		-- Content has to match the version, so wait until the server has
+		-- sequenced our own changes
+		ot.when_idle(payload.path, function()
+			-- Get content from open buffer, if no open buffer then pending, and if no
+			-- pending then disk
+			local buffer_util = require("cesp.buffer")
+			local content = utils.get_file_content(
+				payload.path,
+				buffer_util.pending[payload.path]
+			)
+
+			-- Don't send an empty file
+			if not content then
+				return
+			end
 
-		M.send_event({
-			event = "response_file",
-			path = payload.path,
-			content = content,
-			request_id = payload.request_id,
-		})
+			-- Stream the file in parts, so that large files fit in the server's
+			-- message limit. Every part but the last has more = true
+			local config = require("cesp.config").config
+			local parts = utils.split_content(content, config.file_chunk_size)
+			local offset = 0
+			local version = ot.get(payload.path).version
+			for i, part in ipairs(parts) do
+				M.send_event({
+					event = "response_file",
+					path = payload.path,
+					content = part,
+					offset = offset,
+					more = i < #parts or nil,
+					version = version,
+					request_id = payload.request_id,
+				})
+				offset = offset + #part
+			end
+		end)
 		return
 	end
 
@@ -135,17 +360,31 @@ function M.handle_event(json_str)
 		-- Should not be possible, but never can be too safe :D
 		if not content then
 			print("No content from " .. path)
+			content = ""
 		end
 
-		-- Opens an empty buffer that mimics real file buffer
-		browser.open_remote_file(path, content, function(buf)
+		-- Opens an empty buffer that mimics real file buffer, and fills it
+		-- part by part. Listeners are attached after the last part
+		local opts = { offset = payload.offset, more = payload.more }
+		browser.open_remote_file(path, content, opts, function(buf)
+			-- Content is at payload.version, changes made after it were queued
+			local queued = M.requested[path] or {}
+			M.requested[path] = nil
+			ot.reset(path, payload.version)
+			for _, update in ipairs(queued) do
+				if (update.version or 0) > (payload.version or 0) then
+					-- Waited for the file, its latency isn't the edit's
+					update.trace = nil
+					M.apply_update(update)
+				end
+			end
+
+			-- Narrow the subscription to what's shown
+			require("cesp.viewport").schedule()
+
 			-- Attach listeners to it
 			buffer.attach_buf_listener(buf, function(p, c)
-				M.send_event({
-					event = "update_content",
-					path = p,
-					changes = c,
-				})
+				ot.local_change(p, c)
 			end)
 
 			vim.api.nvim_create_autocmd("BufWriteCmd", {
@@ -164,24 +403,74 @@ function M.handle_event(json_str)
 	end
 
 	if payload.event == "update_content" then
-		local path = payload.path
-		local changes = payload.changes
+		-- File is still being received, apply after it
+		if M.requested[payload.path] then
+			table.insert(M.requested[payload.path], payload)
+			return
+		end
+		-- Applied right away, in order with update_ack
+		M.apply_update(payload)
+		M.check_hash(payload.path, payload.hash)
+		return
+	end
 
-		vim.schedule(function()
-			local bufnr = utils.find_buffer_by_rel_path(path)
-			local is_loaded = bufnr
-				and vim.api.nvim_buf_is_valid(bufnr)
-				and vim.api.nvim_buf_is_loaded(bufnr)
-
-			-- Apply directly if loaded, add to pending if not
-			if is_loaded then
-				buffer.apply_change(bufnr, changes)
-			elseif M.state.is_host then
-				buffer.add_pending(path, changes)
+	-- Server sequenced our changes
+	if payload.event == "update_ack" then
+		trace.acked(payload.trace)
+		ot.ack(payload.path, payload.version)
+		M.check_hash(payload.path, payload.hash)
+		return
+	end
+
+	-- Lines that differed from the server at a checkpoint
+	if payload.event == "sync_content" then
+		local bufnr = utils.find_buffer_by_rel_path(payload.path)
+		-- Change is against the content we hashed, later edits moved it
+		if
+			not bufnr
+			or not vim.api.nvim_buf_is_loaded(bufnr)
+			or not ot.is_idle(payload.path)
+			or ot.get(payload.path).version ~= payload.version
+			or type(payload.changes) ~= "table"
+		then
+			return
+		end
+		buffer.apply_change(bufnr, payload.changes)
+		print("Resynced " .. payload.path)
+		return
+	end
+
+	-- Server dropped messages we couldn't keep up with, get files again
+	if payload.event == "resync" then
+		if M.state.is_host then
+			return
+		end
+		local paths = vim.tbl_keys(M.requested)
+		for path in pairs(ot.docs) do
+			if not M.requested[path] then
+				table.insert(paths, path)
 			end
-		end)
+		end
+		for _, path in ipairs(paths) do
+			ot.reset(path)
+			M.request_file(path)
+		end
+		print("Missed changes, requesting " .. #paths .. " files again")
 		return
 	end
+
+	-- Server didn't have our version anymore, start over from its version
+	if payload.event == "update_reject" then
+		ot.reset(payload.path, payload.version)
+		if M.state.is_host then
+			print("Changes to " .. payload.path .. " were rejected")
+		else
+			print("Out of sync, requesting " .. payload.path .. " again")
+			M.request_file(payload.path)
+		end
+		return
+	end
+
 	-- Event that contains client's cursor positions
 	if payload.event == "cursor_move" then
 		vim.schedule(function()
@@ -252,7 +541,12 @@ function M.handle_event(json_str)
 			end)
 
 			-- Clear pending as they are now committed via the write
-			buffer_util.pending[path] = nil
+			buffer_util.drop_pending(path)
+		elseif buffer_util.dropped[path] then
+			-- Disk and pending don't have the latest content
+			print(
+				"Not writing " .. path .. ", its pending changes were dropped"
+			)
 		else
 			-- Buffer is not open
 			local content =
@@ -261,7 +555,7 @@ function M.handle_event(json_str)
 			if content then
 				-- Standard write
 				utils.write_file(path, content)
-				buffer_util.pending[path] = nil
+				buffer_util.drop_pending(path)
 
 				print(requestor_name .. " wrote to " .. path)
 			else
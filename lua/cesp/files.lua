@@ -0,0 +1,336 @@
+-- Index of the project's files for response_files. Built once in the
+-- background and kept up to date with file system events, so requests are
+-- answered from memory
+local uv = vim.uv or vim.loop
+
+local utils = require("cesp.utils")
+
+local M = {}
+
+-- rel path -> true
+local files = {}
+-- Sorted list of files, nil after changes
+local sorted = nil
+-- Callbacks waiting for the first build
+local waiting = {}
+local ready = false
+local building = false
+local watchers = {}
+-- Root the index was built for
+local root = nil
+-- True if files come from git, which knows what is ignored
+local use_git = false
+-- Bumped by stop(), callbacks of older builds do nothing
+local generation = 0
+-- True if the root watcher sees the whole tree
+local recursive_watch = false
+-- Changed paths waiting to be checked
+local changed = {}
+local refresh_scheduled = false
+
+-- Used without git
+-- TODO: Add patterns to config
+local ignore_patterns =
+	{ "%.git", "node_modules", "%.venv", "build", "%.env" }
+
+local function is_ignored(path)
+	-- .git is never listed
+	if path == ".git" or path:sub(1, 5) == ".git/" then
+		return true
+	end
+	if use_git then
+		return false
+	end
+	for _, pattern in ipairs(ignore_patterns) do
+		if path:match(pattern) then
+			return true
+		end
+	end
+	return false
+end
+
+local function add(path)
+	if not files[path] and not is_ignored(path) then
+		files[path] = true
+		sorted = nil
+	end
+end
+
+local function remove(path)
+	if files[path] then
+		files[path] = nil
+		sorted = nil
+	end
+	-- Removed directory takes its files with it
+	local prefix = path .. "/"
+	for file in pairs(files) do
+		if file:sub(1, #prefix) == prefix then
+			files[file] = nil
+			sorted = nil
+		end
+	end
+end
+
+local function finish_build()
+	building = false
+	ready = true
+	local callbacks = waiting
+	waiting = {}
+	for _, fn in ipairs(callbacks) do
+		fn(M.list())
+	end
+end
+
+-- Lists files that git doesn't ignore, calls on_files with them in the main
+-- loop. Nil if git failed
+local function git_files(args, on_files)
+	local cmd = {
+		"git",
+		"ls-files",
+		"-z",
+		"--cached",
+		"--others",
+		"--exclude-standard",
+	}
+	vim.list_extend(cmd, args)
+	local function on_exit(out)
+		vim.schedule(function()
+			if out.code ~= 0 then
+				on_files(nil)
+				return
+			end
+			on_files(
+				vim.split(out.stdout, "\0", { plain = true, trimempty = true })
+			)
+		end)
+	end
+	local ok = pcall(vim.system, cmd, { cwd = root, text = true }, on_exit)
+	if not ok then
+		on_files(nil)
+	end
+end
+
+-- Walks directory dir (relative, "" for root) without blocking, one
+-- directory per loop iteration. on_done is called after all of them
+local function scan(dir, on_done)
+	local gen = generation
+	local stack = { dir }
+	local function step()
+		if gen ~= generation then
+			return
+		end
+		local current = table.remove(stack)
+		if not current then
+			on_done()
+			return
+		end
+		uv.fs_scandir(vim.fs.joinpath(root, current), function(err, scanner)
+			vim.schedule(function()
+				if not err and scanner then
+					for name, type in
+						function()
+							return uv.fs_scandir_next(scanner)
+						end
+					do
+						local path = current == "" and name
+							or current .. "/" .. name
+						if not is_ignored(path) then
+							if type == "directory" then
+								table.insert(stack, path)
+							elseif type == "file" then
+								add(path)
+							end
+						end
+					end
+				end
+				step()
+			end)
+		end)
+	end
+	step()
+end
+
+local watch
+
+-- Checks changed path and updates the index with it
+local function refresh(path)
+	if path == "" or is_ignored(path) then
+		return
+	end
+	local gen = generation
+	local function add_all(list)
+		if gen == generation then
+			for _, file in ipairs(list or {}) do
+				add(file)
+			end
+		end
+	end
+	uv.fs_stat(vim.fs.joinpath(root, path), function(err, stat)
+		vim.schedule(function()
+			if gen ~= generation then
+				return
+			end
+			if err or not stat then
+				remove(path)
+			elseif stat.type == "file" then
+				if not use_git then
+					add(path)
+					return
+				end
+				-- Only if git doesn't ignore it
+				git_files({ "--", path }, add_all)
+			elseif stat.type == "directory" then
+				if not recursive_watch then
+					watch(path, false)
+				end
+				if use_git then
+					git_files({ "--", path }, add_all)
+				else
+					scan(path, function() end)
+				end
+			end
+		end)
+	end)
+end
+
+-- Watches dir (relative) for changes. On systems without recursive
+-- watchers every directory gets its own, up to max_watchers
+function watch(dir, recursive)
+	local max = require("cesp.config").config.max_watchers or 0
+	if #watchers >= max then
+		return false
+	end
+	local handle = uv.new_fs_event()
+	if not handle then
+		return false
+	end
+	local ok = handle:start(
+		vim.fs.joinpath(root, dir),
+		{ recursive = recursive },
+		function(err, filename)
+			if err or not filename then
+				return
+			end
+			local path = dir == "" and filename or dir .. "/" .. filename
+			vim.schedule(function()
+				-- Saving a file makes a burst of events, check them together
+				changed[path] = true
+				if refresh_scheduled then
+					return
+				end
+				refresh_scheduled = true
+				vim.defer_fn(function()
+					refresh_scheduled = false
+					local paths = changed
+					changed = {}
+					for p in pairs(paths) do
+						refresh(p)
+					end
+				end, 100)
+			end)
+		end
+	)
+	if not ok then
+		handle:close()
+		return false
+	end
+	table.insert(watchers, handle)
+	return true
+end
+
+local function start_watching()
+	local recursive = vim.fn.has("mac") == 1 or vim.fn.has("win32") == 1
+	if recursive and watch("", true) then
+		recursive_watch = true
+		return
+	end
+	-- Watchers only see their own directory's entries
+	watch("", false)
+	local dirs = {}
+	for file in pairs(files) do
+		local dir = vim.fs.dirname(file)
+		while dir and dir ~= "." and dir ~= "" and not dirs[dir] do
+			dirs[dir] = true
+			dir = vim.fs.dirname(dir)
+		end
+	end
+	for dir in pairs(dirs) do
+		if not watch(dir, false) then
+			return
+		end
+	end
+end
+
+local function build()
+	building = true
+	root = vim.fs.normalize(utils.get_project_root())
+	use_git = uv.fs_stat(vim.fs.joinpath(root, ".git")) ~= nil
+
+	local gen = generation
+	local function done()
+		start_watching()
+		finish_build()
+	end
+
+	if use_git then
+		git_files({}, function(list)
+			if gen ~= generation then
+				return
+			elseif not list then
+				-- No git after all, walk the tree
+				use_git = false
+				scan("", done)
+				return
+			end
+			for _, file in ipairs(list) do
+				add(file)
+			end
+			done()
+		end)
+	else
+		scan("", done)
+	end
+end
+
+-- Returns sorted list of indexed files
+function M.list()
+	if not sorted then
+		sorted = vim.tbl_keys(files)
+		table.sort(sorted)
+	end
+	return sorted
+end
+
+-- Calls on_files with the file list, right away if the index is built
+function M.get(on_files)
+	if ready then
+		on_files(M.list())
+		return
+	end
+	table.insert(waiting, on_files)
+	if not building then
+		build()
+	end
+end
+
+-- Stops watching and forgets the index
+function M.stop()
+	for _, handle in ipairs(watchers) do
+		if not handle:is_closing() then
+			handle:stop()
+			handle:close()
+		end
+	end
+	watchers = {}
+	files = {}
+	sorted = nil
+	waiting = {}
+	ready = false
+	building = false
+	root = nil
+	recursive_watch = false
+	changed = {}
+	generation = generation + 1
+end
+
+return M
@@ -2,6 +2,7 @@ local browser = require("cesp.browser")
 local buffer = require("cesp.buffer")
 local events = require("cesp.events")
 local network = require("cesp.network")
+local trace = require("cesp.trace")
 
 local M = {}
 
@@ -65,6 +66,19 @@ function M.setup(opts)
 		buffer.review_pending()
 	end, {})
 
+	vim.api.nvim_create_user_command("CespTrace", function(args)
+		if args.args == "reset" then
+			trace.reset()
+			return
+		end
+		print(table.concat(trace.report(), "\n"))
+	end, {
+		nargs = "?",
+		complete = function()
+			return { "reset" }
+		end,
+	})
+
 	vim.api.nvim_create_autocmd("VimLeavePre", {
 		callback = function()
 			network.stop()
@@ -1,50 +1,146 @@
 local uv = vim.uv or vim.loop
 local cursor = require("cesp.cursor")
+local compress = require("cesp.compress")
 local events = require("cesp.events")
+local utils = require("cesp.utils")
+local viewport = require("cesp.viewport")
 
 local M = {}
 M.handle = nil
+-- { ip, is_host } of the session, kept for reconnecting until we leave
+M.target = nil
+-- Set while waiting to reconnect
+M.reconnecting = false
+-- Random id server uses to tell our edits apart when we resume
+M.session = vim.fn.sha256(tostring(uv.hrtime()) .. tostring(math.random()))
+	:sub(1, 32)
 
--- Reads incoming stream
-local function on_read()
+local reconnect
+
+-- Reads incoming stream, messages are either newline-delimited json or
+-- length-prefixed frames (first byte is 0 or 1 for compressed, json never
+-- starts with either)
+local function on_read(handle)
 	local chunks = {}
+	local size = 0
+	-- Bytes needed for the rest of a frame, nil when waiting for a newline
+	local need = nil
 
 	return function(err, chunk)
-		-- On error/disconnect clear cursors and close gracefully
+		-- On error/disconnect clear cursors, close and try again
 		if err or not chunk then
-			vim.schedule(cursor.clear_all_remote_cursors)
-			return M.handle:close()
+			if M.handle == handle then
+				M.handle = nil
+			end
+			if not handle:is_closing() then
+				handle:close()
+			end
+			vim.schedule(function()
+				cursor.clear_all_remote_cursors()
+				-- Next handshake negotiates them again
+				events.state.framing = nil
+				events.state.compression = nil
+				if M.target and not M.handle then
+					print("Lost connection, reconnecting...")
+					reconnect(1)
+				end
+			end)
+			return
 		end
 
 		table.insert(chunks, chunk)
+		size = size + #chunk
+		-- Frame header starts after the previous message
+		if not need and chunks[1]:byte(1) <= 1 then
+			need = 5
+		end
 
-		-- Only process if we see a newline (the end of at least one message)
-		if chunk:find("\n") then
-			local raw_data = table.concat(chunks)
-			chunks = {}
+		-- Only process once at least one message is complete, so partial
+		-- frames aren't joined again on every chunk
+		if need then
+			if size < need then
+				return
+			end
+		elseif not chunk:find("\n", 1, true) then
+			return
+		end
 
-			-- Split data into lines
-			local lines = vim.split(raw_data, "\n", { plain = true })
+		local data = table.concat(chunks)
+		local pos = 1
+		need = nil
 
-			-- Handle Fragmentation
-			local leftover = table.remove(lines)
-			if leftover ~= "" then
-				table.insert(chunks, leftover)
+		while pos <= #data do
+			local msg
+			local kind = data:byte(pos)
+			if kind <= 1 then
+				local left = #data - pos + 1
+				if left < 5 then
+					need = 5
+					break
+				end
+				local length = utils.decode_uint32(data, pos + 1)
+				if left < 5 + length then
+					need = 5 + length
+					break
+				end
+				msg = data:sub(pos + 5, pos + 4 + length)
+				pos = pos + 5 + length
+				if kind == 1 then
+					msg = compress.decompress(
+						msg:sub(5),
+						utils.decode_uint32(msg, 1)
+					) or ""
+				end
+			else
+				local nl = data:find("\n", pos, true)
+				-- Handle Fragmentation
+				if not nl then
+					break
+				end
+				msg = data:sub(pos, nl - 1)
+				pos = nl + 1
 			end
 
 			-- Handle events
-			for _, line in ipairs(lines) do
-				if line ~= "" then
-					vim.schedule(function()
-						events.handle_event(line)
-					end)
-				end
+			if msg ~= "" then
+				vim.schedule(function()
+					events.handle_event(msg)
+				end)
 			end
 		end
+
+		local leftover = data:sub(pos)
+		chunks = {}
+		size = #leftover
+		if leftover ~= "" then
+			table.insert(chunks, leftover)
+		end
 	end
 end
 
-function M.start_client(ip, is_host)
+-- Tries to join again after attempt-1 failed attempts, with versions of our
+-- files so that server only sends the edits we missed
+reconnect = function(attempt)
+	local config = require("cesp.config").config
+	local target = M.target
+	if attempt > (config.reconnect_attempts or 0) then
+		print("Unable to reconnect")
+		M.stop()
+		return
+	end
+	M.reconnecting = true
+	local delay = (config.reconnect_delay or 0) * 2 ^ (attempt - 1)
+	vim.defer_fn(function()
+		-- Left or joined again meanwhile
+		if M.target ~= target or M.handle then
+			return
+		end
+		M.start_client(target.ip, target.is_host, attempt)
+	end, delay)
+end
+
+-- Joins server at ip. attempt is set when reconnecting
+function M.start_client(ip, is_host, attempt)
 	if M.handle then
 		if not M.handle:is_closing() then
 			print("Already connected, try again") -- :katti:
@@ -55,21 +151,45 @@ function M.start_client(ip, is_host)
 		end
 	end
 
-	M.handle = uv.new_tcp()
+	local handle = uv.new_tcp()
+	M.handle = handle
+	M.target = { ip = ip, is_host = is_host }
 
 	local config = require("cesp.config").config
-	M.handle:connect(ip, config.port, function(err)
+	handle:connect(ip, config.port, function(err)
 		if err then
-			print(err)
-			M.handle = nil
+			handle:close()
+			if M.handle == handle then
+				M.handle = nil
+			end
+			if attempt then
+				vim.schedule(function()
+					reconnect(attempt + 1)
+				end)
+			else
+				M.target = nil
+				print(err)
+			end
 			return
 		end
 
+		M.reconnecting = false
+		local resume = attempt and events.resume_versions() or nil
+		events.resuming = attempt ~= nil
 		-- Do the required handshake (required by host)
 		events.send_event({
 			event = "handshake",
 			name = config.name,
 			host = is_host,
+			room = config.room,
+			framing = config.framing,
+			compression = compress.available() and config.compression or nil,
+			overflow = config.overflow,
+			standby = not is_host and config.standby or nil,
+			-- Only files we have open are sent to us
+			subscriptions = true,
+			session = M.session,
+			resume = resume,
 		})
 
 		-- TODO: add handshake response, so we know "this" client's id and other details
@@ -77,29 +197,35 @@ function M.start_client(ip, is_host)
 		vim.schedule(function()
 			-- Attach cursor tracker
 			cursor.start_cursor_tracker()
+			-- Server subscribed us to the files we resumed
+			viewport.stop()
+			for path in pairs(resume or {}) do
+				viewport.requested(path)
+			end
+			viewport.start()
 
 			-- Share buf on open
 			vim.api.nvim_create_autocmd("BufReadPost", {
+				group = vim.api.nvim_create_augroup("CespShare", {}),
 				callback = function(e)
 					local buffer = require("cesp.buffer")
-					buffer.attach_buf_listener(e.buf, function(path, changes)
-						events.send_event({
-							event = "update_content",
-							path = path,
-							changes = changes,
-						})
+					-- Changes are versioned and sent by ot
+					buffer.attach_buf_listener(e.buf, function(path, change)
+						require("cesp.ot").local_change(path, change)
 					end)
 				end,
 			})
 		end)
 
 		-- Start reading
-		M.handle:read_start(on_read())
+		handle:read_start(on_read(handle))
 	end)
 end
 
 -- Cleans up connections and cursors
 function M.stop()
+	M.target = nil
+	M.reconnecting = false
 	if M.handle then
 		events.send_event({ event = "cursor_leave" })
 
@@ -111,9 +237,24 @@ function M.stop()
 
 	vim.schedule(function()
 		cursor.clear_all_remote_cursors()
+		viewport.stop()
 		-- Reset client state
 		events.state.is_host = false
+		events.state.adopted = nil
 		events.state.client_id = nil
+		events.state.framing = nil
+		events.state.compression = nil
+		-- Versions belong to the session
+		require("cesp.ot").docs = {}
+		require("cesp.buffer").dropped = {}
+		events.requested = {}
+		events.received_files = {}
+		events.handoff = {}
+		events.resuming = false
+		pcall(vim.api.nvim_del_augroup_by_name, "CespShare")
+		require("cesp.files").stop()
+		-- Next session may have another root
+		utils.reset_index()
 	end)
 
 	print("Closed connection")
@@ -0,0 +1,462 @@
+-- Client side of server-sequenced operational transforms, same as
+-- server/ot.go. Every file has a version. Local changes are sent with the
+-- version they are based on, one batch at a time, and edits made while
+-- waiting for update_ack are buffered. Remote changes are transformed over
+-- our unacknowledged ones before applying them
+local trace = require("cesp.trace")
+
+local M = {}
+
+-- path -> { version, inflight (list of ops or nil), buffer, idle, timer,
+-- origin (when the first buffered change was made, only when tracing) }
+M.docs = {}
+
+-- Operations are runs of { retain = n }, { delete = n }, { insert = lines }
+-- or { edit = text operation } of one line. Text operations are the same
+-- runs on bytes of the line, with a string as insert. Lines (or bytes) after
+-- the last run are retained
+local function retain(op, n)
+	if n <= 0 then
+		return
+	end
+	local last = op[#op]
+	if last and last.retain then
+		last.retain = last.retain + n
+	else
+		table.insert(op, { retain = n })
+	end
+end
+
+local function delete(op, n)
+	if n <= 0 then
+		return
+	end
+	local last = op[#op]
+	if last and last.delete then
+		last.delete = last.delete + n
+	else
+		table.insert(op, { delete = n })
+	end
+end
+
+local function insert(op, value)
+	if #value == 0 then
+		return
+	end
+	local last = op[#op]
+	-- Inserts go before deletes at the same line
+	if last and last.delete then
+		table.remove(op)
+		insert(op, value)
+		delete(op, last.delete)
+	elseif last and last.insert then
+		if type(value) == "string" then
+			last.insert = last.insert .. value
+		else
+			local merged = vim.list_extend({}, last.insert)
+			last.insert = vim.list_extend(merged, value)
+		end
+	else
+		table.insert(op, { insert = value })
+	end
+end
+
+-- Edit of the next line, edits that only retain are retains
+local function edit(op, text_op)
+	for _, run in ipairs(text_op) do
+		if not run.retain then
+			table.insert(op, { edit = text_op })
+			return
+		end
+	end
+	retain(op, 1)
+end
+
+-- Converts line change { first, old_last, lines } or text change
+-- { first, col, delete, text } to an operation
+function M.from_change(change)
+	local op = {}
+	retain(op, change.first)
+	if change.text then
+		local text_op = {}
+		retain(text_op, change.col or 0)
+		insert(text_op, change.text)
+		delete(text_op, change.delete or 0)
+		edit(op, text_op)
+		return op
+	end
+	insert(op, change.lines or {})
+	delete(op, change.old_last - change.first)
+	return op
+end
+
+-- Appends text operation of line as sequential text changes to out
+local function text_changes(text_op, line, out)
+	local col = 0
+	local pending = nil
+	for _, run in ipairs(text_op) do
+		if run.retain then
+			col = col + run.retain
+			pending = nil
+		else
+			if not pending then
+				pending = { first = line, col = col, delete = 0, text = "" }
+				table.insert(out, pending)
+			end
+			if run.delete then
+				pending.delete = pending.delete + run.delete
+			else
+				pending.text = pending.text .. run.insert
+				col = col + #run.insert
+			end
+		end
+	end
+end
+
+-- Appends operation as sequential changes to out
+function M.to_changes(op, out)
+	local line = 0
+	local pending = nil
+	for _, run in ipairs(op) do
+		if run.retain then
+			line = line + run.retain
+			pending = nil
+		elseif run.edit then
+			text_changes(run.edit, line, out)
+			line = line + 1
+			pending = nil
+		else
+			if not pending then
+				pending = { first = line, old_last = line, lines = {} }
+				table.insert(out, pending)
+			end
+			if run.delete then
+				pending.old_last = pending.old_last + run.delete
+			else
+				vim.list_extend(pending.lines, run.insert)
+				line = line + #run.insert
+			end
+		end
+	end
+	return out
+end
+
+local function copy_run(run)
+	return run
+		and {
+			retain = run.retain,
+			delete = run.delete,
+			insert = run.insert,
+			edit = run.edit,
+		}
+end
+
+-- Walks runs of an operation, run is nil when it has ended
+local function reader(op)
+	local r = { i = 1 }
+	function r.next()
+		-- Copy, take() changes it
+		r.run = copy_run(op[r.i])
+		r.i = r.i + 1
+	end
+	function r.left()
+		if r.run.edit then
+			return 1
+		end
+		return r.run.retain or r.run.delete
+	end
+	function r.take(n)
+		if r.run.edit then
+			r.next()
+			return
+		end
+		if r.run.retain then
+			r.run.retain = r.run.retain - n
+		else
+			r.run.delete = r.run.delete - n
+		end
+		if r.left() == 0 then
+			r.next()
+		end
+	end
+	function r.rest(out)
+		local runs = { r.run }
+		for i = r.i, #op do
+			table.insert(runs, op[i])
+		end
+		for _, run in ipairs(runs) do
+			retain(out, run.retain or 0)
+			if run.insert then
+				insert(out, run.insert)
+			end
+			delete(out, run.delete or 0)
+			if run.edit then
+				edit(out, run.edit)
+			end
+		end
+		return out
+	end
+	r.next()
+	return r
+end
+
+-- Transforms operations a and b made on the same version, returns a' to
+-- apply after b and b' to apply after a. a was sequenced first, so its
+-- inserts go first. Works for line and text operations alike
+function M.transform(a, b)
+	local a2, b2 = {}, {}
+	local ra, rb = reader(a), reader(b)
+
+	while ra.run or rb.run do
+		if ra.run and ra.run.insert then
+			insert(a2, ra.run.insert)
+			retain(b2, #ra.run.insert)
+			ra.next()
+		elseif rb.run and rb.run.insert then
+			retain(a2, #rb.run.insert)
+			insert(b2, rb.run.insert)
+			rb.next()
+		elseif not ra.run then
+			-- Lines after the last run are retained
+			return a2, rb.rest(b2)
+		elseif not rb.run then
+			return ra.rest(a2), b2
+		else
+			local n = math.min(ra.left(), rb.left())
+			local ea, eb = ra.run.edit, rb.run.edit
+			if ea and eb then
+				local ea2, eb2 = M.transform(ea, eb)
+				edit(a2, ea2)
+				edit(b2, eb2)
+			elseif ea and rb.run.retain then
+				edit(a2, ea)
+				retain(b2, 1)
+			elseif eb and ra.run.retain then
+				retain(a2, 1)
+				edit(b2, eb)
+			elseif ea then
+				-- Edit of a deleted line is dropped
+				delete(b2, 1)
+			elseif eb then
+				delete(a2, 1)
+			elseif ra.run.retain and rb.run.retain then
+				retain(a2, n)
+				retain(b2, n)
+			elseif ra.run.delete and rb.run.retain then
+				delete(a2, n)
+			elseif ra.run.retain and rb.run.delete then
+				delete(b2, n)
+			end
+			-- Lines deleted by both are already gone
+			ra.take(n)
+			rb.take(n)
+		end
+	end
+	return a2, b2
+end
+
+function M.get(path)
+	if not M.docs[path] then
+		M.reset(path, 0)
+	end
+	return M.docs[path]
+end
+
+-- Starts the file over at version, like after opening it
+function M.reset(path, version)
+	M.docs[path] = { version = version or 0, buffer = {}, idle = {} }
+end
+
+-- Merges change b made right after a into a, if they touch the same range.
+-- Returns false if they don't
+local function merge(a, b)
+	local lines = not a.text and not b.text
+	if not lines and not (a.text and b.text and a.first == b.first) then
+		return false
+	end
+
+	-- Range is lines for line changes and bytes of the line for text ones
+	local start, old_stop, new = a.first, a.old_last, a.lines
+	local b_start, b_stop, b_new = b.first, b.old_last, b.lines
+	if not lines then
+		start, old_stop, new = a.col, a.col + a.delete, a.text
+		b_start, b_stop, b_new = b.col, b.col + b.delete, b.text
+	end
+	-- Range of a after it was made
+	local stop = start + #new
+	if b_start > stop or b_stop < start then
+		return false
+	end
+
+	-- b replaced part of a's new content and maybe some around it
+	local function sub(from, to)
+		if to < from then
+			return lines and {} or ""
+		elseif lines then
+			return vim.list_slice(new, from, to)
+		end
+		return new:sub(from, to)
+	end
+	local head = sub(1, b_start - start)
+	local tail = sub(b_stop - start + 1, #new)
+	local old_start = math.min(start, b_start)
+	old_stop = old_stop + math.max(b_stop - stop, 0)
+
+	if lines then
+		a.first, a.old_last = old_start, old_stop
+		a.lines = vim.list_extend(vim.list_extend(head, b_new), tail)
+	else
+		a.col, a.delete = old_start, old_stop - old_start
+		a.text = head .. b_new .. tail
+	end
+	return true
+end
+
+local function send(path, doc)
+	local changes = {}
+	for _, op in ipairs(doc.buffer) do
+		for _, change in ipairs(M.to_changes(op, {})) do
+			if #changes == 0 or not merge(changes[#changes], change) then
+				table.insert(changes, change)
+			end
+		end
+	end
+
+	-- Inflight operations are what the server gets, so both transform the
+	-- same ones
+	doc.inflight = {}
+	for _, change in ipairs(changes) do
+		table.insert(doc.inflight, M.from_change(change))
+	end
+	doc.buffer = {}
+	local origin = doc.origin
+	doc.origin = nil
+
+	local events = require("cesp.events")
+	events.send_event(trace.stamp({
+		event = "update_content",
+		path = path,
+		version = doc.version,
+		-- One change is sent as is, so simple clients keep working
+		changes = #changes == 1 and changes[1] or changes,
+	}, origin))
+end
+
+-- Sends buffered changes unless previous ones are still unacknowledged
+local function flush(path)
+	local doc = M.get(path)
+	doc.timer = nil
+	if not doc.inflight and #doc.buffer > 0 then
+		send(path, doc)
+	end
+end
+
+-- Buffers local change. Changes are sent together after batch_delay ms, or
+-- when previous ones are acknowledged
+function M.local_change(path, change)
+	local doc = M.get(path)
+	local op = M.from_change(change)
+	if #op == 0 or (#op == 1 and op[1].retain) then
+		return
+	end
+	if #doc.buffer == 0 and trace.enabled() then
+		doc.origin = trace.now()
+	end
+	table.insert(doc.buffer, op)
+	if doc.inflight or doc.timer then
+		return
+	end
+
+	local delay = require("cesp.config").config.batch_delay or 0
+	if delay <= 0 then
+		send(path, doc)
+		return
+	end
+	doc.timer = true
+	vim.defer_fn(function()
+		-- File might have been reset meanwhile
+		if M.docs[path] == doc then
+			flush(path)
+		end
+	end, delay)
+end
+
+-- Sends unacknowledged changes again, with the ones buffered after them,
+-- after reconnecting. They are already transformed to our version
+function M.resend(path)
+	local doc = M.docs[path]
+	if not doc or not doc.inflight then
+		return
+	end
+	local ops = {}
+	for _, op in ipairs(doc.inflight) do
+		if #op > 0 and not (#op == 1 and op[1].retain) then
+			table.insert(ops, op)
+		end
+	end
+	doc.buffer = vim.list_extend(ops, doc.buffer)
+	-- Like an ack of nothing, sends the buffer or runs idle callbacks
+	M.ack(path, doc.version)
+end
+
+-- Server sequenced our changes
+function M.ack(path, version)
+	local doc = M.get(path)
+	doc.version = version
+	doc.inflight = nil
+
+	if #doc.buffer > 0 then
+		-- They already waited for a round trip
+		send(path, doc)
+		return
+	end
+
+	local idle = doc.idle
+	doc.idle = {}
+	for _, fn in ipairs(idle) do
+		fn()
+	end
+end
+
+-- Transforms remote over our pending operations, which are transformed
+-- to come after it
+local function transform_over(op, pending)
+	for i, p in ipairs(pending) do
+		op, pending[i] = M.transform(op, p)
+	end
+	return op
+end
+
+-- Returns remote changes (that made version) as changes to apply locally
+function M.remote_changes(path, version, changes)
+	local doc = M.get(path)
+	local out = {}
+	for _, change in ipairs(changes) do
+		local op = M.from_change(change)
+		if doc.inflight then
+			op = transform_over(op, doc.inflight)
+		end
+		op = transform_over(op, doc.buffer)
+		M.to_changes(op, out)
+	end
+	doc.version = version
+	return out
+end
+
+-- True if server has acknowledged all of our changes
+function M.is_idle(path)
+	local doc = M.get(path)
+	return not doc.inflight and #doc.buffer == 0
+end
+
+-- Calls fn once there are no unacknowledged changes
+function M.when_idle(path, fn)
+	local doc = M.get(path)
+	if doc.inflight or #doc.buffer > 0 then
+		table.insert(doc.idle, fn)
+	else
+		fn()
+	end
+end
+
+return M
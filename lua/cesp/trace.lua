@@ -0,0 +1,120 @@
+-- Latency tracing of edits and cursor moves, enabled with config.trace.
+-- Traced events carry Unix ms timestamps: origin (when the edit or move was
+-- made) and sent from the editor, received and forwarded from the server.
+-- Receivers record when they applied them. Parts measured across machines
+-- are only as exact as their clocks are synced
+local uv = vim.uv or vim.loop
+
+local M = {}
+
+-- Latest samples kept of each measurement
+local max_samples = 1000
+-- name -> { values, next }
+local samples = {}
+
+function M.now()
+	local sec, usec = uv.gettimeofday()
+	return sec * 1000 + usec / 1000
+end
+
+function M.enabled()
+	return require("cesp.config").config.trace == true
+end
+
+local function add(name, value)
+	local ring = samples[name]
+	if not ring then
+		ring = { values = {}, next = 1 }
+		samples[name] = ring
+	end
+	ring.values[ring.next] = value
+	ring.next = ring.next % max_samples + 1
+end
+
+-- Adds trace to outgoing payload if tracing is on. Origin defaults to now
+function M.stamp(payload, origin)
+	if M.enabled() then
+		local now = M.now()
+		payload.trace = { origin = origin or now, sent = now }
+	end
+	return payload
+end
+
+-- Records latencies of a remote event (kind "update" or "cursor") that was
+-- just applied or drawn
+function M.applied(kind, trace)
+	if type(trace) ~= "table" or not trace.origin or not M.enabled() then
+		return
+	end
+	local now = M.now()
+	add(kind .. " total", now - trace.origin)
+	if trace.sent and trace.received and trace.forwarded then
+		add(kind .. " batching", trace.sent - trace.origin)
+		add(kind .. " to server", trace.received - trace.sent)
+		add(kind .. " server", trace.forwarded - trace.received)
+		add(kind .. " to editor", now - trace.forwarded)
+	end
+end
+
+-- Records round trip of our own edit from its update_ack. Only our clock is
+-- used, so it doesn't depend on clocks being synced
+function M.acked(trace)
+	if type(trace) ~= "table" or not trace.sent or not M.enabled() then
+		return
+	end
+	local rtt = M.now() - trace.sent
+	add("ack round trip", rtt)
+	if trace.received and trace.forwarded then
+		add("ack network", rtt - (trace.forwarded - trace.received))
+	end
+end
+
+local function percentile(sorted, p)
+	local i = math.max(math.ceil(#sorted * p), 1)
+	return sorted[i]
+end
+
+-- Returns report lines of latency percentiles
+function M.report()
+	local names = vim.tbl_keys(samples)
+	table.sort(names)
+	if #names == 0 then
+		return { "No traced events, set trace = true on every client" }
+	end
+
+	local lines = {
+		string.format(
+			"%-20s %6s %9s %9s %9s %9s",
+			"ms",
+			"n",
+			"p50",
+			"p90",
+			"p99",
+			"max"
+		),
+	}
+	for _, name in ipairs(names) do
+		local sorted = vim.list_extend({}, samples[name].values)
+		table.sort(sorted)
+		table.insert(
+			lines,
+			string.format(
+				"%-20s %6d %9.2f %9.2f %9.2f %9.2f",
+				name,
+				#sorted,
+				percentile(sorted, 0.5),
+				percentile(sorted, 0.9),
+				percentile(sorted, 0.99),
+				sorted[#sorted]
+			)
+		)
+	end
+	return lines
+end
+
+-- Forgets all samples
+function M.reset()
+	samples = {}
+end
+
+return M
@@ -14,71 +14,20 @@ function M.encode_json(ltable)
 	return ok and res or nil
 end
 
--- Get all files recursively and return list of relative paths
--- path/another_path/file.pl
--- Uses depth-first search
-function M.get_files()
-	local root_path = vim.fs.normalize(M.get_project_root())
-	local files = {}
-	-- TODO: Add patterns to config
-	local ignore_patterns =
-		{ "%.git", "node_modules", "%.venv", "build", "%.env" }
-
-	-- List of not looked directories
-	local stack = { root_path }
-
-	local function make_relative(full_path)
-		local rel = full_path:sub(#root_path + 1)
-		if rel:sub(1, 1) == "/" then
-			rel = rel:sub(2)
-		end
-		return rel
-	end
-
-	-- Returns true if file is in ignored patterns
-	local function is_ignored(path)
-		for _, pattern in ipairs(ignore_patterns) do
-			-- TODO?: Fix if too relaxed match
-			if path:match(pattern) then
-				return true
-			end
-		end
-		return false
-	end
-
-	-- TODO: Add max depth
-	while #stack > 0 do
-		-- Pops directory out of the stack
-		local current_dir = table.remove(stack)
-		-- Open the popped directory
-		local scanner = uv.fs_scandir(current_dir)
-
-		-- Iterate the each directory
-		if scanner then
-			for name, type in
-				-- Move to next
-				function()
-					return uv.fs_scandir_next(scanner)
-				end
-			do
-				-- Clean up the path, no ./file.c
-				local full_path = vim.fs.joinpath(current_dir, name)
-
-				-- If file is not on the naughty list check it
-				if not is_ignored(full_path) then
-					-- If dir add it to stack (will be processed later)
-					if type == "directory" then
-						table.insert(stack, full_path)
-					-- If file just add it to final "files"
-					elseif type == "file" then
-						table.insert(files, make_relative(full_path))
-					end
-				end
-			end
-		end
-	end
+-- Encodes n as big-endian uint32 (frame lengths)
+function M.encode_uint32(n)
+	return string.char(
+		math.floor(n / 16777216) % 256,
+		math.floor(n / 65536) % 256,
+		math.floor(n / 256) % 256,
+		n % 256
+	)
+end
 
-	return files
+-- Decodes big-endian uint32 starting at pos
+function M.decode_uint32(data, pos)
+	local b1, b2, b3, b4 = data:byte(pos, pos + 3)
+	return ((b1 * 256 + b2) * 256 + b3) * 256 + b4
 end
 
 -- Reads a file, retuns nil if unable to open or non-exited
@@ -110,19 +59,30 @@ function M.write_file(path, content)
 	fd:close()
 end
 
+-- Project root of the session, found once
+local project_root = nil
+-- Buffer index, rel path -> bufnr and bufnr -> rel path
+local buf_by_path = {}
+local path_by_buf = {}
+local index_started = false
+
 -- Get project root path, .git or cwd
 function M.get_project_root()
+	if project_root then
+		return project_root
+	end
 	-- TODO: Move root markers to config
 	-- TODO: Maybe in checkhealth say what this is using? cwd or root marker
 	local root_markers = { ".git" }
 	local root = vim.fs.root(0, root_markers)
-	return root or vim.uv.cwd()
+	project_root = root or vim.uv.cwd()
+	return project_root
 end
 
 -- Robust check to ensure we don't return partial path matches
-function M.get_rel_path(bufnr)
+local function compute_rel_path(bufnr)
 	-- Try to get full path
-	local full_path = vim.api.nvim_buf_get_name(bufnr or 0)
+	local full_path = vim.api.nvim_buf_get_name(bufnr)
 	if full_path == "" then
 		return nil
 	end
@@ -147,6 +107,68 @@ function M.get_rel_path(bufnr)
 	return nil
 end
 
+local function unindex_buf(bufnr)
+	local path = path_by_buf[bufnr]
+	if path and buf_by_path[path] == bufnr then
+		buf_by_path[path] = nil
+	end
+	path_by_buf[bufnr] = nil
+end
+
+local function index_buf(bufnr)
+	unindex_buf(bufnr)
+	local path = compute_rel_path(bufnr)
+	if path then
+		path_by_buf[bufnr] = path
+		buf_by_path[path] = bufnr
+	end
+end
+
+-- Keeps the path index up to date as buffers are added, renamed and
+-- deleted, so lookups don't go through every buffer
+local function start_index()
+	index_started = true
+	for _, buf in ipairs(vim.api.nvim_list_bufs()) do
+		index_buf(buf)
+	end
+
+	local group = vim.api.nvim_create_augroup("CespBufferIndex", {})
+	vim.api.nvim_create_autocmd({ "BufAdd", "BufFilePost" }, {
+		group = group,
+		callback = function(e)
+			index_buf(e.buf)
+		end,
+	})
+	vim.api.nvim_create_autocmd({ "BufDelete", "BufWipeout" }, {
+		group = group,
+		callback = function(e)
+			unindex_buf(e.buf)
+		end,
+	})
+end
+
+-- Forgets project root and the index, for the next session
+function M.reset_index()
+	project_root = nil
+	buf_by_path = {}
+	path_by_buf = {}
+	if index_started then
+		vim.api.nvim_del_augroup_by_name("CespBufferIndex")
+		index_started = false
+	end
+end
+
+-- Returns buffer's path relative to project root, nil if it's outside
+function M.get_rel_path(bufnr)
+	if not bufnr or bufnr == 0 then
+		bufnr = vim.api.nvim_get_current_buf()
+	end
+	if not index_started then
+		start_index()
+	end
+	return path_by_buf[bufnr]
+end
+
 -- Gets absolute path from project relative path
 -- USE THIS FOR CRITICAL THINGS!
 function M.get_abs_path(path)
@@ -155,64 +177,108 @@ end
 
 -- Find a buffer by its relative path
 function M.find_buffer_by_rel_path(rel_path)
-	for _, buf in ipairs(vim.api.nvim_list_bufs()) do
-		if
-			vim.api.nvim_buf_is_valid(buf)
-			and M.get_rel_path(buf) == rel_path
-		then
-			return buf
-		end
+	if not index_started then
+		start_index()
+	end
+	local buf = buf_by_path[rel_path]
+	if buf and vim.api.nvim_buf_is_valid(buf) then
+		return buf
 	end
 	return nil
 end
 
-function M.get_file_content(path, pending_changes)
-	local abs_path = M.get_abs_path(path)
+-- Applies line change { first, old_last, lines } or text change
+-- { first, col, delete, text } to a buffer
+function M.apply_change(buf, change)
+	if not change.text then
+		vim.api.nvim_buf_set_lines(
+			buf,
+			change.first,
+			change.old_last,
+			false,
+			change.lines
+		)
+		return
+	end
 
-	local lines = {}
-	local bufnr = M.find_buffer_by_rel_path(path)
+	-- Clamped like line changes are
+	local line = vim.api.nvim_buf_get_lines(
+		buf,
+		change.first,
+		change.first + 1,
+		false
+	)[1]
+	if not line then
+		return
+	end
+	local col = math.min(change.col or 0, #line)
+	local last = math.min(col + (change.delete or 0), #line)
+	vim.api.nvim_buf_set_text(
+		buf,
+		change.first,
+		col,
+		change.first,
+		last,
+		{ change.text }
+	)
+end
 
-	-- Get base content
-	if bufnr and vim.api.nvim_buf_is_loaded(bufnr) then
-		lines = vim.api.nvim_buf_get_lines(bufnr, 0, -1, false)
-	else
-		local content = M.read_file(abs_path)
-		if content then
-			lines = vim.split(content, "\n", { trimempty = false })
-		end
+-- Returns content of path: pending content if it has some, otherwise open
+-- buffer's or the file on disk
+function M.get_file_content(path, pending)
+	-- Pending changes are already applied to their scratch buffer
+	if pending and vim.api.nvim_buf_is_valid(pending.buf) then
+		local lines = vim.api.nvim_buf_get_lines(pending.buf, 0, -1, false)
+		return table.concat(lines, "\n")
 	end
 
-	--If no pending changes provided, return base content
-	if not pending_changes or #pending_changes == 0 then
+	local bufnr = M.find_buffer_by_rel_path(path)
+	if bufnr and vim.api.nvim_buf_is_loaded(bufnr) then
+		local lines = vim.api.nvim_buf_get_lines(bufnr, 0, -1, false)
 		return table.concat(lines, "\n")
 	end
 
-	-- Apply pending changes
-	-- Using neovim's own buffers for this to be more safe and...
-	-- BLAZINGLY FAST (optimized c)
+	return M.read_file(M.get_abs_path(path)) or ""
+end
 
-	-- Create temp buf to apply changes to
-	local temp_buf = vim.api.nvim_create_buf(false, true)
-	-- Set base lines (disk)
-	vim.api.nvim_buf_set_lines(temp_buf, 0, -1, false, lines)
+-- Splits content into parts of at most size bytes. Parts end after a newline
+-- when possible and never inside an utf-8 character
+function M.split_content(content, size)
+	local parts = {}
+	local pos = 1
+
+	while pos <= #content do
+		local last = math.min(pos + size - 1, #content)
+		if last < #content then
+			-- Find last newline of the part
+			local cut = last
+			while cut >= pos and content:byte(cut) ~= 10 do
+				cut = cut - 1
+			end
 
-	-- Merge pending changes (reverse to keep indexes right)
-	for i = #pending_changes, 1, -1 do
-		local change = pending_changes[i]
-		vim.api.nvim_buf_set_lines(
-			temp_buf,
-			change.first,
-			change.old_last,
-			false,
-			change.lines
-		)
-	end
+			if cut >= pos then
+				last = cut
+			else
+				-- One long line, step back from continuation bytes
+				while last > pos do
+					local next_byte = content:byte(last + 1)
+					if next_byte < 0x80 or next_byte >= 0xC0 then
+						break
+					end
+					last = last - 1
+				end
+			end
+		end
 
-	-- Get end result and cleanup
-	local result_lines = vim.api.nvim_buf_get_lines(temp_buf, 0, -1, false)
-	vim.api.nvim_buf_delete(temp_buf, { force = true })
+		table.insert(parts, content:sub(pos, last))
+		pos = last + 1
+	end
 
-	return table.concat(result_lines, "\n")
+	-- Empty file is still one part
+	if #parts == 0 then
+		parts[1] = ""
+	end
+	return parts
 end
 
 -- Returns buffer's SHA256 content hash
@@ -230,4 +296,26 @@ function M.get_buf_sha256(buf)
 	return vim.fn.sha256(content)
 end
 
+-- Lines per block in sync_file, same as the server's
+M.sync_block_lines = 64
+
+-- Returns short hashes of lines in blocks counted from the start and from
+-- the end, which the server compares to its own with sync_file
+function M.get_block_hashes(lines)
+	local size = M.sync_block_lines
+	local function hash(first, last)
+		local block = table.concat(lines, "\n", first, last)
+		return vim.fn.sha256(block):sub(1, 16)
+	end
+
+	local head, tail = {}, {}
+	for i = 1, #lines, size do
+		table.insert(head, hash(i, math.min(i + size - 1, #lines)))
+	end
+	for i = #lines, 1, -size do
+		table.insert(tail, hash(math.max(i - size + 1, 1), i))
+	end
+	return head, tail
+end
+
 return M
@@ -0,0 +1,122 @@
+-- Subscriptions to the files shown in windows. Server only sends edits of
+-- subscribed files, and cursors in the lines around the visible ones, so
+-- hidden files cost nothing. Resubscribing sends the version we have, and
+-- server answers with the edits made to the file while it was hidden
+local events = require("cesp.events")
+local ot = require("cesp.ot")
+local utils = require("cesp.utils")
+
+local M = {}
+
+-- path -> { first, last } lines we are subscribed to, 0-indexed and
+-- inclusive. Last -1 is the whole file
+M.subscribed = {}
+
+local GROUP = "CespViewport"
+local scheduled = false
+
+-- Requested files are subscribed to as a whole by the server
+function M.requested(path)
+	M.subscribed[path] = { first = 0, last = -1 }
+end
+
+local function subscribe(path, view)
+	local sub = M.subscribed[path]
+	if sub and sub.first <= view.top and view.bottom <= sub.last then
+		return
+	end
+
+	local version = nil
+	if not sub and ot.docs[path] then
+		-- Server may have already applied our changes, they would come back
+		-- as missed edits
+		if not ot.is_idle(path) then
+			ot.when_idle(path, M.schedule)
+			return
+		end
+		version = ot.docs[path].version
+	end
+
+	-- A screen of margin on both sides, so that scrolling a bit doesn't
+	-- need a new subscription
+	sub = {
+		first = math.max(view.top - view.height, 0),
+		last = view.bottom + view.height,
+	}
+	M.subscribed[path] = sub
+	events.send_event({
+		event = "subscribe",
+		path = path,
+		version = version,
+		first = sub.first,
+		last = sub.last,
+	})
+end
+
+-- Subscribes to the lines of files shown in windows, and unsubscribes
+-- from files that aren't shown anymore
+local function refresh()
+	local views = {}
+	for _, win in ipairs(vim.api.nvim_list_wins()) do
+		local path = utils.get_rel_path(vim.api.nvim_win_get_buf(win))
+		-- File still being received is subscribed to as a whole
+		if path and not events.requested[path] then
+			local top, bottom = vim.api.nvim_win_call(win, function()
+				return vim.fn.line("w0") - 1, vim.fn.line("w$") - 1
+			end)
+			local view = views[path]
+			if view then
+				view.top = math.min(view.top, top)
+				view.bottom = math.max(view.bottom, bottom)
+				view.height = math.max(view.height, bottom - top + 1)
+			else
+				views[path] =
+					{ top = top, bottom = bottom, height = bottom - top + 1 }
+			end
+		end
+	end
+
+	for path in pairs(M.subscribed) do
+		if not views[path] and not events.requested[path] then
+			M.subscribed[path] = nil
+			events.send_event({ event = "unsubscribe", path = path })
+		end
+	end
+	for path, view in pairs(views) do
+		subscribe(path, view)
+	end
+end
+
+-- Refreshes subscriptions once, after the current events
+function M.schedule()
+	if scheduled then
+		return
+	end
+	scheduled = true
+	vim.schedule(function()
+		scheduled = false
+		refresh()
+	end)
+end
+
+function M.start()
+	local group = vim.api.nvim_create_augroup(GROUP, {})
+	vim.api.nvim_create_autocmd({
+		"BufWinEnter",
+		"BufWinLeave",
+		"WinClosed",
+		"WinScrolled",
+		"VimResized",
+	}, {
+		group = group,
+		callback = M.schedule,
+	})
+	M.schedule()
+end
+
+function M.stop()
+	M.subscribed = {}
+	pcall(vim.api.nvim_del_augroup_by_name, GROUP)
+end
+
+return M
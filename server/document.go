@@ -0,0 +1,273 @@
+package main
+
+import (
+	"encoding/json"
+	"strings"
+	"unicode/utf8"
+)
+
+const (
+	// Lines per chunk of a document
+	docChunkLines = 512
+	// Max bytes of cached documents per room, files opened after that are
+	// still requested from host
+	MaxDocumentCacheSize = 64 * 1024 * 1024
+	// Max bytes of content in one response_file part, same as the clients'
+	FileChunkSize = 64 * 1024
+	// Max bytes of content in one handoff_file part. Larger than
+	// FileChunkSize so that handoff takes fewer slots of the new host's queue
+	HandoffChunkSize = 1024 * 1024
+)
+
+// Text of a file as lines, kept in chunks of at most docChunkLines so that
+// edits only copy the chunks they touch. Mirrors a neovim buffer, so it
+// always has at least one line
+type Document struct {
+	chunks [][]string
+	lines  int
+	// Bytes of content with newlines
+	size int
+}
+
+func NewDocument(content string) *Document {
+	d := &Document{}
+	d.Replace(0, 0, strings.Split(content, "\n"))
+	return d
+}
+
+func (d *Document) Lines() int {
+	return d.lines
+}
+
+func (d *Document) Size() int {
+	return d.size
+}
+
+// Replaces lines [first, last) like nvim_buf_set_lines without strict
+// indexing: out of range indices are clamped
+func (d *Document) Replace(first, last int, lines []string) {
+	first = min(max(first, 0), d.lines)
+	last = min(max(last, first), d.lines)
+
+	// Chunks from start to end (inclusive) are rebuilt
+	start, startOff := d.locate(first)
+	end, endOff := d.locate(last)
+
+	var head, tail []string
+	if start < len(d.chunks) {
+		head, tail = d.chunks[start][:startOff], d.chunks[end][endOff:]
+	}
+	merged := make([]string, 0, len(head)+len(lines)+len(tail))
+	merged = append(append(append(merged, head...), lines...), tail...)
+
+	for i := start; i <= end && i < len(d.chunks); i++ {
+		d.lines -= len(d.chunks[i])
+		d.size -= linesSize(d.chunks[i])
+	}
+	d.lines += len(merged)
+	d.size += linesSize(merged)
+
+	var rebuilt [][]string
+	for len(merged) > 0 {
+		n := min(len(merged), docChunkLines)
+		rebuilt = append(rebuilt, merged[:n:n])
+		merged = merged[n:]
+	}
+	if replaced := d.chunks[start:min(end+1, len(d.chunks))]; len(rebuilt) == len(replaced) {
+		// Usual case of an edit inside one chunk
+		copy(replaced, rebuilt)
+	} else {
+		rest := d.chunks[min(end+1, len(d.chunks)):]
+		d.chunks = append(append(d.chunks[:start:start], rebuilt...), rest...)
+	}
+
+	// Buffer without lines still has an empty one
+	if d.lines == 0 {
+		d.chunks = [][]string{{""}}
+		d.lines = 1
+		d.size = 1
+	}
+}
+
+// Applies line operation run by run
+func (d *Document) Apply(op lineOp) {
+	line := 0
+	for _, run := range op {
+		switch {
+		case run.Retain > 0:
+			line += run.Retain
+		case run.Delete > 0:
+			d.Replace(line, line+run.Delete, nil)
+		case run.Edit != nil:
+			if line < d.lines {
+				// Chunks are never shared, the line can be replaced in place
+				c, off := d.locate(line)
+				edited := run.Edit.apply(d.chunks[c][off])
+				d.size += len(edited) - len(d.chunks[c][off])
+				d.chunks[c][off] = edited
+			}
+			line++
+		default:
+			d.Replace(line, line, run.Insert)
+			line += len(run.Insert)
+		}
+	}
+}
+
+// Returns chunk and offset in it for line i. Line after the last one is at
+// the end of the last chunk
+func (d *Document) locate(i int) (int, int) {
+	for c, chunk := range d.chunks {
+		if i < len(chunk) {
+			return c, i
+		}
+		if c == len(d.chunks)-1 {
+			return c, len(chunk)
+		}
+		i -= len(chunk)
+	}
+	return 0, 0
+}
+
+// Returns the whole document joined with newlines
+func (d *Document) Content() string {
+	var b strings.Builder
+	b.Grow(d.size)
+	first := true
+	for _, chunk := range d.chunks {
+		for _, line := range chunk {
+			if !first {
+				b.WriteByte('\n')
+			}
+			b.WriteString(line)
+			first = false
+		}
+	}
+	return b.String()
+}
+
+func linesSize(lines []string) int {
+	size := 0
+	for _, line := range lines {
+		size += len(line) + 1
+	}
+	return size
+}
+
+// Splits content into parts of at most size bytes the same way clients do:
+// after the last newline of a part if it has one, never inside an utf-8
+// character
+func splitContent(content string, size int) []string {
+	var parts []string
+	for len(content) > size {
+		cut := strings.LastIndexByte(content[:size], '\n') + 1
+		if cut == 0 {
+			cut = size
+			for cut > 1 && !utf8.RuneStart(content[cut]) {
+				cut--
+			}
+		}
+		parts = append(parts, content[:cut])
+		content = content[cut:]
+	}
+	return append(parts, content)
+}
+
+// Change of update_content. Line changes replace lines [First, OldLast)
+// with Lines, text changes replace Delete bytes at byte Col of line First
+// with Text
+type Change struct {
+	First   int      `json:"first"`
+	OldLast int      `json:"old_last"`
+	Lines   []string `json:"lines"`
+	Col     int      `json:"col"`
+	Delete  int      `json:"delete"`
+	// Set for text changes
+	Text *string `json:"text"`
+}
+
+// Encodes only the fields of the change's kind
+func (c Change) MarshalJSON() ([]byte, error) {
+	if c.Text != nil {
+		return json.Marshal(struct {
+			First  int    `json:"first"`
+			Col    int    `json:"col"`
+			Delete int    `json:"delete"`
+			Text   string `json:"text"`
+		}{c.First, c.Col, c.Delete, *c.Text})
+	}
+	return json.Marshal(struct {
+		First   int      `json:"first"`
+		OldLast int      `json:"old_last"`
+		Lines   []string `json:"lines"`
+	}{c.First, c.OldLast, c.Lines})
+}
+
+// Files of the session. Versions are tracked for every edited file, content
+// only for files host has sent, so that later request_file calls don't need
+// the host
+type documentCache struct {
+	docs map[string]*docState
+	// Bytes of cached content
+	size int
+}
+
+func newDocumentCache() documentCache {
+	return documentCache{docs: make(map[string]*docState)}
+}
+
+// Returns state of path, creating it at version 0
+func (c *documentCache) State(path string) *docState {
+	state, ok := c.docs[path]
+	if !ok {
+		state = &docState{}
+		c.docs[path] = state
+	}
+	return state
+}
+
+// Returns cached content of path and its version
+func (c *documentCache) Get(path string) (*Document, int, bool) {
+	state, ok := c.docs[path]
+	if !ok || state.Doc == nil {
+		return nil, 0, false
+	}
+	return state.Doc, state.Version, true
+}
+
+// Caches content of path at version unless it's outdated or the cache is
+// full
+func (c *documentCache) Put(path, content string, version int) {
+	state := c.State(path)
+	c.Drop(path)
+	if version != state.Version || c.size+len(content) > MaxDocumentCacheSize {
+		return
+	}
+	state.Doc = NewDocument(content)
+	c.size += state.Doc.Size()
+}
+
+// Applies next operation of path made by author, it must already be
+// transformed to the current version
+func (c *documentCache) Apply(path string, op lineOp, author string) {
+	state := c.State(path)
+	state.record(op, author)
+	if doc := state.Doc; doc != nil {
+		c.size -= doc.Size()
+		doc.Apply(op)
+		c.size += doc.Size()
+	}
+}
+
+// Forgets cached content of path, version is kept
+func (c *documentCache) Drop(path string) {
+	if state, ok := c.docs[path]; ok && state.Doc != nil {
+		c.size -= state.Doc.Size()
+		state.Doc = nil
+	}
+}
+
+func (c *documentCache) Clear() {
+	c.docs = make(map[string]*docState)
+	c.size = 0
+}
@@ -0,0 +1,101 @@
+package main
+
+import (
+	"fmt"
+	"math/rand"
+	"strings"
+	"testing"
+)
+
+func TestDocumentReplace(t *testing.T) {
+	doc := NewDocument("a\nb\nc")
+	doc.Replace(1, 2, []string{"x", "y"})
+	if got := doc.Content(); got != "a\nx\ny\nc" {
+		t.Fatalf("Expected replaced line, got %q", got)
+	}
+
+	// Out of range is clamped like in neovim
+	doc.Replace(10, 20, []string{"end"})
+	doc.Replace(-1, 1, nil)
+	if got := doc.Content(); got != "x\ny\nc\nend" {
+		t.Fatalf("Expected clamped edits, got %q", got)
+	}
+
+	// Buffer always has a line
+	doc.Replace(0, doc.Lines(), nil)
+	if doc.Lines() != 1 || doc.Content() != "" {
+		t.Fatalf("Expected one empty line, got %d lines %q", doc.Lines(), doc.Content())
+	}
+}
+
+func TestDocumentMatchesSlice(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	var want []string
+	for i := 0; i < 3000; i++ {
+		want = append(want, fmt.Sprint("line ", i))
+	}
+	doc := NewDocument(strings.Join(want, "\n"))
+
+	for i := 0; i < 300; i++ {
+		first := rng.Intn(len(want) + 1)
+		last := first + rng.Intn(min(len(want)-first, 700)+1)
+		lines := make([]string, rng.Intn(700))
+		for j := range lines {
+			lines[j] = fmt.Sprint("edit ", i, " ", j)
+		}
+
+		want = append(want[:first:first], append(lines, want[last:]...)...)
+		if len(want) == 0 {
+			want = []string{""}
+		}
+		doc.Replace(first, last, lines)
+
+		if doc.Lines() != len(want) {
+			t.Fatalf("Edit %d: expected %d lines, got %d", i, len(want), doc.Lines())
+		}
+	}
+
+	content := strings.Join(want, "\n")
+	if doc.Content() != content || doc.Size() != len(content)+1 {
+		t.Fatal("Document differs from reference after edits")
+	}
+	for _, chunk := range doc.chunks {
+		if len(chunk) == 0 || len(chunk) > docChunkLines {
+			t.Fatalf("Invalid chunk of %d lines", len(chunk))
+		}
+	}
+}
+
+func TestSplitContent(t *testing.T) {
+	parts := splitContent("aaa\nbb\ncccc", 5)
+	if strings.Join(parts, "|") != "aaa\n|bb\n|cccc" {
+		t.Fatalf("Expected parts cut after newlines, got %q", parts)
+	}
+
+	// Long line is cut, but not inside a character
+	parts = splitContent(strings.Repeat("ä", 5), 3)
+	for _, part := range parts {
+		if !strings.HasPrefix(part, "ä") || len(part) > 3 {
+			t.Fatalf("Part splits a character: %q", parts)
+		}
+	}
+	if strings.Join(parts, "") != strings.Repeat("ä", 5) {
+		t.Fatalf("Parts don't add up: %q", parts)
+	}
+}
+
+func BenchmarkDocumentReplace(b *testing.B) {
+	lines := make([]string, 100000)
+	for i := range lines {
+		lines[i] = fmt.Sprint("line ", i)
+	}
+	doc := NewDocument(strings.Join(lines, "\n"))
+	edit := []string{"typed"}
+
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		line := (i * 7919) % doc.Lines()
+		doc.Replace(line, line+1, edit)
+	}
+}
@@ -0,0 +1,244 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"compress/zlib"
+	"encoding/binary"
+	"errors"
+	"io"
+	"net"
+)
+
+// Messages are either newline-delimited json (default) or length-prefixed
+// frames, which clients can ask for in handshake. A frame starts with a
+// kind byte and a big-endian uint32 payload length. Json never starts with
+// a zero byte, so both ends can tell the two apart message by message.
+//
+// Frames can be compressed on connections that negotiated it. Payload of a
+// compressed frame is uncompressed length (uint32) and zlib stream of json
+const (
+	FrameHeaderSize = 5
+	// Payload is a json object without newline
+	FrameJSON byte = 0
+	FrameZlib byte = 1
+	// Smaller messages (like cursors) are not worth compressing
+	CompressMinSize = 1024
+	// Larger scratch buffers are dropped after use, so that one big file
+	// doesn't keep megabytes per connection
+	maxPooledBuffer = 256 * 1024
+)
+
+type Framing int32
+
+const (
+	FramingNewline Framing = iota
+	FramingLength
+)
+
+// Values of "framing" and "compression" in handshake and handshake_response
+const (
+	framingLengthName   = "length"
+	compressionZlibName = "zlib"
+)
+
+var (
+	ErrMessageTooLong = errors.New("message exceeds MaxBufferSize")
+	ErrUnknownFrame   = errors.New("unknown frame kind")
+)
+
+// Reads both newline-delimited and length-prefixed messages
+type frameReader struct {
+	r *bufio.Reader
+	// Lines longer than the bufio buffer are collected here
+	line []byte
+	max  int
+	// Compressed payload and its decompressor, reused between frames
+	compressed []byte
+	zr         io.ReadCloser
+}
+
+func newFrameReader(conn io.Reader, size, max int) *frameReader {
+	return &frameReader{r: bufio.NewReaderSize(conn, size), max: max}
+}
+
+// Returns next message. If owned is false the slice is only valid until the
+// next call, like bufio.Scanner's
+func (fr *frameReader) Next() (msg []byte, owned bool, err error) {
+	// Previous message is not used anymore
+	if cap(fr.line) > maxPooledBuffer {
+		fr.line = nil
+	}
+	if cap(fr.compressed) > maxPooledBuffer {
+		fr.compressed = nil
+	}
+
+	first, err := fr.r.Peek(1)
+	if err != nil {
+		return nil, false, err
+	}
+	if first[0] == FrameJSON || first[0] == FrameZlib {
+		return fr.nextFrame()
+	}
+	return fr.nextLine()
+}
+
+func (fr *frameReader) nextFrame() ([]byte, bool, error) {
+	header, err := fr.r.Peek(FrameHeaderSize)
+	if err != nil {
+		return nil, false, err
+	}
+	kind := header[0]
+	size := int(binary.BigEndian.Uint32(header[1:]))
+	if size > fr.max {
+		return nil, false, ErrMessageTooLong
+	}
+	fr.r.Discard(FrameHeaderSize)
+
+	if kind == FrameZlib {
+		return fr.decompress(size)
+	}
+	// Read straight into the message, it doesn't need another copy
+	payload := make([]byte, size)
+	if _, err := io.ReadFull(fr.r, payload); err != nil {
+		return nil, false, err
+	}
+	return payload, true, nil
+}
+
+func (fr *frameReader) decompress(size int) ([]byte, bool, error) {
+	if size < 4 {
+		return nil, false, ErrUnknownFrame
+	}
+	if cap(fr.compressed) < size {
+		fr.compressed = make([]byte, size)
+	}
+	fr.compressed = fr.compressed[:size]
+	if _, err := io.ReadFull(fr.r, fr.compressed); err != nil {
+		return nil, false, err
+	}
+
+	rawSize := int(binary.BigEndian.Uint32(fr.compressed))
+	if rawSize > fr.max {
+		return nil, false, ErrMessageTooLong
+	}
+	src := bytes.NewReader(fr.compressed[4:])
+	var err error
+	if fr.zr == nil {
+		fr.zr, err = zlib.NewReader(src)
+	} else {
+		err = fr.zr.(zlib.Resetter).Reset(src, nil)
+	}
+	if err != nil {
+		return nil, false, err
+	}
+
+	payload := make([]byte, rawSize)
+	if _, err := io.ReadFull(fr.zr, payload); err != nil {
+		return nil, false, err
+	}
+	return payload, true, nil
+}
+
+func (fr *frameReader) nextLine() ([]byte, bool, error) {
+	fr.line = fr.line[:0]
+	for {
+		chunk, err := fr.r.ReadSlice('\n')
+		if len(fr.line)+len(chunk) > fr.max {
+			return nil, false, ErrMessageTooLong
+		}
+
+		switch {
+		case err == nil:
+			if len(fr.line) > 0 {
+				chunk = append(fr.line, chunk...)
+				fr.line = chunk
+			}
+			return dropCR(chunk[:len(chunk)-1]), false, nil
+		case errors.Is(err, bufio.ErrBufferFull):
+			fr.line = append(fr.line, chunk...)
+		case errors.Is(err, io.EOF) && len(fr.line)+len(chunk) > 0:
+			// Last line without newline
+			fr.line = append(fr.line, chunk...)
+			return dropCR(fr.line), false, nil
+		default:
+			return nil, false, err
+		}
+	}
+}
+
+func dropCR(line []byte) []byte {
+	if len(line) > 0 && line[len(line)-1] == '\r' {
+		return line[:len(line)-1]
+	}
+	return line
+}
+
+// Frames batches for clients using length-prefixed framing. Buffers are
+// reused between batches, so a batch is only valid until the next one
+type frameWriter struct {
+	framed  net.Buffers
+	headers []byte
+	// Compressed payloads of the current batch
+	compressed bytes.Buffer
+	zw         *zlib.Writer
+}
+
+// Adds header to every queued (newline terminated) message of batch, and
+// compresses the ones that are at least CompressMinSize bytes if compress
+// is set
+func (fw *frameWriter) Frame(batch net.Buffers, compress bool) net.Buffers {
+	if need := len(batch) * FrameHeaderSize; cap(fw.headers) < need {
+		fw.headers = make([]byte, need)
+	}
+	fw.headers = fw.headers[:len(batch)*FrameHeaderSize]
+	fw.framed = fw.framed[:0]
+	// Previous batch has been written
+	if fw.compressed.Cap() > maxPooledBuffer {
+		fw.compressed = bytes.Buffer{}
+	}
+	fw.compressed.Reset()
+
+	for i, msg := range batch {
+		if n := len(msg); n > 0 && msg[n-1] == '\n' {
+			msg = msg[:n-1]
+		}
+		kind := FrameJSON
+		if compress && len(msg) >= CompressMinSize {
+			if small, ok := fw.compress(msg); ok {
+				kind, msg = FrameZlib, small
+			}
+		}
+		header := fw.headers[i*FrameHeaderSize : (i+1)*FrameHeaderSize]
+		header[0] = kind
+		binary.BigEndian.PutUint32(header[1:], uint32(len(msg)))
+		fw.framed = append(fw.framed, header, msg)
+	}
+	return fw.framed
+}
+
+// Returns compressed payload of msg, or false if it didn't get any smaller
+func (fw *frameWriter) compress(msg []byte) ([]byte, bool) {
+	start := fw.compressed.Len()
+	var size [4]byte
+	binary.BigEndian.PutUint32(size[:], uint32(len(msg)))
+	fw.compressed.Write(size[:])
+
+	if fw.zw == nil {
+		// Text compresses well even with the fastest level
+		fw.zw, _ = zlib.NewWriterLevel(&fw.compressed, zlib.BestSpeed)
+	} else {
+		fw.zw.Reset(&fw.compressed)
+	}
+	fw.zw.Write(msg)
+	fw.zw.Close()
+
+	// Earlier payloads stay valid when the buffer grows, they just keep
+	// pointing to the old array
+	out := fw.compressed.Bytes()[start:]
+	if len(out) >= len(msg) {
+		fw.compressed.Truncate(start)
+		return nil, false
+	}
+	return out, true
+}
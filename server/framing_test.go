@@ -0,0 +1,205 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/binary"
+	"fmt"
+	"io"
+	"net"
+	"strings"
+	"testing"
+)
+
+func frame(payload string) []byte {
+	out := make([]byte, FrameHeaderSize, FrameHeaderSize+len(payload))
+	out[0] = FrameJSON
+	binary.BigEndian.PutUint32(out[1:], uint32(len(payload)))
+	return append(out, payload...)
+}
+
+func readFrame(t *testing.T, r *bufio.Reader) string {
+	t.Helper()
+	header := make([]byte, FrameHeaderSize)
+	if _, err := io.ReadFull(r, header); err != nil || header[0] != FrameJSON {
+		t.Fatalf("Expected frame header, got %q (%v)", header, err)
+	}
+	payload := make([]byte, binary.BigEndian.Uint32(header[1:]))
+	if _, err := io.ReadFull(r, payload); err != nil {
+		t.Fatal(err)
+	}
+	return string(payload)
+}
+
+func TestFrameReaderMixed(t *testing.T) {
+	long := `{"event":"update_content","lines":"` + strings.Repeat("x", 100) + `"}`
+	var in bytes.Buffer
+	in.WriteString(`{"event":"a"}` + "\n")
+	in.Write(frame(`{"event":"b"}`))
+	in.WriteString(`{"event":"c"}` + "\r\n")
+	in.WriteString(long + "\n")
+	in.Write(frame(long))
+	in.WriteString(`{"event":"last"}`)
+
+	// Small buffer so the long line doesn't fit in it
+	reader := newFrameReader(&in, 16, 1024)
+	want := []string{`{"event":"a"}`, `{"event":"b"}`, `{"event":"c"}`, long, long, `{"event":"last"}`}
+	for _, w := range want {
+		msg, _, err := reader.Next()
+		if err != nil || string(msg) != w {
+			t.Fatalf("Expected %q, got %q (%v)", w, msg, err)
+		}
+	}
+	if _, _, err := reader.Next(); err == nil {
+		t.Fatal("Expected error at the end of stream")
+	}
+}
+
+func TestFrameReaderLimits(t *testing.T) {
+	header := frame("")
+	binary.BigEndian.PutUint32(header[1:], 2048)
+	reader := newFrameReader(bytes.NewReader(header), 16, 1024)
+	if _, _, err := reader.Next(); err != ErrMessageTooLong {
+		t.Fatalf("Expected ErrMessageTooLong for frame, got %v", err)
+	}
+
+	line := strings.Repeat("x", 2048) + "\n"
+	reader = newFrameReader(strings.NewReader(line), 16, 1024)
+	if _, _, err := reader.Next(); err != ErrMessageTooLong {
+		t.Fatalf("Expected ErrMessageTooLong for line, got %v", err)
+	}
+}
+
+func TestFrameReaderDropsLargeBuffers(t *testing.T) {
+	long := `{"content":"` + strings.Repeat("x", 4*maxPooledBuffer) + `"}`
+	reader := newFrameReader(strings.NewReader(long+"\n"+`{"event":"a"}`+"\n"+long+"\n"), 64, MaxBufferSize)
+
+	if msg, _, err := reader.Next(); err != nil || string(msg) != long {
+		t.Fatalf("Expected long line, got %d bytes (%v)", len(msg), err)
+	}
+	if msg, _, err := reader.Next(); err != nil || string(msg) != `{"event":"a"}` {
+		t.Fatalf("Expected short line, got %.40q (%v)", msg, err)
+	}
+	if cap(reader.line) > maxPooledBuffer {
+		t.Errorf("Buffer of a long line is kept, %d bytes", cap(reader.line))
+	}
+	if msg, _, err := reader.Next(); err != nil || string(msg) != long {
+		t.Fatalf("Expected long line again, got %d bytes (%v)", len(msg), err)
+	}
+}
+
+func TestFrameWriter(t *testing.T) {
+	batch := net.Buffers{[]byte(`{"a":1}` + "\n"), []byte(`{"b":22}` + "\n")}
+	var fw frameWriter
+	framed := fw.Frame(batch, false)
+	if len(framed) != 4 {
+		t.Fatalf("Expected header and payload per message, got %d buffers", len(framed))
+	}
+
+	var out bytes.Buffer
+	framed.WriteTo(&out)
+	want := append(frame(`{"a":1}`), frame(`{"b":22}`)...)
+	if !bytes.Equal(out.Bytes(), want) {
+		t.Fatalf("Expected %q, got %q", want, out.Bytes())
+	}
+}
+
+func TestFrameCompression(t *testing.T) {
+	big := `{"event":"response_file","content":"` + strings.Repeat("line of text\\n", 1000) + `"}`
+	batch := net.Buffers{[]byte(big + "\n"), []byte(`{"small":1}` + "\n"), []byte(big + "\n")}
+
+	var fw frameWriter
+	var out bytes.Buffer
+	framed := fw.Frame(batch, true)
+	framed.WriteTo(&out)
+	if out.Len() > len(big) {
+		t.Fatalf("Expected compressed batch, got %d bytes for %d byte messages", out.Len(), 2*len(big))
+	}
+	if out.Bytes()[0] != FrameZlib {
+		t.Fatalf("Expected large message to be compressed, got kind %d", out.Bytes()[0])
+	}
+
+	reader := newFrameReader(&out, 64, 1<<20)
+	for _, want := range []string{big, `{"small":1}`, big} {
+		msg, owned, err := reader.Next()
+		if err != nil || !owned || string(msg) != want {
+			t.Fatalf("Expected %.40q, got %.40q (%v)", want, msg, err)
+		}
+	}
+
+	// Uncompressed size is checked before inflating
+	framed = fw.Frame(net.Buffers{[]byte(big)}, true)
+	framed.WriteTo(&out)
+	reader = newFrameReader(&out, 64, 1024)
+	if _, _, err := reader.Next(); err != ErrMessageTooLong {
+		t.Fatalf("Expected ErrMessageTooLong, got %v", err)
+	}
+}
+
+func TestLengthFramingHandshake(t *testing.T) {
+	_, addr := startTestServer()
+
+	framed, _ := net.Dial("tcp", addr)
+	defer framed.Close()
+	rf := bufio.NewReader(framed)
+	// Handshake itself can be either way
+	fmt.Fprintln(framed, `{"event": "handshake", "name": "kehys", "framing": "length"}`)
+	if reply := readFrame(t, rf); !strings.Contains(reply, `"framing":"length"`) {
+		t.Fatalf("Expected framed handshake_response, got %s", reply)
+	}
+
+	plain, _ := net.Dial("tcp", addr)
+	defer plain.Close()
+	rp := bufio.NewReader(plain)
+	fmt.Fprintln(plain, `{"event": "handshake", "name": "rivi"}`)
+	if reply, _ := rp.ReadString('\n'); strings.Contains(reply, "framing") {
+		t.Fatalf("Newline client got framing: %s", reply)
+	}
+	readFrame(t, rf) // user_joined
+
+	// Framed to newline and back
+	framed.Write(frame(`{"event": "remote_write", "path": "a.c"}`))
+	if reply, _ := rp.ReadString('\n'); !strings.Contains(reply, `"path": "a.c"`) {
+		t.Fatalf("Expected newline broadcast, got %s", reply)
+	}
+	fmt.Fprintln(plain, `{"event": "remote_write", "path": "b.c"}`)
+	if reply := readFrame(t, rf); !strings.Contains(reply, `"path": "b.c"`) || strings.HasSuffix(reply, "\n") {
+		t.Fatalf("Expected framed broadcast without newline, got %q", reply)
+	}
+}
+
+func TestCompressionHandshake(t *testing.T) {
+	_, addr := startTestServer()
+
+	c1, _ := net.Dial("tcp", addr)
+	defer c1.Close()
+	r1 := bufio.NewReader(c1)
+	fmt.Fprintln(c1, `{"event": "handshake", "name": "pakattu", "framing": "length", "compression": "zlib"}`)
+	if reply := readFrame(t, r1); !strings.Contains(reply, `"compression":"zlib"`) {
+		t.Fatalf("Expected compression in handshake_response, got %s", reply)
+	}
+
+	// Compression needs length framing
+	c2, _ := net.Dial("tcp", addr)
+	defer c2.Close()
+	r2 := bufio.NewReader(c2)
+	fmt.Fprintln(c2, `{"event": "handshake", "name": "rivi", "compression": "zlib"}`)
+	if reply, _ := r2.ReadString('\n'); strings.Contains(reply, "compression") {
+		t.Fatalf("Newline client got compression: %s", reply)
+	}
+	readFrame(t, r1) // user_joined
+
+	content := strings.Repeat("abc", 1000)
+	fmt.Fprintf(c2, `{"event": "remote_write", "path": "a.c", "content": %q}`+"\n", content)
+	header := make([]byte, FrameHeaderSize)
+	io.ReadFull(r1, header)
+	if header[0] != FrameZlib {
+		t.Fatalf("Expected compressed frame, got kind %d", header[0])
+	}
+	payload := make([]byte, binary.BigEndian.Uint32(header[1:]))
+	io.ReadFull(r1, payload)
+	reader := newFrameReader(io.MultiReader(bytes.NewReader(header), bytes.NewReader(payload)), 64, MaxBufferSize)
+	if msg, _, err := reader.Next(); err != nil || !strings.Contains(string(msg), content) {
+		t.Fatalf("Invalid compressed broadcast: %v", err)
+	}
+}
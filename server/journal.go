@@ -0,0 +1,325 @@
+package main
+
+import (
+	"bufio"
+	"crypto/sha256"
+	"encoding/hex"
+	"encoding/json"
+	"errors"
+	"io"
+	"os"
+	"path/filepath"
+	"sort"
+)
+
+// With -journal every room keeps its files in an append-only journal, one
+// json record per line: snapshots of files and the edits made after them.
+// Room loads it when it starts, so clients that come back after the server
+// restarted (or after the room emptied) get the edits they missed instead of
+// every file. Writes are done by journal's own goroutine, the room never
+// waits for the disk. Once the edits appended since the last snapshot are
+// larger than it, the whole journal is replaced with a new snapshot
+
+const (
+	// Appended bytes allowed on top of the snapshot's size before the next
+	// snapshot, so that small journals aren't rewritten all the time
+	JournalCompactSize = 1024 * 1024
+	// Writes waiting for journal's goroutine. If it's full the write is
+	// dropped and the next edit takes a snapshot instead
+	journalQueueSize = 4096
+)
+
+// One line of a journal. Snapshot records have History (maybe empty) and
+// replace the file's state, otherwise Edit record's Op made Version, one
+// with Content caches the file at Version and Drop forgets cached content
+type journalRecord struct {
+	Path    string  `json:"path"`
+	Version int     `json:"version"`
+	Content *string `json:"content,omitempty"`
+	Op      lineOp  `json:"op,omitempty"`
+	Author  string  `json:"author,omitempty"`
+	Drop    bool    `json:"drop,omitempty"`
+	// Set on edit records, Op is empty when the edit was transformed away
+	// but it still made a version
+	Edit    bool          `json:"edit,omitempty"`
+	History []journalEdit `json:"history,omitempty"`
+	// Set on snapshot records, their history can be empty
+	Snapshot bool `json:"snapshot,omitempty"`
+}
+
+type journalEdit struct {
+	Op     lineOp `json:"op"`
+	Author string `json:"author,omitempty"`
+}
+
+type journalWrite struct {
+	data []byte
+	// Replaces the whole journal instead of appending to it
+	snapshot bool
+}
+
+type journal struct {
+	path  string
+	file  *os.File
+	queue chan journalWrite
+	done  chan struct{}
+	// Owned by the room: bytes appended since the snapshot, its size and
+	// whether a write was dropped since
+	appended     int
+	snapshotSize int
+	lost         bool
+}
+
+// Journal file of room id in dir. Ids can be anything, so the name is their
+// hash
+func journalPath(dir, id string) string {
+	sum := sha256.Sum256([]byte(id))
+	return filepath.Join(dir, hex.EncodeToString(sum[:])+".journal")
+}
+
+// Opens journal of room id and returns the records it has. A torn last
+// record (from a crash in the middle of a write) ends the journal
+func openJournal(dir, id string) (*journal, []journalRecord, error) {
+	path := journalPath(dir, id)
+	var records []journalRecord
+	if file, err := os.Open(path); err == nil {
+		records, err = readJournal(file)
+		file.Close()
+		if err != nil {
+			logger.Errorf("Journal %s ends with a broken record: %v", path, err)
+		}
+	} else if !errors.Is(err, os.ErrNotExist) {
+		return nil, nil, err
+	}
+
+	file, err := os.OpenFile(path, os.O_WRONLY|os.O_CREATE|os.O_APPEND, 0o644)
+	if err != nil {
+		return nil, nil, err
+	}
+	j := &journal{
+		path:  path,
+		file:  file,
+		queue: make(chan journalWrite, journalQueueSize),
+		done:  make(chan struct{}),
+	}
+	go j.run()
+	return j, records, nil
+}
+
+func readJournal(r io.Reader) ([]journalRecord, error) {
+	var records []journalRecord
+	reader := bufio.NewReader(r)
+	for {
+		line, err := reader.ReadBytes('\n')
+		if err == io.EOF {
+			if len(line) > 0 {
+				return records, io.ErrUnexpectedEOF
+			}
+			return records, nil
+		}
+		if err != nil {
+			return records, err
+		}
+		var record journalRecord
+		if err := json.Unmarshal(line, &record); err != nil {
+			return records, err
+		}
+		records = append(records, record)
+	}
+}
+
+func (j *journal) run() {
+	defer close(j.done)
+	for w := range j.queue {
+		var err error
+		if w.snapshot {
+			err = j.replace(w.data)
+		} else {
+			_, err = j.file.Write(w.data)
+		}
+		if err != nil {
+			logger.Errorf("Journal %s: %v", j.path, err)
+		}
+	}
+	j.file.Close()
+}
+
+// Writes snapshot next to the journal and moves it over the journal, so
+// that a crash leaves either the old or the new one
+func (j *journal) replace(data []byte) error {
+	tmp := j.path + ".tmp"
+	file, err := os.Create(tmp)
+	if err != nil {
+		return err
+	}
+	if _, err := file.Write(data); err != nil {
+		file.Close()
+		return err
+	}
+	if err := file.Sync(); err != nil {
+		file.Close()
+		return err
+	}
+	file.Close()
+	if err := os.Rename(tmp, j.path); err != nil {
+		return err
+	}
+
+	j.file.Close()
+	j.file, err = os.OpenFile(j.path, os.O_WRONLY|os.O_APPEND, 0o644)
+	return err
+}
+
+// Queues write without waiting, false if the queue is full
+func (j *journal) write(w journalWrite) bool {
+	select {
+	case j.queue <- w:
+		return true
+	default:
+		return false
+	}
+}
+
+// Finishes queued writes and closes the file
+func (j *journal) close() {
+	close(j.queue)
+	<-j.done
+}
+
+// Loads the room's journal in dir, runs on the room's goroutine before it
+// handles any client. Journal is snapshotted right away, which also drops
+// a broken tail
+func (r *Room) openJournal(dir string) {
+	j, records, err := openJournal(dir, r.ID)
+	if err != nil {
+		logger.Errorf("Unable to open journal of room %q: %v", r.ID, err)
+		return
+	}
+	for i := range records {
+		r.replayRecord(&records[i])
+	}
+	r.journal = j
+	r.snapshotJournal()
+	if len(records) > 0 {
+		logger.Infof("Room %q resumed %d files from its journal", r.ID, len(r.docs.docs))
+	}
+}
+
+func (r *Room) closeJournal() {
+	if r.journal == nil {
+		return
+	}
+	r.journal.close()
+	r.journal = nil
+}
+
+func (r *Room) replayRecord(record *journalRecord) {
+	switch {
+	case record.Snapshot:
+		state := r.docs.State(record.Path)
+		r.docs.Drop(record.Path)
+		state.Version = record.Version
+		state.history, state.authors = nil, nil
+		for _, edit := range record.History {
+			state.history = append(state.history, edit.Op)
+			state.authors = append(state.authors, edit.Author)
+		}
+		if record.Content != nil {
+			r.docs.Put(record.Path, *record.Content, record.Version)
+		}
+	case record.Edit:
+		// Edits that don't follow the previous one can't be applied
+		if r.docs.State(record.Path).Version == record.Version-1 {
+			r.docs.Apply(record.Path, record.Op, record.Author)
+		}
+	case record.Content != nil:
+		r.docs.Put(record.Path, *record.Content, record.Version)
+	case record.Drop:
+		r.docs.Drop(record.Path)
+	}
+}
+
+// Appends record to the room's journal, or snapshots the journal if it has
+// grown enough (or lost a write). Call after the record is applied to docs
+func (r *Room) journalRecord(record *journalRecord) {
+	j := r.journal
+	if j == nil {
+		return
+	}
+	if j.lost {
+		// Snapshot once the writer has caught up a bit
+		if len(j.queue) < cap(j.queue)/2 {
+			r.snapshotJournal()
+		}
+		return
+	}
+	if j.appended > j.snapshotSize+JournalCompactSize {
+		r.snapshotJournal()
+		return
+	}
+	data, err := json.Marshal(record)
+	if err != nil {
+		logger.Errorf("Error marshaling: %v", err)
+		return
+	}
+	data = append(data, '\n')
+	if !j.write(journalWrite{data: data}) {
+		j.lost = true
+		return
+	}
+	j.appended += len(data)
+}
+
+// Replaces the journal with the room's current files
+func (r *Room) snapshotJournal() {
+	j := r.journal
+	if j == nil {
+		return
+	}
+	paths := make([]string, 0, len(r.docs.docs))
+	for path := range r.docs.docs {
+		paths = append(paths, path)
+	}
+	sort.Strings(paths)
+
+	var data []byte
+	for _, path := range paths {
+		state := r.docs.docs[path]
+		record := journalRecord{Path: path, Version: state.Version, Snapshot: true}
+		for i, op := range state.history {
+			record.History = append(record.History, journalEdit{Op: op, Author: state.authors[i]})
+		}
+		if state.Doc != nil {
+			content := state.Doc.Content()
+			record.Content = &content
+		}
+		line, err := json.Marshal(&record)
+		if err != nil {
+			logger.Errorf("Error marshaling: %v", err)
+			return
+		}
+		data = append(append(data, line...), '\n')
+	}
+
+	j.lost = !j.write(journalWrite{data: data, snapshot: true})
+	if !j.lost {
+		j.appended = 0
+		j.snapshotSize = len(data)
+	}
+}
+
+// Caches content of path and journals it
+func (r *Room) putDoc(path, content string, version int) {
+	r.docs.Put(path, content, version)
+	if _, _, ok := r.docs.Get(path); ok {
+		r.journalRecord(&journalRecord{Path: path, Version: version, Content: &content})
+	} else {
+		r.journalRecord(&journalRecord{Path: path, Drop: true})
+	}
+}
+
+// Forgets every file, for the next host
+func (r *Room) clearDocs() {
+	r.docs.Clear()
+	r.snapshotJournal()
+}
@@ -0,0 +1,213 @@
+package main
+
+import (
+	"bufio"
+	"fmt"
+	"net"
+	"os"
+	"strings"
+	"testing"
+	"time"
+)
+
+// Connects to addr and sends handshake, replies are left to the caller
+func dialHandshake(addr, handshake string) (net.Conn, *bufio.Reader) {
+	conn, _ := net.Dial("tcp", addr)
+	reader := bufio.NewReader(conn)
+	fmt.Fprintln(conn, handshake)
+	return conn, reader
+}
+
+func TestJournalReplay(t *testing.T) {
+	server := NewServer()
+	dir := t.TempDir()
+	// Not running, so it's safe to use from here
+	room := newRoom(server, "journal")
+	room.openJournal(dir)
+	room.putDoc("a.c", "one\ntwo", 0)
+	for i, change := range []Change{
+		{First: 0, OldLast: 1, Lines: []string{"ONE"}},
+		{First: 2, OldLast: 2, Lines: []string{"three"}},
+	} {
+		op := opFromChange(change)
+		room.docs.Apply("a.c", op, "me")
+		room.journalRecord(&journalRecord{Path: "a.c", Version: i + 1, Edit: true, Op: op, Author: "me"})
+	}
+	room.docs.Apply("b.c", opFromChange(Change{First: 0, OldLast: 0, Lines: []string{"b"}}), "")
+	room.journalRecord(&journalRecord{Path: "b.c", Version: 1, Edit: true, Op: opFromChange(Change{First: 0, OldLast: 0, Lines: []string{"b"}})})
+	room.closeJournal()
+
+	// Crash in the middle of a write
+	path := journalPath(dir, "journal")
+	file, _ := os.OpenFile(path, os.O_WRONLY|os.O_APPEND, 0)
+	file.WriteString(`{"path":"a.c","version":3,"op":[{"ret`)
+	file.Close()
+
+	again := newRoom(server, "journal")
+	again.openJournal(dir)
+	defer again.closeJournal()
+	doc, version, ok := again.docs.Get("a.c")
+	if !ok || version != 2 || doc.Content() != "ONE\ntwo\nthree" {
+		t.Fatalf("Expected a.c at version 2, got %v %d", ok, version)
+	}
+	state := again.docs.State("a.c")
+	if ops, ok := state.since(0); !ok || len(ops) != 2 || state.authors[1] != "me" {
+		t.Fatalf("Expected history of 2 edits by me, got %d %v", len(ops), state.authors)
+	}
+	if state := again.docs.State("b.c"); state.Version != 1 || state.Doc != nil {
+		t.Fatalf("Expected b.c at version 1 without content, got %d", state.Version)
+	}
+}
+
+func TestJournalReplaysEmptyEdits(t *testing.T) {
+	server := NewServer()
+	dir := t.TempDir()
+	// Not running, so it's safe to use from here
+	room := newRoom(server, "empty")
+	room.openJournal(dir)
+	room.putDoc("a.c", "one\ntwo", 0)
+	for id := 1; id <= 2; id++ {
+		client := NewClient(nil)
+		client.ID = id
+		client.fromField = jsonField("from_id", id)
+		room.Clients[id] = client
+	}
+	edit := func(id int, line string) {
+		msg, err := parseMessage([]byte(line), true)
+		if err != nil {
+			t.Fatal(err)
+		}
+		room.updateContent(room.Clients[id], msg)
+	}
+	// Both delete the first line at once, second one is transformed away
+	edit(1, `{"event": "update_content", "path": "a.c", "version": 0, "changes": {"first": 0, "old_last": 1, "lines": []}}`)
+	edit(2, `{"event": "update_content", "path": "a.c", "version": 0, "changes": {"first": 0, "old_last": 1, "lines": []}}`)
+	edit(1, `{"event": "update_content", "path": "a.c", "version": 2, "changes": {"first": 0, "old_last": 0, "lines": ["x"]}}`)
+	live, version, _ := room.docs.Get("a.c")
+	want := live.Content()
+	room.closeJournal()
+
+	again := newRoom(server, "empty")
+	again.openJournal(dir)
+	defer again.closeJournal()
+	doc, got, ok := again.docs.Get("a.c")
+	if !ok || got != version || version != 3 || doc.Content() != want {
+		t.Fatalf("Expected a.c at version %d with %q, got %v %d %q", version, want, ok, got, doc.Content())
+	}
+}
+
+func TestJournalResume(t *testing.T) {
+	dir := t.TempDir()
+	server := NewServer()
+	server.UseJournal(dir)
+	_, addr := startTestServerWith(server)
+
+	h, hr := dialHandshake(addr, `{"event": "handshake", "name": "host", "host": true, "room": "r", "session": "h"}`)
+	hr.ReadString('\n')
+	e, er := dialHandshake(addr, `{"event": "handshake", "name": "editor", "room": "r", "session": "e"}`)
+	er.ReadString('\n')
+	hr.ReadString('\n') // user_joined
+
+	fmt.Fprintln(e, `{"event": "request_file", "path": "a.c"}`)
+	hr.ReadString('\n')
+	fmt.Fprintln(h, `{"event": "response_file", "path": "a.c", "content": "one\ntwo", "offset": 0, "version": 0, "request_id": 0}`)
+	er.ReadString('\n')
+	fmt.Fprintln(e, `{"event": "update_content", "path": "a.c", "version": 0, "changes": {"first": 0, "old_last": 1, "lines": ["ONE"]}}`)
+	er.ReadString('\n') // update_ack
+	hr.ReadString('\n')
+	fmt.Fprintln(h, `{"event": "update_content", "path": "a.c", "version": 1, "changes": {"first": 1, "old_last": 2, "lines": ["TWO"]}}`)
+	hr.ReadString('\n') // update_ack
+	er.ReadString('\n')
+	fmt.Fprintln(e, `{"event": "update_content", "path": "a.c", "version": 2, "changes": {"first": 2, "old_last": 2, "lines": ["three"]}}`)
+	er.ReadString('\n') // update_ack
+	e.Close()
+	// Server crashes once the last edit is on disk
+	defer h.Close()
+	for deadline := time.Now().Add(time.Second); ; {
+		journal, _ := os.ReadFile(journalPath(dir, "r"))
+		if strings.Contains(string(journal), `"version":3`) {
+			break
+		}
+		if time.Now().After(deadline) {
+			t.Fatalf("Last edit wasn't journaled:\n%s", journal)
+		}
+		time.Sleep(time.Millisecond)
+	}
+
+	// Server restarts, editor comes back having seen only its first edit's ack
+	restarted := NewServer()
+	restarted.UseJournal(dir)
+	_, addr = startTestServerWith(restarted)
+	e, _ = net.Dial("tcp", addr)
+	defer e.Close()
+	er = bufio.NewReader(e)
+	fmt.Fprintln(e, `{"event": "handshake", "name": "editor", "room": "r", "session": "e", "resume": {"a.c": 1}}`)
+	for _, want := range []string{
+		`{"changes":[{"first":1,"old_last":2,"lines":["TWO"]}],"event":"update_content","path":"a.c","version":2}`,
+		`{"event":"update_ack","path":"a.c","version":3}`,
+	} {
+		if got, _ := er.ReadString('\n'); strings.TrimSpace(got) != want {
+			t.Fatalf("Expected %s, got %s", want, got)
+		}
+	}
+	if got, _ := er.ReadString('\n'); !strings.Contains(got, "handshake_response") {
+		t.Fatalf("Expected handshake_response, got %s", got)
+	}
+	// Cached file survived without a host
+	fmt.Fprintln(e, `{"event": "request_file", "path": "a.c"}`)
+	if got, _ := er.ReadString('\n'); !strings.Contains(got, `"content":"ONE\nTWO\nthree"`) || !strings.Contains(got, `"version":3`) {
+		t.Fatalf("Expected cached file at version 3, got %s", got)
+	}
+}
+
+func TestHostResume(t *testing.T) {
+	// Host edits a.c once and drops, returns whether the host joining next
+	// got its files back
+	resume := func(server *Server, wait time.Duration, handshake string) bool {
+		_, addr := startTestServerWith(server)
+		h, hr := dialHandshake(addr, `{"event": "handshake", "name": "host", "host": true, "session": "h"}`)
+		hr.ReadString('\n')
+		e, er := dialHandshake(addr, `{"event": "handshake", "name": "editor"}`)
+		defer e.Close()
+		er.ReadString('\n')
+		hr.ReadString('\n') // user_joined
+
+		fmt.Fprintln(e, `{"event": "request_file", "path": "a.c"}`)
+		hr.ReadString('\n')
+		fmt.Fprintln(h, `{"event": "response_file", "path": "a.c", "content": "one", "offset": 0, "version": 0, "request_id": 0}`)
+		er.ReadString('\n')
+		fmt.Fprintln(h, `{"event": "update_content", "path": "a.c", "version": 0, "changes": {"first": 0, "old_last": 1, "lines": ["ONE"]}}`)
+		hr.ReadString('\n') // update_ack
+		er.ReadString('\n')
+		h.Close()
+		er.ReadString('\n') // host_left
+		er.ReadString('\n') // user_left
+		time.Sleep(wait)
+
+		h, hr = dialHandshake(addr, handshake)
+		defer h.Close()
+		// Files that were forgotten have no edits to send back
+		got, _ := hr.ReadString('\n')
+		if strings.Contains(got, "handshake_response") {
+			return false
+		}
+		if !strings.Contains(got, `"update_ack"`) || !strings.Contains(got, `"version":1`) {
+			t.Fatalf("Expected own edit back as update_ack, got %s", got)
+		}
+		return true
+	}
+
+	back := `{"event": "handshake", "name": "host", "host": true, "session": "h", "resume": {"a.c": 0}}`
+	if !resume(NewServer(), 0, back) {
+		t.Fatal("Expected host to resume within grace period")
+	}
+	other := NewServer()
+	if resume(other, 0, `{"event": "handshake", "name": "host", "host": true, "session": "x", "resume": {"a.c": 0}}`) {
+		t.Fatal("Expected another session to start over")
+	}
+	expired := NewServer()
+	expired.HostGrace = 10 * time.Millisecond
+	if resume(expired, 50*time.Millisecond, back) {
+		t.Fatal("Expected files to be forgotten after grace period")
+	}
+}
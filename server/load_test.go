@@ -0,0 +1,411 @@
+package main
+
+import (
+	"bufio"
+	"bytes"
+	"encoding/json"
+	"errors"
+	"fmt"
+	"math/rand"
+	"net"
+	"sort"
+	"strconv"
+	"strings"
+	"sync"
+	"sync/atomic"
+	"testing"
+	"time"
+)
+
+// Session mix replayed against a real server: a host answering request_file
+// with multi-MB files, and editors that type in bursts, move their cursors
+// on every key, open files and leave and join again mid-run
+type loadProfile struct {
+	name string
+	// Host included
+	clients int
+	// Edits sent back to back before waiting for their acks
+	burst int
+	// Cursor moves sent with every edit
+	cursorsPerEdit int
+	// Every editor requests a file every requestEvery edits, and leaves
+	// and joins again every churnEvery edits
+	requestEvery int
+	churnEvery   int
+	// Size of files host sends
+	fileSize int
+}
+
+var loadProfiles = []loadProfile{
+	{name: "pair", clients: 2, burst: 4, cursorsPerEdit: 2, requestEvery: 200, churnEvery: 1000, fileSize: 1 << 20},
+	{name: "team", clients: 8, burst: 4, cursorsPerEdit: 2, requestEvery: 200, churnEvery: 1000, fileSize: 2 << 20},
+	{name: "crowd", clients: 32, burst: 8, cursorsPerEdit: 4, requestEvery: 400, churnEvery: 1000, fileSize: 2 << 20},
+}
+
+const (
+	// Edited file, others are only requested
+	loadEditPath = "a.txt"
+	// Fan-out latencies kept for percentiles
+	maxLoadSamples = 1 << 18
+	// How long an editor waits for its acks or files before giving up
+	loadTimeout = 10 * time.Second
+	// Messages are recognized from this many bytes at both ends, they can
+	// be megabytes long
+	loadPeekSize = 512
+)
+
+var loadPaths = []string{loadEditPath, "b.txt", "c.txt", "d.txt", "e.txt", "f.txt", "g.txt", "h.txt"}
+
+type loadRun struct {
+	addr    string
+	profile loadProfile
+	// Json encoded parts of the files host sends, and their lengths
+	parts [][]byte
+	sizes []int
+
+	delivered atomic.Uint64
+	files     atomic.Uint64
+	// Reservoir of fan-out latencies of edits
+	mu        sync.Mutex
+	latencies []time.Duration
+	seen      int64
+	rng       *rand.Rand
+}
+
+func newLoadRun(addr string, profile loadProfile) *loadRun {
+	content := strings.Repeat(strings.Repeat("x", 79)+"\n", profile.fileSize/80)
+	l := &loadRun{addr: addr, profile: profile, rng: rand.New(rand.NewSource(0))}
+	for _, part := range splitContent(content, FileChunkSize) {
+		encoded, _ := json.Marshal(part)
+		l.parts = append(l.parts, encoded)
+		l.sizes = append(l.sizes, len(part))
+	}
+	return l
+}
+
+func (l *loadRun) record(latency time.Duration) {
+	l.mu.Lock()
+	defer l.mu.Unlock()
+	l.seen++
+	if len(l.latencies) < maxLoadSamples {
+		l.latencies = append(l.latencies, latency)
+	} else if i := l.rng.Int63n(l.seen); i < maxLoadSamples {
+		l.latencies[i] = latency
+	}
+}
+
+type loadClient struct {
+	run  *loadRun
+	conn net.Conn
+	w    *bufio.Writer
+	host bool
+	// Host's latest version of the edited file
+	version atomic.Int64
+	// Signaled by reader for every update_ack and last part of a file
+	acks  chan struct{}
+	files chan struct{}
+	// Requests for host to answer
+	requests chan []byte
+	// Closed when reader stops
+	done chan struct{}
+}
+
+var (
+	loadUpdateAck     = []byte(`"event":"update_ack"`)
+	loadUpdateContent = []byte(`"event":"update_content"`)
+	loadResponseFile  = []byte(`"event":"response_file"`)
+	loadRequestFile   = []byte(`"event":"request_file"`)
+	loadMore          = []byte(`"more":true`)
+)
+
+// Reports whether pattern is near either end of line
+func peekContains(line, pattern []byte) bool {
+	if len(line) <= 2*loadPeekSize {
+		return bytes.Contains(line, pattern)
+	}
+	return bytes.Contains(line[:loadPeekSize], pattern) || bytes.Contains(line[len(line)-loadPeekSize:], pattern)
+}
+
+// Returns number value of key from the start of line
+func peekNumber(line []byte, key string) (float64, bool) {
+	head := line[:min(len(line), loadPeekSize)]
+	i := bytes.Index(head, []byte(`"`+key+`":`))
+	if i < 0 {
+		return 0, false
+	}
+	start := i + len(key) + 3
+	end := start
+	for end < len(head) && bytes.IndexByte([]byte("-+.eE0123456789"), head[end]) >= 0 {
+		end++
+	}
+	n, err := strconv.ParseFloat(string(head[start:end]), 64)
+	return n, err == nil
+}
+
+// Reads next line into buf, reusing it
+func readLoadLine(r *bufio.Reader, buf []byte) ([]byte, error) {
+	buf = buf[:0]
+	for {
+		chunk, err := r.ReadSlice('\n')
+		buf = append(buf, chunk...)
+		if err != bufio.ErrBufferFull {
+			return buf, err
+		}
+	}
+}
+
+func (l *loadRun) join(name string, host bool) (*loadClient, error) {
+	conn, err := net.Dial("tcp", l.addr)
+	if err != nil {
+		return nil, err
+	}
+	fmt.Fprintf(conn, `{"event":"handshake","name":%q,"host":%t}`+"\n", name, host)
+	r := bufio.NewReaderSize(conn, 64*1024)
+	for {
+		line, err := readLoadLine(r, nil)
+		if err != nil {
+			conn.Close()
+			return nil, err
+		}
+		if bytes.Contains(line, []byte(`"event":"handshake_response"`)) {
+			break
+		}
+	}
+
+	c := &loadClient{
+		run:      l,
+		conn:     conn,
+		w:        bufio.NewWriter(conn),
+		host:     host,
+		acks:     make(chan struct{}, 1024),
+		files:    make(chan struct{}, 16),
+		requests: make(chan []byte, 64),
+		done:     make(chan struct{}),
+	}
+	go c.read(r)
+	if host {
+		// Answers from its own goroutine, so that host keeps reading while
+		// it sends files
+		go c.respond()
+	}
+	return c, nil
+}
+
+func (c *loadClient) read(r *bufio.Reader) {
+	defer close(c.done)
+	defer close(c.requests)
+	var line []byte
+	for {
+		var err error
+		line, err = readLoadLine(r, line)
+		if err != nil {
+			return
+		}
+		now := time.Now()
+		c.run.delivered.Add(1)
+
+		switch {
+		case peekContains(line, loadUpdateAck):
+			c.acks <- struct{}{}
+		case peekContains(line, loadUpdateContent):
+			if sent, ok := peekNumber(line, "sent"); ok {
+				c.run.record(now.Sub(time.UnixMicro(int64(sent * 1000))))
+			}
+			if version, ok := peekNumber(line, "version"); ok && c.host {
+				c.version.Store(int64(version))
+			}
+		case peekContains(line, loadResponseFile):
+			if !peekContains(line, loadMore) {
+				c.run.files.Add(1)
+				c.files <- struct{}{}
+			}
+		case c.host && peekContains(line, loadRequestFile):
+			c.requests <- append([]byte(nil), line...)
+		}
+	}
+}
+
+func (c *loadClient) respond() {
+	for line := range c.requests {
+		var request struct {
+			RequestID int    `json:"request_id"`
+			Path      string `json:"path"`
+		}
+		if json.Unmarshal(line, &request) != nil {
+			continue
+		}
+		var version int64
+		if request.Path == loadEditPath {
+			version = c.version.Load()
+		}
+
+		offset := 0
+		for i, part := range c.run.parts {
+			more := i < len(c.run.parts)-1
+			fmt.Fprintf(c.w, `{"event":"response_file","path":%q,"request_id":%d,"version":%d,"offset":%d,"more":%t,"content":%s}`+"\n",
+				request.Path, request.RequestID, version, offset, more, part)
+			offset += c.run.sizes[i]
+		}
+		if c.w.Flush() != nil {
+			return
+		}
+	}
+}
+
+// Waits for n signals from ch
+func (c *loadClient) wait(ch chan struct{}, n int, what string) error {
+	timeout := time.NewTimer(loadTimeout)
+	defer timeout.Stop()
+	for i := 0; i < n; i++ {
+		select {
+		case <-ch:
+		case <-c.done:
+			return errors.New("disconnected while waiting for " + what)
+		case <-timeout.C:
+			return fmt.Errorf("timed out waiting for %s (%d of %d)", what, i, n)
+		}
+	}
+	return nil
+}
+
+func (c *loadClient) close() {
+	c.conn.Close()
+	<-c.done
+}
+
+// Sends edits, cursors and requests of one editor
+func (l *loadRun) edit(id, edits int) error {
+	p := l.profile
+	name := fmt.Sprintf("load-%d", id)
+	c, err := l.join(name, false)
+	if err != nil {
+		return err
+	}
+	defer func() { c.close() }()
+
+	requests := id
+	for sent := 0; sent < edits; {
+		n := min(p.burst, edits-sent)
+		for i := 0; i < n; i++ {
+			line := (sent + i) % 100
+			for j := 0; j < p.cursorsPerEdit; j++ {
+				fmt.Fprintf(c.w, `{"event":"cursor_move","path":%q,"position":[%d,%d]}`+"\n", loadEditPath, line, j)
+			}
+			now := unixMillis(time.Now())
+			fmt.Fprintf(c.w, `{"event":"update_content","path":%q,"changes":{"first":0,"col":0,"delete":0,"text":"x"},"trace":{"origin":%.3f,"sent":%.3f}}`+"\n",
+				loadEditPath, now, now)
+		}
+		if err := c.w.Flush(); err != nil {
+			return err
+		}
+		if err := c.wait(c.acks, n, "acks"); err != nil {
+			return fmt.Errorf("%s: %w", name, err)
+		}
+		sent += n
+
+		if sent/p.requestEvery != (sent-n)/p.requestEvery {
+			path := loadPaths[requests%len(loadPaths)]
+			requests++
+			fmt.Fprintf(c.w, `{"event":"request_file","path":%q}`+"\n", path)
+			if err := c.w.Flush(); err != nil {
+				return err
+			}
+			if err := c.wait(c.files, 1, path); err != nil {
+				return fmt.Errorf("%s: %w", name, err)
+			}
+		}
+		if sent < edits && sent/p.churnEvery != (sent-n)/p.churnEvery {
+			c.close()
+			if c, err = l.join(name, false); err != nil {
+				return err
+			}
+		}
+	}
+	return nil
+}
+
+type loadResult struct {
+	edits     int
+	elapsed   time.Duration
+	delivered uint64
+	files     uint64
+	p50, p99  time.Duration
+}
+
+// Runs profile with edits per editor, host included in clients
+func runSessionMix(tb testing.TB, addr string, p loadProfile, edits int, start func()) loadResult {
+	l := newLoadRun(addr, p)
+	host, err := l.join("load-host", true)
+	if err != nil {
+		tb.Fatal(err)
+	}
+	defer host.close()
+
+	editors := p.clients - 1
+	errs := make(chan error, editors)
+	start()
+	began := time.Now()
+	for i := 0; i < editors; i++ {
+		go func(id int) { errs <- l.edit(id, edits) }(i)
+	}
+	for i := 0; i < editors; i++ {
+		if err := <-errs; err != nil {
+			tb.Fatal(err)
+		}
+	}
+
+	res := loadResult{
+		edits:     editors * edits,
+		elapsed:   time.Since(began),
+		delivered: l.delivered.Load(),
+		files:     l.files.Load(),
+	}
+	sort.Slice(l.latencies, func(i, j int) bool { return l.latencies[i] < l.latencies[j] })
+	if n := len(l.latencies); n > 0 {
+		res.p50 = l.latencies[n/2]
+		res.p99 = l.latencies[min(n*99/100, n-1)]
+	}
+	return res
+}
+
+func TestSessionMix(t *testing.T) {
+	server, addr := startTestServer()
+	p := loadProfile{name: "test", clients: 4, burst: 4, cursorsPerEdit: 2, requestEvery: 20, churnEvery: 50, fileSize: 256 << 10}
+	res := runSessionMix(t, addr, p, 100, func() {})
+
+	// Every editor requested 5 files
+	if res.files != 15 {
+		t.Fatalf("Expected 15 files, got %d", res.files)
+	}
+	if res.p50 <= 0 || res.p99 < res.p50 {
+		t.Fatalf("Expected fan-out latencies, got p50 %v p99 %v", res.p50, res.p99)
+	}
+	if n := server.Stats.ReliableDisconnects.Load(); n > 0 {
+		t.Fatalf("Expected no disconnects, got %d", n)
+	}
+}
+
+// Reports edits and delivered messages per second, fan-out latency of edits
+// (sent to received by another client) and how often queues overflowed
+func BenchmarkSessionMix(b *testing.B) {
+	for _, p := range loadProfiles {
+		b.Run(p.name, func(b *testing.B) {
+			server, addr := startTestServer()
+			edits := max(b.N/(p.clients-1), 1)
+			res := runSessionMix(b, addr, p, edits, func() {
+				b.ReportAllocs()
+				b.ResetTimer()
+			})
+			b.StopTimer()
+
+			seconds := res.elapsed.Seconds()
+			b.ReportMetric(float64(res.edits)/seconds, "edits/sec")
+			b.ReportMetric(float64(res.delivered)/seconds, "msg/sec")
+			b.ReportMetric(float64(res.p50.Microseconds()), "p50-us")
+			b.ReportMetric(float64(res.p99.Microseconds()), "p99-us")
+			b.ReportMetric(float64(server.Stats.ReliableFull.Load()), "full")
+			b.ReportMetric(float64(server.Stats.ReliableDisconnects.Load()), "disconnects")
+			b.ReportMetric(float64(server.Stats.CursorsConflated.Load()), "conflated")
+		})
+	}
+}
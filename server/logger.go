@@ -0,0 +1,130 @@
+package main
+
+import (
+	"fmt"
+	"log"
+	"strings"
+	"sync/atomic"
+)
+
+type LogLevel int32
+
+const (
+	LevelOff LogLevel = iota
+	LevelError
+	LevelInfo
+	// Logs message payloads, very noisy
+	LevelDebug
+)
+
+const (
+	DefaultLogLevel   = LevelInfo
+	DefaultLogSample  = 1
+	DefaultLogPreview = 256
+	// Entries waiting for the logger goroutine
+	logQueueSize = 4096
+)
+
+func ParseLogLevel(name string) (LogLevel, error) {
+	switch strings.ToLower(name) {
+	case "off":
+		return LevelOff, nil
+	case "error":
+		return LevelError, nil
+	case "info":
+		return LevelInfo, nil
+	case "debug":
+		return LevelDebug, nil
+	}
+	return LevelOff, fmt.Errorf("unknown log level %q", name)
+}
+
+type logEntry struct {
+	format string
+	args   []any
+}
+
+// Asynchronous leveled logger. Formatting and writing happens in its own
+// goroutine, so logging never slows down routing. Entries are dropped
+// instead of waited on if the queue is full, payload logs are also sampled
+// and truncated
+type Logger struct {
+	level atomic.Int32
+	// Log every Nth payload
+	sample atomic.Uint64
+	// Max logged bytes of a payload
+	preview atomic.Int64
+	seen    atomic.Uint64
+	// Logs dropped because queue was full
+	Dropped atomic.Uint64
+	entries chan logEntry
+	print   func(string)
+}
+
+var logger = NewLogger(func(line string) { log.Print(line) })
+
+func NewLogger(print func(string)) *Logger {
+	l := &Logger{
+		entries: make(chan logEntry, logQueueSize),
+		print:   print,
+	}
+	l.Configure(DefaultLogLevel, DefaultLogSample, DefaultLogPreview)
+	go l.run()
+	return l
+}
+
+func (l *Logger) Configure(level LogLevel, sample, preview int) {
+	l.level.Store(int32(level))
+	l.sample.Store(uint64(max(sample, 1)))
+	l.preview.Store(int64(max(preview, 0)))
+}
+
+func (l *Logger) run() {
+	for e := range l.entries {
+		l.print(fmt.Sprintf(e.format, e.args...))
+	}
+}
+
+func (l *Logger) Enabled(level LogLevel) bool {
+	return level != LevelOff && LogLevel(l.level.Load()) >= level
+}
+
+func (l *Logger) Errorf(format string, args ...any) {
+	if l.Enabled(LevelError) {
+		l.queue(logEntry{format, args})
+	}
+}
+
+func (l *Logger) Infof(format string, args ...any) {
+	if l.Enabled(LevelInfo) {
+		l.queue(logEntry{format, args})
+	}
+}
+
+// Queues entry without waiting, a stalled output must not block rooms
+func (l *Logger) queue(e logEntry) {
+	select {
+	case l.entries <- e:
+	default:
+		l.Dropped.Add(1)
+	}
+}
+
+// Logs a sample of message payloads at debug level. Only a preview of the
+// payload is copied, so multi-MB files cost the same as cursors
+func (l *Logger) Payload(what, peer string, payload []byte) {
+	if !l.Enabled(LevelDebug) {
+		return
+	}
+	if l.seen.Add(1)%l.sample.Load() != 0 {
+		return
+	}
+
+	size := len(payload)
+	if limit := int(l.preview.Load()); size > limit {
+		payload = payload[:limit]
+	}
+	preview := string(payload)
+
+	l.queue(logEntry{"%s %s: %q (%d bytes)", []any{what, peer, preview, size}})
+}
@@ -0,0 +1,101 @@
+package main
+
+import (
+	"strings"
+	"testing"
+	"time"
+)
+
+func TestLoggerLevels(t *testing.T) {
+	lines := make(chan string, 16)
+	l := NewLogger(func(line string) { lines <- line })
+
+	l.Payload("RECEIVED from", "peer", []byte(`{"event": "cursor_move"}`))
+	l.Infof("info %d", 1)
+	if line := <-lines; line != "info 1" {
+		t.Fatalf("Expected only info line by default, got %q", line)
+	}
+
+	l.Configure(LevelError, 1, 0)
+	l.Infof("hidden")
+	l.Errorf("error %s", "shown")
+	if line := <-lines; line != "error shown" {
+		t.Fatalf("Info should be hidden on error level, got %q", line)
+	}
+
+	l.Configure(LevelOff, 1, 0)
+	l.Errorf("hidden")
+	select {
+	case line := <-lines:
+		t.Fatalf("Nothing should be logged when off, got %q", line)
+	case <-time.After(20 * time.Millisecond):
+	}
+}
+
+func TestLoggerPayloadPreviewAndSampling(t *testing.T) {
+	lines := make(chan string, 16)
+	l := NewLogger(func(line string) { lines <- line })
+	l.Configure(LevelDebug, 3, 8)
+
+	big := []byte(`{"event": "response_file", "content": "` + strings.Repeat("a", 1<<20) + `"}`)
+	for i := 0; i < 6; i++ {
+		l.Payload("SEND to", "kissa", big)
+	}
+
+	for i := 0; i < 2; i++ {
+		line := <-lines
+		if want := `SEND to kissa: "{\"event\"" (`; !strings.HasPrefix(line, want) {
+			t.Fatalf("Expected truncated preview %q, got %q", want, line)
+		}
+		if len(line) > 64 {
+			t.Fatalf("Preview is not bounded: %d bytes", len(line))
+		}
+	}
+	select {
+	case line := <-lines:
+		t.Fatalf("Only every 3rd payload should be logged, got extra %q", line)
+	case <-time.After(20 * time.Millisecond):
+	}
+}
+
+func TestLoggerNeverBlocks(t *testing.T) {
+	stalled := make(chan struct{})
+	defer close(stalled)
+	l := NewLogger(func(string) { <-stalled })
+
+	done := make(chan struct{})
+	go func() {
+		for i := 0; i < 2*logQueueSize; i++ {
+			l.Errorf("error %d", i)
+		}
+		close(done)
+	}()
+	select {
+	case <-done:
+	case <-time.After(time.Second):
+		t.Fatal("Logging blocked on a stalled output")
+	}
+	if l.Dropped.Load() == 0 {
+		t.Fatal("Expected dropped entries to be counted")
+	}
+}
+
+func TestParseLogLevel(t *testing.T) {
+	for name, want := range map[string]LogLevel{"off": LevelOff, "ERROR": LevelError, "info": LevelInfo, "debug": LevelDebug} {
+		if got, err := ParseLogLevel(name); err != nil || got != want {
+			t.Errorf("ParseLogLevel(%q) = %v, %v", name, got, err)
+		}
+	}
+	if _, err := ParseLogLevel("loud"); err == nil {
+		t.Error("Unknown level was accepted")
+	}
+}
+
+func BenchmarkLoggerPayloadDisabled(b *testing.B) {
+	l := NewLogger(func(string) {})
+	payload := []byte(`{"event": "cursor_move", "position": [10,10]}`)
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		l.Payload("RECEIVED from", "peer", payload)
+	}
+}
@@ -0,0 +1,248 @@
+package main
+
+import (
+	"bytes"
+	"encoding/json"
+	"errors"
+	"strconv"
+	"time"
+)
+
+// Fields of a message that server needs for routing, everything else is
+// forwarded as is
+type Envelope struct {
+	Event     string   `json:"event"`
+	RequestID *float64 `json:"request_id"`
+	// Response is streamed, more parts with the same request_id follow
+	More bool `json:"more"`
+	// File the event is about, used by the document cache
+	Path string `json:"path"`
+	// Only used by handshake
+	Name string `json:"name"`
+	Host bool   `json:"host"`
+	Room string `json:"room"`
+	// Becomes host if the host leaves
+	Standby bool `json:"standby"`
+	// Only subscribed files are sent to client
+	Subscriptions bool `json:"subscriptions"`
+	// Random id client keeps over reconnects, so that its own edits are
+	// told apart when it resumes
+	Session string `json:"session"`
+	// Path -> version of files client had before reconnecting
+	Resume map[string]int `json:"resume"`
+	// "length" asks server to use length-prefixed frames
+	Framing string `json:"framing"`
+	// "zlib" asks server to compress large frames
+	Compression string `json:"compression"`
+	// "disconnect" or "resync", what server does if client can't keep up
+	Overflow string `json:"overflow"`
+	// Only on traced update_content and cursor_move
+	Trace *Trace `json:"trace"`
+}
+
+// Timestamps of a traced message in Unix milliseconds. Sender sets origin
+// (when the edit or move was made) and sent, server adds the rest
+type Trace struct {
+	Origin    float64 `json:"origin"`
+	Sent      float64 `json:"sent"`
+	Received  float64 `json:"received"`
+	Forwarded float64 `json:"forwarded"`
+}
+
+func unixMillis(t time.Time) float64 {
+	return float64(t.UnixMicro()) / 1000
+}
+
+// Stamps forwarding time on traced message and returns its pre-encoded
+// trace member, nil if message isn't traced
+func traceField(msg *Message) []byte {
+	if msg.Trace == nil {
+		return nil
+	}
+	msg.Trace.Forwarded = unixMillis(time.Now())
+	return jsonField("trace", msg.Trace)
+}
+
+// Message as received, Raw is the original json object without delimiter
+type Message struct {
+	Envelope
+	Raw []byte
+}
+
+// Decodes envelope from line. Wrong field types are treated like missing
+// fields (same as before with map[string]any), only malformed json or
+// non-objects are rejected. Line is copied unless it's owned by the caller
+func parseMessage(line []byte, owned bool) (*Message, error) {
+	if i := skipSpace(line, 0); i >= len(line) || line[i] != '{' {
+		return nil, errors.New("message is not a json object")
+	}
+
+	msg := &Message{}
+	if err := json.Unmarshal(line, &msg.Envelope); err != nil {
+		var typeErr *json.UnmarshalTypeError
+		if !errors.As(err, &typeErr) {
+			return nil, err
+		}
+	}
+	// Reader reuses its buffer, so keep our own copy
+	if !owned {
+		line = append([]byte(nil), line...)
+	}
+	msg.Raw = line
+	return msg, nil
+}
+
+// Pre-encodes `"key":value` member for spliceObject
+func jsonField(key string, value any) []byte {
+	// Versions are stamped on every edit, don't go through reflection
+	if n, ok := value.(int); ok {
+		field := strconv.AppendQuote(make([]byte, 0, len(key)+24), key)
+		field = append(field, ':')
+		return strconv.AppendInt(field, int64(n), 10)
+	}
+	enc, err := json.Marshal(value)
+	if err != nil {
+		// Only called with ints, strings and plain structs
+		panic(err)
+	}
+	field := strconv.AppendQuote(make([]byte, 0, len(key)+len(enc)+3), key)
+	field = append(field, ':')
+	return append(field, enc...)
+}
+
+// Returns copy of json object raw (newline terminated) without the top
+// level members in drop and with pre-encoded extra members added first. Raw
+// must be valid json, which parseMessage has already checked
+func spliceObject(raw []byte, drop []string, extra ...[]byte) []byte {
+	size := len(raw) + 2
+	for _, field := range extra {
+		size += len(field) + 1
+	}
+
+	out := make([]byte, 0, size)
+	out = append(out, '{')
+	for i, field := range extra {
+		if i > 0 {
+			out = append(out, ',')
+		}
+		out = append(out, field...)
+	}
+	empty := len(extra) == 0
+
+	// Skip the opening brace
+	i := skipSpace(raw, 0) + 1
+	for {
+		i = skipSpace(raw, i)
+		if i >= len(raw) || raw[i] != '"' {
+			break
+		}
+		start := i
+		keyEnd := skipString(raw, i)
+		key := raw[start+1 : keyEnd-1]
+		// Skip colon
+		i = skipSpace(raw, keyEnd) + 1
+		i = skipValue(raw, skipSpace(raw, i))
+		end := i
+
+		if !hasKey(drop, key) {
+			if !empty {
+				out = append(out, ',')
+			}
+			out = append(out, raw[start:end]...)
+			empty = false
+		}
+
+		i = skipSpace(raw, i)
+		if i < len(raw) && raw[i] == ',' {
+			i++
+		}
+	}
+
+	return append(out, '}', '\n')
+}
+
+// Compares raw (possibly escaped) object key against list of keys
+func hasKey(keys []string, raw []byte) bool {
+	if bytes.IndexByte(raw, '\\') >= 0 {
+		// Escaped "from_id" is still from_id
+		var key string
+		quoted := make([]byte, 0, len(raw)+2)
+		quoted = append(append(append(quoted, '"'), raw...), '"')
+		if err := json.Unmarshal(quoted, &key); err != nil {
+			return false
+		}
+		raw = []byte(key)
+	}
+	for _, k := range keys {
+		// Comparison doesn't allocate
+		if string(raw) == k {
+			return true
+		}
+	}
+	return false
+}
+
+func skipSpace(b []byte, i int) int {
+	for i < len(b) {
+		switch b[i] {
+		case ' ', '\t', '\r', '\n':
+			i++
+		default:
+			return i
+		}
+	}
+	return i
+}
+
+// Returns index after the string starting at b[i] (opening quote)
+func skipString(b []byte, i int) int {
+	for i++; i < len(b); i++ {
+		switch b[i] {
+		case '\\':
+			i++
+		case '"':
+			return i + 1
+		}
+	}
+	return i
+}
+
+// Returns index after the value starting at b[i]
+func skipValue(b []byte, i int) int {
+	if i >= len(b) {
+		return i
+	}
+
+	switch b[i] {
+	case '"':
+		return skipString(b, i)
+	case '{', '[':
+		depth := 0
+		for i < len(b) {
+			switch b[i] {
+			case '"':
+				i = skipString(b, i)
+				continue
+			case '{', '[':
+				depth++
+			case '}', ']':
+				depth--
+				if depth == 0 {
+					return i + 1
+				}
+			}
+			i++
+		}
+		return i
+	default:
+		// Numbers, true, false and null
+		for i < len(b) {
+			switch b[i] {
+			case ',', '}', ']', ' ', '\t', '\r', '\n':
+				return i
+			}
+			i++
+		}
+		return i
+	}
+}
@@ -0,0 +1,107 @@
+package main
+
+import (
+	"encoding/json"
+	"reflect"
+	"testing"
+)
+
+func TestParseMessage(t *testing.T) {
+	msg, err := parseMessage([]byte(`{"event": "response_file", "request_id": 3, "content": "a\nb"}`), false)
+	if err != nil {
+		t.Fatal(err)
+	}
+	if msg.Event != "response_file" || msg.RequestID == nil || *msg.RequestID != 3 {
+		t.Fatalf("Wrong envelope: %+v", msg.Envelope)
+	}
+
+	// Wrong types are ignored like before, not rejected
+	msg, err = parseMessage([]byte(`{"event": "handshake", "name": 5, "host": "yes"}`), false)
+	if err != nil || msg.Event != "handshake" || msg.Name != "" || msg.Host {
+		t.Fatalf("Mistyped fields should be treated as missing: %+v, %v", msg, err)
+	}
+
+	for _, line := range []string{`[1, 2]`, `null`, `"event"`, `{"event": `, ``} {
+		if _, err := parseMessage([]byte(line), false); err == nil {
+			t.Errorf("Expected %q to be rejected", line)
+		}
+	}
+}
+
+func TestSpliceObject(t *testing.T) {
+	tests := []struct {
+		raw   string
+		drop  []string
+		extra [][]byte
+		want  map[string]any
+	}{
+		{
+			raw:   `{"event":"cursor_move","position":[10,10]}`,
+			drop:  originKeys,
+			extra: [][]byte{jsonField("from_id", 2), jsonField("name", "hauva")},
+			want: map[string]any{
+				"event": "cursor_move", "position": []any{10.0, 10.0},
+				"from_id": 2.0, "name": "hauva",
+			},
+		},
+		{
+			// Spoofed fields are replaced, nested ones are left alone
+			raw:   ` { "name" : "roisto", "event": "update_content", "changes": {"name": "x", "lines": ["}", "\"{"]}, "from_id": 0 } `,
+			drop:  originKeys,
+			extra: [][]byte{jsonField("from_id", 1), jsonField("name", "kissa")},
+			want: map[string]any{
+				"event": "update_content", "from_id": 1.0, "name": "kissa",
+				"changes": map[string]any{"name": "x", "lines": []any{"}", `"{`}},
+			},
+		},
+		{
+			raw:  `{"request_id":4,"event":"response_files","files":["a.c"]}`,
+			drop: requestKeys[:1],
+			want: map[string]any{"event": "response_files", "files": []any{"a.c"}},
+		},
+		{
+			// Escaped keys still match
+			raw:  `{"request\u005fid":4}`,
+			drop: requestKeys[:1],
+			want: map[string]any{},
+		},
+		{
+			raw:   `{}`,
+			extra: [][]byte{jsonField("request_id", 7)},
+			want:  map[string]any{"request_id": 7.0},
+		},
+	}
+
+	for _, tt := range tests {
+		out := spliceObject([]byte(tt.raw), tt.drop, tt.extra...)
+		if out[len(out)-1] != '\n' {
+			t.Errorf("Missing newline in %q", out)
+		}
+		var got map[string]any
+		if err := json.Unmarshal(out, &got); err != nil {
+			t.Errorf("Invalid json %q: %v", out, err)
+			continue
+		}
+		if !reflect.DeepEqual(got, tt.want) {
+			t.Errorf("spliceObject(%s) = %s, want %v", tt.raw, out, tt.want)
+		}
+	}
+}
+
+func TestJSONField(t *testing.T) {
+	for _, value := range []any{12, -1, "nimi", &Trace{Origin: 1.5}} {
+		enc, _ := json.Marshal(value)
+		if got := jsonField("key", value); string(got) != `"key":`+string(enc) {
+			t.Errorf("jsonField(%v) = %s", value, got)
+		}
+	}
+}
+
+func BenchmarkSpliceObject(b *testing.B) {
+	raw := []byte(`{"event": "cursor_move", "position": [10,10], "path": "server/server.go"}`)
+	from, name := jsonField("from_id", 1), jsonField("name", "hauva")
+	b.ReportAllocs()
+	for i := 0; i < b.N; i++ {
+		spliceObject(raw, originKeys, from, name)
+	}
+}
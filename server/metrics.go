@@ -0,0 +1,278 @@
+package main
+
+import (
+	"bytes"
+	"context"
+	"fmt"
+	"io"
+	"net/http"
+	"sort"
+	"strings"
+	"sync/atomic"
+	"time"
+)
+
+// How long a scrape waits for rooms to report their state
+const metricsTimeout = time.Second
+
+// Events counted by name, everything else is counted as "other" so that
+// clients can't make up new series
+var metricEvents = [...]string{
+	"handshake",
+	"update_content",
+	"sync_file",
+	"cursor_move",
+	"cursor_leave",
+	"remote_write",
+	"request_files",
+	"response_files",
+	"request_file",
+	"response_file",
+}
+
+// Upper bounds of latency histogram buckets
+var latencyBuckets = []time.Duration{
+	10 * time.Microsecond,
+	50 * time.Microsecond,
+	100 * time.Microsecond,
+	500 * time.Microsecond,
+	time.Millisecond,
+	5 * time.Millisecond,
+	10 * time.Millisecond,
+	50 * time.Millisecond,
+	100 * time.Millisecond,
+	500 * time.Millisecond,
+	time.Second,
+	5 * time.Second,
+}
+
+// Server wide counters, safe to update from any goroutine. Queue depths are
+// read when scraped
+type Metrics struct {
+	// Messages received by event, indexed like metricEvents, last is other
+	received      [len(metricEvents) + 1]atomic.Uint64
+	receivedBytes atomic.Uint64
+	// Time messages wait in a room's inbox
+	QueueWait *histogram
+	// Time room loop takes to handle a message
+	Handle *histogram
+}
+
+func NewMetrics() *Metrics {
+	return &Metrics{
+		QueueWait: newHistogram(latencyBuckets),
+		Handle:    newHistogram(latencyBuckets),
+	}
+}
+
+// Counts a message from a client
+func (m *Metrics) Received(event string, size int) {
+	i := 0
+	for i < len(metricEvents) && metricEvents[i] != event {
+		i++
+	}
+	m.received[i].Add(1)
+	m.receivedBytes.Add(uint64(size))
+}
+
+// Fixed bucket histogram of durations
+type histogram struct {
+	bounds []time.Duration
+	// One per bound and the last one for larger values, not cumulative
+	counts []atomic.Uint64
+	// Nanoseconds
+	sum atomic.Int64
+}
+
+func newHistogram(bounds []time.Duration) *histogram {
+	return &histogram{bounds: bounds, counts: make([]atomic.Uint64, len(bounds)+1)}
+}
+
+func (h *histogram) Observe(d time.Duration) {
+	i := 0
+	for i < len(h.bounds) && d > h.bounds[i] {
+		i++
+	}
+	h.counts[i].Add(1)
+	h.sum.Add(int64(d))
+}
+
+func (h *histogram) write(w io.Writer, name, help string) {
+	writeHeader(w, name, "histogram", help)
+	var total uint64
+	for i, bound := range h.bounds {
+		total += h.counts[i].Load()
+		fmt.Fprintf(w, "%s_bucket{le=\"%g\"} %d\n", name, bound.Seconds(), total)
+	}
+	total += h.counts[len(h.bounds)].Load()
+	fmt.Fprintf(w, "%s_bucket{le=\"+Inf\"} %d\n", name, total)
+	fmt.Fprintf(w, "%s_sum %g\n", name, time.Duration(h.sum.Load()).Seconds())
+	fmt.Fprintf(w, "%s_count %d\n", name, total)
+}
+
+// State of a room, taken on its own goroutine
+type roomSnapshot struct {
+	id      string
+	clients []clientSnapshot
+	pending int
+	inbox   int
+	actions int
+}
+
+type clientSnapshot struct {
+	id    int
+	name  string
+	queue int
+	stats *LaneStats
+}
+
+func (r *Room) snapshot() roomSnapshot {
+	snap := roomSnapshot{
+		id:      r.ID,
+		pending: len(r.PendingRequests),
+		inbox:   len(r.inbox),
+		actions: len(r.actions),
+	}
+	for _, client := range r.Clients {
+		snap.clients = append(snap.clients, clientSnapshot{
+			id:    client.ID,
+			name:  client.Name,
+			queue: len(client.Send),
+			stats: &client.Stats,
+		})
+	}
+	sort.Slice(snap.clients, func(i, j int) bool { return snap.clients[i].id < snap.clients[j].id })
+	return snap
+}
+
+// Asks every room for its state. Rooms that don't answer in time (busy or
+// just stopped) are left out
+func (s *Server) snapshotRooms() []roomSnapshot {
+	s.roomsMu.Lock()
+	rooms := make([]*Room, 0, len(s.rooms))
+	for _, room := range s.rooms {
+		rooms = append(rooms, room)
+	}
+	s.roomsMu.Unlock()
+
+	// Buffered so that late rooms don't block on it
+	results := make(chan roomSnapshot, len(rooms))
+	ctx, cancel := context.WithTimeout(context.Background(), metricsTimeout)
+	defer cancel()
+
+	asked := 0
+ask:
+	for _, room := range rooms {
+		room := room
+		select {
+		case room.actions <- func() { results <- room.snapshot() }:
+			asked++
+		case <-ctx.Done():
+			break ask
+		}
+	}
+
+	var snaps []roomSnapshot
+	for len(snaps) < asked {
+		select {
+		case snap := <-results:
+			snaps = append(snaps, snap)
+		case <-ctx.Done():
+			asked = len(snaps)
+		}
+	}
+	sort.Slice(snaps, func(i, j int) bool { return snaps[i].id < snaps[j].id })
+	return snaps
+}
+
+// Writes metrics in Prometheus text format
+func (s *Server) ServeMetrics(w http.ResponseWriter, _ *http.Request) {
+	var out bytes.Buffer
+	s.writeMetrics(&out)
+	w.Header().Set("Content-Type", "text/plain; version=0.0.4")
+	w.Write(out.Bytes())
+}
+
+func (s *Server) writeMetrics(w io.Writer) {
+	m := s.Metrics
+	// First, so that counters include what rooms did before answering
+	snaps := s.snapshotRooms()
+
+	writeHeader(w, "cesp_messages_received_total", "counter", "Messages received from clients by event.")
+	for i := range m.received {
+		event := "other"
+		if i < len(metricEvents) {
+			event = metricEvents[i]
+		}
+		fmt.Fprintf(w, "cesp_messages_received_total{event=%q} %d\n", event, m.received[i].Load())
+	}
+	writeHeader(w, "cesp_received_bytes_total", "counter", "Bytes of messages received from clients.")
+	fmt.Fprintf(w, "cesp_received_bytes_total %d\n", m.receivedBytes.Load())
+
+	writeCounter(w, "cesp_reliable_full_total", "Reliable messages that found a client's queue full.", s.Stats.ReliableFull.Load())
+	writeCounter(w, "cesp_reliable_disconnects_total", "Clients disconnected because their queue was full.", s.Stats.ReliableDisconnects.Load())
+	writeCounter(w, "cesp_resyncs_total", "Times a client's messages were dropped and it was told to resync.", s.Stats.Resyncs.Load())
+	writeCounter(w, "cesp_write_timeouts_total", "Clients disconnected because a write took longer than send-timeout.", s.Stats.WriteTimeouts.Load())
+	writeCounter(w, "cesp_cursors_conflated_total", "Cursor positions overwritten before delivery.", s.Stats.CursorsConflated.Load())
+	writeCounter(w, "cesp_log_dropped_total", "Logs dropped because the log queue was full.", logger.Dropped.Load())
+
+	m.QueueWait.write(w, "cesp_room_queue_seconds", "Time messages wait in a room's inbox.")
+	m.Handle.write(w, "cesp_room_handle_seconds", "Time a room takes to handle a message.")
+
+	writeHeader(w, "cesp_rooms", "gauge", "Running rooms.")
+	fmt.Fprintf(w, "cesp_rooms %d\n", s.RoomCount())
+
+	roomGauges := []struct {
+		name, help string
+		value      func(*roomSnapshot) int
+	}{
+		{"cesp_room_clients", "Clients in a room.", func(r *roomSnapshot) int { return len(r.clients) }},
+		{"cesp_room_pending_requests", "Requests waiting for the host.", func(r *roomSnapshot) int { return r.pending }},
+		{"cesp_room_inbox_depth", "Messages waiting in a room's inbox.", func(r *roomSnapshot) int { return r.inbox }},
+		{"cesp_room_actions_depth", "Actions waiting for a room's goroutine.", func(r *roomSnapshot) int { return r.actions }},
+	}
+	for _, gauge := range roomGauges {
+		writeHeader(w, gauge.name, "gauge", gauge.help)
+		for i := range snaps {
+			fmt.Fprintf(w, "%s{room=\"%s\"} %d\n", gauge.name, labelValue(snaps[i].id), gauge.value(&snaps[i]))
+		}
+	}
+
+	clientMetrics := []struct {
+		name, kind, help string
+		value            func(*clientSnapshot) uint64
+	}{
+		{"cesp_client_queue_depth", "gauge", "Messages in a client's reliable queue.", func(c *clientSnapshot) uint64 { return uint64(c.queue) }},
+		{"cesp_client_reliable_full_total", "counter", "Reliable messages that found the client's queue full.", func(c *clientSnapshot) uint64 { return c.stats.ReliableFull.Load() }},
+		{"cesp_client_resyncs_total", "counter", "Times the client's messages were dropped and it was told to resync.", func(c *clientSnapshot) uint64 { return c.stats.Resyncs.Load() }},
+		{"cesp_client_cursors_conflated_total", "counter", "Cursor positions overwritten before delivery to the client.", func(c *clientSnapshot) uint64 { return c.stats.CursorsConflated.Load() }},
+	}
+	for _, metric := range clientMetrics {
+		writeHeader(w, metric.name, metric.kind, metric.help)
+		for i := range snaps {
+			for j := range snaps[i].clients {
+				c := &snaps[i].clients[j]
+				fmt.Fprintf(w, "%s{room=\"%s\",client=\"%d\",name=\"%s\"} %d\n",
+					metric.name, labelValue(snaps[i].id), c.id, labelValue(c.name), metric.value(c))
+			}
+		}
+	}
+	writeHeader(w, "cesp_client_queue_capacity", "gauge", "Size of a client's reliable queue.")
+	fmt.Fprintf(w, "cesp_client_queue_capacity %d\n", clientQueueSize)
+}
+
+func writeHeader(w io.Writer, name, kind, help string) {
+	fmt.Fprintf(w, "# HELP %s %s\n# TYPE %s %s\n", name, help, name, kind)
+}
+
+func writeCounter(w io.Writer, name, help string, value uint64) {
+	writeHeader(w, name, "counter", help)
+	fmt.Fprintf(w, "%s %d\n", name, value)
+}
+
+var labelEscaper = strings.NewReplacer(`\`, `\\`, `"`, `\"`, "\n", `\n`)
+
+// Escapes label value for the text format, which only knows these escapes
+func labelValue(s string) string {
+	return labelEscaper.Replace(s)
+}
@@ -0,0 +1,75 @@
+package main
+
+import (
+	"bufio"
+	"fmt"
+	"net"
+	"net/http/httptest"
+	"strings"
+	"testing"
+	"time"
+)
+
+func TestHistogram(t *testing.T) {
+	h := newHistogram([]time.Duration{time.Millisecond, time.Second})
+	h.Observe(time.Microsecond)
+	h.Observe(time.Millisecond)
+	h.Observe(2 * time.Second)
+
+	var out strings.Builder
+	h.write(&out, "test_seconds", "Test.")
+	for _, want := range []string{
+		`test_seconds_bucket{le="0.001"} 2`,
+		`test_seconds_bucket{le="1"} 2`,
+		`test_seconds_bucket{le="+Inf"} 3`,
+		`test_seconds_sum 2.001001`,
+		`test_seconds_count 3`,
+	} {
+		if !strings.Contains(out.String(), want+"\n") {
+			t.Fatalf("Expected %s in:\n%s", want, out.String())
+		}
+	}
+}
+
+func TestServeMetrics(t *testing.T) {
+	server, addr := startTestServer()
+
+	host, _ := net.Dial("tcp", addr)
+	defer host.Close()
+	hr := bufio.NewReader(host)
+	fmt.Fprintln(host, `{"event": "handshake", "name": "host", "host": true}`)
+	hr.ReadString('\n')
+
+	guest, _ := net.Dial("tcp", addr)
+	defer guest.Close()
+	gr := bufio.NewReader(guest)
+	fmt.Fprintln(guest, `{"event": "handshake", "name": "a \"quoted\" name"}`)
+	gr.ReadString('\n')
+	// Joining is announced to the host
+	hr.ReadString('\n')
+
+	fmt.Fprintln(guest, `{"event": "request_files"}`)
+	fmt.Fprintln(guest, `{"event": "made_up"}`)
+	// Unknown events are requests to host too, both pending once they reach it
+	hr.ReadString('\n')
+	hr.ReadString('\n')
+
+	rec := httptest.NewRecorder()
+	server.ServeMetrics(rec, httptest.NewRequest("GET", "/metrics", nil))
+	body := rec.Body.String()
+	for _, want := range []string{
+		`cesp_messages_received_total{event="handshake"} 2`,
+		`cesp_messages_received_total{event="request_files"} 1`,
+		`cesp_messages_received_total{event="other"} 1`,
+		`cesp_room_clients{room=""} 2`,
+		`cesp_room_pending_requests{room=""} 2`,
+		`cesp_client_queue_depth{room="",client="0",name="host"} 0`,
+		`cesp_client_queue_depth{room="",client="1",name="a \"quoted\" name"} 0`,
+		`cesp_room_handle_seconds_count 2`,
+		`cesp_rooms 1`,
+	} {
+		if !strings.Contains(body, want+"\n") {
+			t.Fatalf("Expected %s in:\n%s", want, body)
+		}
+	}
+}
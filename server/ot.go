@@ -0,0 +1,481 @@
+package main
+
+import (
+	"encoding/json"
+	"errors"
+	"strings"
+)
+
+// Changes kept per file for transforming late update_content. Clients
+// further behind than this have to resync
+const MaxHistory = 1024
+
+// Edits are server-sequenced operational transforms. Every change of a file
+// bumps its version, clients send the version their changes are based on
+// and server transforms them over the changes they haven't seen yet.
+// Clients transform incoming changes over their own unacknowledged ones the
+// same way, so everyone converges to the server's order.
+//
+// Transforms work on line operations: runs of retained, deleted and
+// inserted lines. Lines deleted by both are deleted once and inserts are
+// kept, earlier one first if they are at the same line. Text changes inside
+// one line are edit runs, a text operation of the same kind on the bytes of
+// that line. Edits of the same line are transformed byte by byte, an edit
+// of a deleted line is dropped
+
+// One run of an operation, only one of the fields is set
+type opRun struct {
+	Retain int      `json:"retain,omitempty"`
+	Delete int      `json:"delete,omitempty"`
+	Insert []string `json:"insert,omitempty"`
+	// Edits one line
+	Edit textOp `json:"edit,omitempty"`
+}
+
+// Lines after the last run are retained
+type lineOp []opRun
+
+func (op lineOp) retain(n int) lineOp {
+	if n <= 0 {
+		return op
+	}
+	if last := len(op) - 1; last >= 0 && op[last].Retain > 0 {
+		op[last].Retain += n
+		return op
+	}
+	return append(op, opRun{Retain: n})
+}
+
+func (op lineOp) delete(n int) lineOp {
+	if n <= 0 {
+		return op
+	}
+	if last := len(op) - 1; last >= 0 && op[last].Delete > 0 {
+		op[last].Delete += n
+		return op
+	}
+	return append(op, opRun{Delete: n})
+}
+
+func (op lineOp) insert(lines []string) lineOp {
+	if len(lines) == 0 {
+		return op
+	}
+	// Inserts go before deletes at the same line, so equal operations look
+	// the same
+	last := len(op) - 1
+	if last >= 0 && op[last].Delete > 0 {
+		deleted := op[last].Delete
+		op = op[:last].insert(lines)
+		return op.delete(deleted)
+	}
+	if last >= 0 && op[last].Insert != nil {
+		op[last].Insert = append(op[last].Insert[:len(op[last].Insert):len(op[last].Insert)], lines...)
+		return op
+	}
+	return append(op, opRun{Insert: lines})
+}
+
+// Edit of the next line, edits that only retain are retains
+func (op lineOp) edit(e textOp) lineOp {
+	if e.noop() {
+		return op.retain(1)
+	}
+	return append(op, opRun{Edit: e})
+}
+
+func opFromChange(c Change) lineOp {
+	var op lineOp
+	if c.Text != nil {
+		var e textOp
+		return op.retain(c.First).edit(e.retain(c.Col).insert(*c.Text).delete(c.Delete))
+	}
+	return op.retain(c.First).insert(c.Lines).delete(c.OldLast - c.First)
+}
+
+// Returns the operation as sequential line range changes
+func (op lineOp) changes(out []Change) []Change {
+	line := 0
+	var pending *Change
+	for _, run := range op {
+		if run.Retain > 0 {
+			line += run.Retain
+			pending = nil
+			continue
+		}
+		if run.Edit != nil {
+			out = run.Edit.changes(line, out)
+			line++
+			pending = nil
+			continue
+		}
+		if pending == nil {
+			out = append(out, Change{First: line, OldLast: line, Lines: []string{}})
+			pending = &out[len(out)-1]
+		}
+		if run.Delete > 0 {
+			pending.OldLast += run.Delete
+		} else {
+			pending.Lines = append(pending.Lines, run.Insert...)
+			line += len(run.Insert)
+		}
+	}
+	return out
+}
+
+// Walks runs of an operation
+type opReader struct {
+	op  lineOp
+	i   int
+	run opRun
+}
+
+func newOpReader(op lineOp) *opReader {
+	r := &opReader{op: op}
+	r.next()
+	return r
+}
+
+func (r *opReader) next() {
+	r.run = opRun{}
+	if r.i < len(r.op) {
+		r.run = r.op[r.i]
+		r.i++
+	}
+}
+
+func (r *opReader) done() bool {
+	return r.run.Retain == 0 && r.run.Delete == 0 && r.run.Insert == nil && r.run.Edit == nil
+}
+
+// Lines left in current retain, delete or edit run
+func (r *opReader) left() int {
+	if r.run.Edit != nil {
+		return 1
+	}
+	return r.run.Retain + r.run.Delete
+}
+
+func (r *opReader) take(n int) {
+	if r.run.Edit != nil {
+		r.next()
+		return
+	}
+	if r.run.Retain > 0 {
+		r.run.Retain -= n
+	} else {
+		r.run.Delete -= n
+	}
+	if r.left() == 0 {
+		r.next()
+	}
+}
+
+// Rest of the operation after current run
+func (r *opReader) rest(op lineOp) lineOp {
+	op = op.retain(r.run.Retain).delete(r.run.Delete)
+	if r.run.Edit != nil {
+		op = op.edit(r.run.Edit)
+	}
+	for _, run := range r.op[r.i:] {
+		if run.Edit != nil {
+			op = op.edit(run.Edit)
+			continue
+		}
+		op = op.retain(run.Retain).insert(run.Insert).delete(run.Delete)
+	}
+	return op
+}
+
+// Transforms operations a and b made on the same version so that a' can be
+// applied after b and b' after a with the same result. a was sequenced
+// first, its inserts go first
+func transform(a, b lineOp) (lineOp, lineOp) {
+	var a2, b2 lineOp
+	ra, rb := newOpReader(a), newOpReader(b)
+
+	for !ra.done() || !rb.done() {
+		switch {
+		case ra.run.Insert != nil:
+			a2 = a2.insert(ra.run.Insert)
+			b2 = b2.retain(len(ra.run.Insert))
+			ra.next()
+			continue
+		case rb.run.Insert != nil:
+			a2 = a2.retain(len(rb.run.Insert))
+			b2 = b2.insert(rb.run.Insert)
+			rb.next()
+			continue
+		case ra.done():
+			// Lines after the last run are retained
+			return a2, rb.rest(b2)
+		case rb.done():
+			return ra.rest(a2), b2
+		}
+
+		n := min(ra.left(), rb.left())
+		switch {
+		case ra.run.Edit != nil && rb.run.Edit != nil:
+			ea, eb := transformText(ra.run.Edit, rb.run.Edit)
+			a2, b2 = a2.edit(ea), b2.edit(eb)
+		case ra.run.Edit != nil && rb.run.Retain > 0:
+			a2, b2 = a2.edit(ra.run.Edit), b2.retain(1)
+		case ra.run.Retain > 0 && rb.run.Edit != nil:
+			a2, b2 = a2.retain(1), b2.edit(rb.run.Edit)
+		// Edit of a deleted line is dropped
+		case ra.run.Edit != nil:
+			b2 = b2.delete(1)
+		case rb.run.Edit != nil:
+			a2 = a2.delete(1)
+		case ra.run.Retain > 0 && rb.run.Retain > 0:
+			a2, b2 = a2.retain(n), b2.retain(n)
+		case ra.run.Delete > 0 && rb.run.Retain > 0:
+			a2 = a2.delete(n)
+		case ra.run.Retain > 0 && rb.run.Delete > 0:
+			b2 = b2.delete(n)
+		}
+		// Lines deleted by both are already gone
+		ra.take(n)
+		rb.take(n)
+	}
+	return a2, b2
+}
+
+// Decodes "changes" of update_content, either one change or a list of
+// sequential ones. list tells which one it was
+func parseChanges(raw json.RawMessage) (changes []Change, list bool, err error) {
+	i := skipSpace(raw, 0)
+	if i >= len(raw) {
+		return nil, false, errors.New("missing changes")
+	}
+	list = raw[i] == '['
+	if list {
+		err = json.Unmarshal(raw, &changes)
+	} else {
+		changes = make([]Change, 1)
+		err = json.Unmarshal(raw, &changes[0])
+	}
+	// Deletions are sent back as [], not null
+	for i := range changes {
+		if changes[i].Text == nil && changes[i].Lines == nil {
+			changes[i].Lines = []string{}
+		}
+	}
+	return changes, list, err
+}
+
+// One run of a text operation, like opRun for bytes of a line
+type textRun struct {
+	Retain int    `json:"retain,omitempty"`
+	Delete int    `json:"delete,omitempty"`
+	Insert string `json:"insert,omitempty"`
+}
+
+// Operation on the bytes of a line, bytes after the last run are retained
+type textOp []textRun
+
+func (op textOp) retain(n int) textOp {
+	if n <= 0 {
+		return op
+	}
+	if last := len(op) - 1; last >= 0 && op[last].Retain > 0 {
+		op[last].Retain += n
+		return op
+	}
+	return append(op, textRun{Retain: n})
+}
+
+func (op textOp) delete(n int) textOp {
+	if n <= 0 {
+		return op
+	}
+	if last := len(op) - 1; last >= 0 && op[last].Delete > 0 {
+		op[last].Delete += n
+		return op
+	}
+	return append(op, textRun{Delete: n})
+}
+
+func (op textOp) insert(text string) textOp {
+	if text == "" {
+		return op
+	}
+	last := len(op) - 1
+	if last >= 0 && op[last].Delete > 0 {
+		deleted := op[last].Delete
+		op = op[:last].insert(text)
+		return op.delete(deleted)
+	}
+	if last >= 0 && op[last].Insert != "" {
+		op[last].Insert += text
+		return op
+	}
+	return append(op, textRun{Insert: text})
+}
+
+func (op textOp) noop() bool {
+	for _, run := range op {
+		if run.Retain == 0 {
+			return false
+		}
+	}
+	return true
+}
+
+// Returns line with the operation applied, out of range runs are clamped
+func (op textOp) apply(line string) string {
+	var b strings.Builder
+	pos := 0
+	for _, run := range op {
+		switch {
+		case run.Retain > 0:
+			end := min(pos+run.Retain, len(line))
+			b.WriteString(line[pos:end])
+			pos = end
+		case run.Delete > 0:
+			pos = min(pos+run.Delete, len(line))
+		default:
+			b.WriteString(run.Insert)
+		}
+	}
+	b.WriteString(line[pos:])
+	return b.String()
+}
+
+// Returns the operation as sequential text changes of line
+func (op textOp) changes(line int, out []Change) []Change {
+	col := 0
+	var pending *Change
+	for _, run := range op {
+		if run.Retain > 0 {
+			col += run.Retain
+			pending = nil
+			continue
+		}
+		if pending == nil {
+			text := ""
+			out = append(out, Change{First: line, Col: col, Text: &text})
+			pending = &out[len(out)-1]
+		}
+		if run.Delete > 0 {
+			pending.Delete += run.Delete
+		} else {
+			*pending.Text += run.Insert
+			col += len(run.Insert)
+		}
+	}
+	return out
+}
+
+// Walks runs of a text operation like opReader
+type textReader struct {
+	op  textOp
+	i   int
+	run textRun
+}
+
+func newTextReader(op textOp) *textReader {
+	r := &textReader{op: op}
+	r.next()
+	return r
+}
+
+func (r *textReader) next() {
+	r.run = textRun{}
+	if r.i < len(r.op) {
+		r.run = r.op[r.i]
+		r.i++
+	}
+}
+
+func (r *textReader) done() bool {
+	return r.run == textRun{}
+}
+
+func (r *textReader) left() int {
+	return r.run.Retain + r.run.Delete
+}
+
+func (r *textReader) take(n int) {
+	if r.run.Retain > 0 {
+		r.run.Retain -= n
+	} else {
+		r.run.Delete -= n
+	}
+	if r.left() == 0 {
+		r.next()
+	}
+}
+
+func (r *textReader) rest(op textOp) textOp {
+	op = op.retain(r.run.Retain).delete(r.run.Delete)
+	for _, run := range r.op[r.i:] {
+		op = op.retain(run.Retain).insert(run.Insert).delete(run.Delete)
+	}
+	return op
+}
+
+// Transforms edits a and b of the same line like transform does lines
+func transformText(a, b textOp) (textOp, textOp) {
+	var a2, b2 textOp
+	ra, rb := newTextReader(a), newTextReader(b)
+
+	for !ra.done() || !rb.done() {
+		switch {
+		case ra.run.Insert != "":
+			a2, b2 = a2.insert(ra.run.Insert), b2.retain(len(ra.run.Insert))
+			ra.next()
+			continue
+		case rb.run.Insert != "":
+			a2, b2 = a2.retain(len(rb.run.Insert)), b2.insert(rb.run.Insert)
+			rb.next()
+			continue
+		case ra.done():
+			return a2, rb.rest(b2)
+		case rb.done():
+			return ra.rest(a2), b2
+		}
+
+		n := min(ra.left(), rb.left())
+		switch {
+		case ra.run.Retain > 0 && rb.run.Retain > 0:
+			a2, b2 = a2.retain(n), b2.retain(n)
+		case ra.run.Delete > 0 && rb.run.Retain > 0:
+			a2 = a2.delete(n)
+		case ra.run.Retain > 0 && rb.run.Delete > 0:
+			b2 = b2.delete(n)
+		}
+		ra.take(n)
+		rb.take(n)
+	}
+	return a2, b2
+}
+
+// Version and recent changes of a file, and its content if it is cached
+type docState struct {
+	Doc     *Document
+	Version int
+	// history[len-1] made Version. authors[i] is the session of the client
+	// that made history[i], empty if it didn't give one
+	history []lineOp
+	authors []string
+}
+
+// Returns operations made after version base, false if base is unknown
+func (s *docState) since(base int) ([]lineOp, bool) {
+	n := s.Version - base
+	if n < 0 || n > len(s.history) {
+		return nil, false
+	}
+	return s.history[len(s.history)-n:], true
+}
+
+func (s *docState) record(op lineOp, author string) {
+	s.Version++
+	s.history = append(s.history, op)
+	s.authors = append(s.authors, author)
+	if len(s.history) >= 2*MaxHistory {
+		s.history = append(s.history[:0], s.history[len(s.history)-MaxHistory:]...)
+		s.authors = append(s.authors[:0], s.authors[len(s.authors)-MaxHistory:]...)
+	}
+}
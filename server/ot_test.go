@@ -0,0 +1,345 @@
+package main
+
+import (
+	"bufio"
+	"encoding/json"
+	"fmt"
+	"math/rand"
+	"net"
+	"strings"
+	"testing"
+)
+
+func randomDoc(rng *rand.Rand, lines int) *Document {
+	content := make([]string, lines)
+	for i := range content {
+		content[i] = fmt.Sprint("line ", i)
+	}
+	return NewDocument(strings.Join(content, "\n"))
+}
+
+// Small random change, never empties the document
+func randomChange(rng *rand.Rand, doc *Document, tag string) Change {
+	if rng.Intn(2) == 0 {
+		// Text change inside a line
+		first := rng.Intn(doc.Lines())
+		line := doc.Slice(first, first+1)[0]
+		col := rng.Intn(len(line) + 1)
+		text := strings.Repeat(tag[:1], rng.Intn(3))
+		return Change{First: first, Col: col, Delete: rng.Intn(len(line) - col + 1), Text: &text}
+	}
+	first := rng.Intn(doc.Lines() + 1)
+	deleted := 0
+	if first < doc.Lines()-1 {
+		deleted = rng.Intn(3)
+		deleted = min(deleted, doc.Lines()-1-first)
+	}
+	lines := make([]string, rng.Intn(3))
+	for i := range lines {
+		lines[i] = fmt.Sprint(tag, " ", i)
+	}
+	return Change{First: first, OldLast: first + deleted, Lines: lines}
+}
+
+func copyDoc(doc *Document) *Document {
+	return NewDocument(doc.Content())
+}
+
+func TestTransformConverges(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	for i := 0; i < 5000; i++ {
+		doc := randomDoc(rng, 1+rng.Intn(8))
+		a := opFromChange(randomChange(rng, doc, "a"))
+		// Transformed operations have more runs, use them too
+		if rng.Intn(2) == 0 {
+			c := opFromChange(randomChange(rng, doc, "c"))
+			a, _ = transform(a, c)
+			doc.Apply(c)
+		}
+		b := opFromChange(randomChange(rng, doc, "b"))
+
+		// a was sequenced first
+		a2, b2 := transform(a, b)
+		ab, ba := copyDoc(doc), copyDoc(doc)
+		ab.Apply(a)
+		ab.Apply(b2)
+		ba.Apply(b)
+		ba.Apply(a2)
+
+		if ab.Content() != ba.Content() {
+			t.Fatalf("%+v and %+v on %q diverged:\n%q\n%q", a, b, doc.Content(), ab.Content(), ba.Content())
+		}
+	}
+}
+
+func TestTransformKeepsBothEdits(t *testing.T) {
+	doc := NewDocument("a\nb\nc")
+	first := opFromChange(Change{First: 1, OldLast: 2, Lines: []string{"first"}})
+	second := opFromChange(Change{First: 1, OldLast: 3, Lines: []string{"second"}})
+
+	_, second = transform(first, second)
+	doc.Apply(first)
+	doc.Apply(second)
+	if got := doc.Content(); got != "a\nfirst\nsecond" {
+		t.Fatalf("Expected both edits with deleted lines gone, got %q", got)
+	}
+	if changes := second.changes(nil); len(changes) != 1 || changes[0].First != 2 || changes[0].OldLast != 3 {
+		t.Fatalf("Expected one change after first edit, got %+v", changes)
+	}
+}
+
+func TestTextChanges(t *testing.T) {
+	doc := NewDocument("hello world\nsecond")
+	typed, deleted := "big ", ""
+	first := opFromChange(Change{First: 0, Col: 6, Text: &typed})
+	second := opFromChange(Change{First: 0, Col: 0, Delete: 6, Text: &deleted})
+
+	_, second = transform(first, second)
+	doc.Apply(first)
+	doc.Apply(second)
+	if got := doc.Content(); got != "big world\nsecond" || doc.Size() != len(got)+1 {
+		t.Fatalf("Expected both text edits, got %q", got)
+	}
+
+	// Text changes are encoded without line fields
+	encoded, _ := json.Marshal(second.changes(nil))
+	if string(encoded) != `[{"first":0,"col":0,"delete":6,"text":""}]` {
+		t.Fatalf("Unexpected text change %s", encoded)
+	}
+
+	// Edit of a deleted line is dropped with it
+	edit := opFromChange(Change{First: 1, Col: 0, Text: &typed})
+	removed := opFromChange(Change{First: 1, OldLast: 2, Lines: []string{}})
+	edit, _ = transform(edit, removed)
+	doc.Apply(removed)
+	doc.Apply(edit)
+	if got := doc.Content(); got != "big world" {
+		t.Fatalf("Expected edit to be dropped, got %q", got)
+	}
+}
+
+func TestStaleVersionIsRejected(t *testing.T) {
+	_, addr := startTestServer()
+
+	c, _ := net.Dial("tcp", addr)
+	defer c.Close()
+	r := bufio.NewReader(c)
+	fmt.Fprintln(c, `{"event": "handshake", "name": "eilinen"}`)
+	r.ReadString('\n')
+
+	fmt.Fprintln(c, `{"event": "update_content", "path": "a.c", "version": 0, "changes": {"first": 0, "old_last": 0, "lines": ["x"]}}`)
+	r.ReadString('\n') // update_ack
+	fmt.Fprintln(c, `{"event": "update_content", "path": "a.c", "version": 5, "changes": {"first": 0, "old_last": 0, "lines": ["x"]}}`)
+	if reply, _ := r.ReadString('\n'); !strings.Contains(reply, "update_reject") || !strings.Contains(reply, `"version":1`) {
+		t.Fatalf("Expected update_reject at version 1, got %s", reply)
+	}
+
+	// File isn't dropped for everyone else
+	fmt.Fprintln(c, `{"event": "update_content", "path": "a.c", "version": 1, "changes": {"first": 0, "old_last": 0, "lines": ["y"]}}`)
+	if reply, _ := r.ReadString('\n'); !strings.Contains(reply, "update_ack") || !strings.Contains(reply, `"version":2`) {
+		t.Fatalf("Expected update_ack at version 2, got %s", reply)
+	}
+}
+
+// Client side of the protocol, like lua/cesp/ot.lua
+type testEditor struct {
+	conn     net.Conn
+	in       chan []byte
+	doc      *Document
+	version  int
+	inflight []lineOp
+	buffer   []lineOp
+	rng      *rand.Rand
+	tag      string
+}
+
+func newTestEditor(addr string, id int, content string) *testEditor {
+	conn, _ := net.Dial("tcp", addr)
+	e := &testEditor{
+		conn: conn,
+		in:   make(chan []byte, 1024),
+		doc:  NewDocument(content),
+		rng:  rand.New(rand.NewSource(int64(id))),
+		tag:  fmt.Sprint("editor", id),
+	}
+	r := bufio.NewReader(conn)
+	fmt.Fprintf(conn, `{"event": "handshake", "name": %q}`+"\n", e.tag)
+	r.ReadString('\n')
+	go func() {
+		defer close(e.in)
+		for {
+			line, err := r.ReadBytes('\n')
+			if err != nil {
+				return
+			}
+			e.in <- line
+		}
+	}()
+	return e
+}
+
+func (e *testEditor) send() {
+	var list []Change
+	for _, op := range e.inflight {
+		list = op.changes(list)
+	}
+	changes, _ := json.Marshal(list)
+	fmt.Fprintf(e.conn, `{"event": "update_content", "path": "a.txt", "version": %d, "changes": %s}`+"\n", e.version, changes)
+}
+
+func (e *testEditor) edit() {
+	change := opFromChange(randomChange(e.rng, e.doc, e.tag))
+	e.doc.Apply(change)
+	if e.inflight != nil {
+		e.buffer = append(e.buffer, change)
+		return
+	}
+	e.inflight = []lineOp{change}
+	e.send()
+}
+
+// Remote operation was sequenced before pending ones
+func transformOver(op lineOp, pending []lineOp) lineOp {
+	for i := range pending {
+		op, pending[i] = transform(op, pending[i])
+	}
+	return op
+}
+
+func (e *testEditor) handle(line []byte) error {
+	var msg struct {
+		Event   string          `json:"event"`
+		Version int             `json:"version"`
+		Changes json.RawMessage `json:"changes"`
+	}
+	if err := json.Unmarshal(line, &msg); err != nil {
+		return err
+	}
+
+	switch msg.Event {
+	case "update_ack":
+		e.version = msg.Version
+		e.inflight = nil
+		if len(e.buffer) > 0 {
+			e.inflight, e.buffer = e.buffer, nil
+			e.send()
+		}
+	case "update_content":
+		changes, _, err := parseChanges(msg.Changes)
+		if err != nil {
+			return err
+		}
+		for _, c := range changes {
+			op := transformOver(transformOver(opFromChange(c), e.inflight), e.buffer)
+			e.doc.Apply(op)
+		}
+		e.version = msg.Version
+	case "update_reject":
+		return fmt.Errorf("%s was rejected: %s", e.tag, line)
+	}
+	return nil
+}
+
+// Makes edits as fast as it can while applying everyone else's, until all
+// of its own are acknowledged. Like someone typing faster than the round
+// trip, at most maxBuffered edits wait for the previous ones
+func (e *testEditor) run(edits int) error {
+	const maxBuffered = 8
+	for edits > 0 || e.inflight != nil {
+		if edits > 0 && len(e.buffer) < maxBuffered {
+			select {
+			case line := <-e.in:
+				if err := e.handle(line); err != nil {
+					return err
+				}
+			default:
+				e.edit()
+				edits--
+			}
+			continue
+		}
+		if err := e.sync(-1); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// Handles one message, or messages until file is at version if it isn't -1
+func (e *testEditor) sync(version int) error {
+	for first := true; first || e.version < version; first = false {
+		line, ok := <-e.in
+		if !ok {
+			return fmt.Errorf("%s was disconnected", e.tag)
+		}
+		if err := e.handle(line); err != nil {
+			return err
+		}
+	}
+	return nil
+}
+
+// Runs editors concurrently on the same file and checks that everyone,
+// server included, ends up with the same content
+func runConcurrentEditors(tb testing.TB, editors, edits int) {
+	server, addr := startTestServer()
+	content := randomDoc(rand.New(rand.NewSource(0)), 200).Content()
+
+	done := make(chan struct{})
+	server.DefaultRoom.actions <- func() {
+		server.DefaultRoom.docs.Put("a.txt", content, 0)
+		close(done)
+	}
+	<-done
+
+	clients := make([]*testEditor, editors)
+	for i := range clients {
+		clients[i] = newTestEditor(addr, i, content)
+		defer clients[i].conn.Close()
+	}
+
+	errs := make(chan error, editors)
+	for _, e := range clients {
+		go func(e *testEditor) { errs <- e.run(edits) }(e)
+	}
+	for range clients {
+		if err := <-errs; err != nil {
+			tb.Fatal(err)
+		}
+	}
+
+	var want string
+	var version int
+	done = make(chan struct{})
+	server.DefaultRoom.actions <- func() {
+		var doc *Document
+		doc, version, _ = server.DefaultRoom.docs.Get("a.txt")
+		want = doc.Content()
+		close(done)
+	}
+	<-done
+	for _, e := range clients {
+		if e.version < version {
+			if err := e.sync(version); err != nil {
+				tb.Fatal(err)
+			}
+		}
+		if got := e.doc.Content(); got != want {
+			tb.Fatalf("%s diverged from server:\n%q\n%q", e.tag, got, want)
+		}
+	}
+}
+
+func TestConcurrentEditorsConverge(t *testing.T) {
+	runConcurrentEditors(t, 4, 200)
+}
+
+func BenchmarkConcurrentEditors(b *testing.B) {
+	for _, editors := range []int{2, 8, 32} {
+		b.Run(fmt.Sprintf("editors=%d", editors), func(b *testing.B) {
+			edits := max(b.N/editors, 1)
+			b.ResetTimer()
+			runConcurrentEditors(b, editors, edits)
+		})
+	}
+}
@@ -0,0 +1,772 @@
+package main
+
+import (
+	"encoding/json"
+	"sort"
+	"time"
+)
+
+const (
+	// Slots of new host's queue handoff leaves to other messages. Files
+	// that don't fit wait for the queue to drain
+	handoffHeadroom = clientQueueSize / 4
+	// How often a waiting handoff checks the new host's queue
+	handoffPollInterval = 10 * time.Millisecond
+)
+
+type PendingRequest struct {
+	ClientID  int
+	RequestID int
+	Deadline  time.Time
+	// Set for request_file while the response is collected for the
+	// document cache
+	Path    string
+	content []byte
+	// Request as sent to host, sent again to the next host if it hasn't been
+	// answered
+	raw      []byte
+	answered bool
+}
+
+// Session with its own clients, host and requests. Every room has its own
+// actor loop, so busy rooms don't slow down each other
+type Room struct {
+	ID              string
+	server          *Server
+	Clients         map[int]*Client
+	Host            *Client
+	PendingRequests map[int]*PendingRequest
+	NextClientID    int
+	NextRequestID   int
+	// Request timeouts, one timer for the whole room instead of one per
+	// request. expiry is only set while the timer is armed
+	deadlines   deadlineQueue
+	expiryTimer *time.Timer
+	expiry      <-chan time.Time
+	expired     []deadline
+	// Files opened during session
+	docs documentCache
+	// Session of the host that left without a standby, docs are kept for
+	// it until grace fires. grace is only set while the timer is armed
+	leftHost   string
+	graceTimer *time.Timer
+	grace      <-chan time.Time
+	// Handoff to a new host that is still sending files, see handOff.
+	// handoffWait is only set while waiting for its queue to drain
+	handoff      *handoff
+	handoffTimer *time.Timer
+	handoffWait  <-chan time.Time
+	// Latest cursor of each client, for clients that subscribe later
+	cursors map[int]*lastCursor
+	// Set with -journal, docs are journaled to disk
+	journalDir string
+	journal    *journal
+	// Closed when run returns. previous is the done channel of the room
+	// that had the same id before
+	done     chan struct{}
+	previous chan struct{}
+	// Connections using the room, guarded by Server.roomsMu
+	refs int
+	// Messages from connections
+	inbox chan roomEvent
+	// Other work that has to happen on the room's goroutine
+	actions chan func()
+}
+
+type eventKind int
+
+const (
+	// Client joins with its handshake message
+	eventJoin eventKind = iota
+	eventMessage
+	eventLeave
+	// Last connection has left, stop the loop
+	eventClose
+)
+
+// Sent by connection's reader, a struct instead of a closure so that
+// messages don't allocate one
+type roomEvent struct {
+	kind   eventKind
+	client *Client
+	msg    *Message
+	// When a message was put in the inbox
+	at time.Time
+}
+
+func newRoom(server *Server, id string) *Room {
+	r := &Room{
+		ID:              id,
+		server:          server,
+		Clients:         make(map[int]*Client),
+		PendingRequests: make(map[int]*PendingRequest),
+		docs:            newDocumentCache(),
+		cursors:         make(map[int]*lastCursor),
+		expiryTimer:     time.NewTimer(time.Hour),
+		graceTimer:      time.NewTimer(time.Hour),
+		handoffTimer:    time.NewTimer(time.Hour),
+		inbox:           make(chan roomEvent, 1024),
+		actions:         make(chan func(), 64),
+		done:            make(chan struct{}),
+	}
+	stopTimer(r.expiryTimer)
+	stopTimer(r.graceTimer)
+	stopTimer(r.handoffTimer)
+	return r
+}
+
+func (r *Room) run() {
+	defer r.stop()
+	if r.previous != nil {
+		<-r.previous
+	}
+	if r.journalDir != "" {
+		r.openJournal(r.journalDir)
+	}
+	for {
+		select {
+		case ev := <-r.inbox:
+			switch ev.kind {
+			case eventJoin:
+				r.addClient(ev.client)
+				r.handleHandshake(ev.client, ev.msg)
+			case eventMessage:
+				start := time.Now()
+				r.server.Metrics.QueueWait.Observe(start.Sub(ev.at))
+				r.processMessage(ev.client, ev.msg)
+				r.server.Metrics.Handle.Observe(time.Since(start))
+			case eventLeave:
+				r.removeClient(ev.client)
+			case eventClose:
+				return
+			}
+		case action := <-r.actions:
+			action()
+		case now := <-r.expiry:
+			r.expiry = nil
+			r.expireRequests(now)
+		case <-r.grace:
+			r.grace = nil
+			r.leftHost = ""
+			// Next host can have different files
+			r.clearDocs()
+			logger.Infof("Host of room %q didn't come back, files are forgotten", r.ID)
+		case <-r.handoffWait:
+			r.handoffWait = nil
+			r.continueHandoff()
+		}
+	}
+}
+
+// Finishes journal writes and lets the next room with the same id start
+func (r *Room) stop() {
+	stopTimer(r.graceTimer)
+	stopTimer(r.handoffTimer)
+	r.closeJournal()
+	close(r.done)
+
+	s := r.server
+	s.roomsMu.Lock()
+	if s.stopping[r.ID] == r.done {
+		delete(s.stopping, r.ID)
+	}
+	s.roomsMu.Unlock()
+}
+
+func (r *Room) addClient(client *Client) {
+	client.ID = r.NextClientID
+	r.NextClientID++
+	client.IsHost = false
+	client.fromField = jsonField("from_id", client.ID)
+	r.Clients[client.ID] = client
+}
+
+func (r *Room) processMessage(client *Client, msg *Message) {
+	event := msg.Event
+
+	// Clients only get here after their handshake, name can't be changed
+	if event == "handshake" {
+		return
+	}
+
+	// Route events by type
+	switch event {
+	// To broadcast
+	case "update_content":
+		r.updateContent(client, msg)
+	case "sync_file":
+		r.syncFile(client, msg)
+	case "subscribe", "unsubscribe":
+		r.handleSubscription(client, msg)
+	case "cursor_move", "cursor_leave", "remote_write":
+		// Original payload is forwarded, only sender (and trace) is stamped on it
+		fields := [][]byte{client.fromField, client.nameField}
+		if trace := traceField(msg); trace != nil {
+			fields = append(fields, trace)
+		}
+		bytes := spliceObject(msg.Raw, originKeys, fields...)
+		if laneOf(event) == LaneBestEffort {
+			r.broadcastCursor(client.ID, msg.Path, bytes)
+			return
+		}
+		if event == "cursor_leave" {
+			r.dropCursors(client.ID)
+		}
+		r.broadcastRaw(client.ID, bytes)
+		// Requests to host
+	default:
+		// Request/Response
+		if msg.RequestID != nil {
+			r.resolvePendingRequest(int(*msg.RequestID), msg)
+			return
+		}
+		if event == "request_file" {
+			// Edits made after the file is sent must reach the requester
+			r.autoSubscribe(client, msg.Path, nil)
+			if r.serveCachedFile(client, msg.Path) {
+				return
+			}
+		}
+		r.createNewRequest(client, msg)
+	}
+}
+
+func (r *Room) handleHandshake(client *Client, msg *Message) {
+	newName := msg.Name
+
+	wantsHost := msg.Host
+
+	if newName != "" && client.Name == "" {
+		client.Name = newName
+		client.nameField = jsonField("name", client.Name)
+
+		client.standby = msg.Standby && !wantsHost
+		if msg.Subscriptions {
+			client.useSubscriptions()
+		}
+		if len(msg.Session) <= MaxSessionLength {
+			client.session = msg.Session
+		}
+		// If they asked to be host, and no host exists, make them host.
+		if wantsHost {
+			if r.Host == nil {
+				client.IsHost = true
+				r.Host = client
+				// Versions start over with the new host's files, unless the
+				// host that left (or the one journaled) is coming back to them
+				if len(msg.Resume) == 0 || (r.grace != nil && client.session != r.leftHost) {
+					r.clearDocs()
+				}
+				stopTimer(r.graceTimer)
+				r.grace = nil
+				r.leftHost = ""
+				logger.Infof("Client %s (ID: %d) registered as HOST", client.Name, client.ID)
+			} else {
+				logger.Infof("Client %s requested host, but host already exists (ID: %d)", client.Name, r.Host.ID)
+			}
+		}
+
+		r.broadcast(client.ID, map[string]any{
+			"event":   "user_joined",
+			"id":      client.ID,
+			"name":    client.Name,
+			"is_host": client.IsHost,
+		})
+		// Send info about server state on client
+		response := map[string]any{
+			"event":   "handshake_response",
+			"id":      client.ID,
+			"name":    client.Name,
+			"is_host": client.IsHost,
+			"room":    r.ID,
+		}
+		if Framing(client.framing.Load()) == FramingLength {
+			response["framing"] = framingLengthName
+		}
+		if client.compress.Load() {
+			response["compression"] = compressionZlibName
+		}
+		// Missed edits come before the response, so client knows that
+		// changes still unacknowledged after it never reached the server
+		r.resume(client, msg.Resume)
+		r.sendJSON(client, response)
+	}
+}
+
+// Forwards response to the requester and deletes pending request
+// (successful response :D). Streamed responses keep it pending until the
+// last part, every part gives the host another RequestTimeout
+func (r *Room) resolvePendingRequest(reqID int, msg *Message) {
+	if pending, exists := r.PendingRequests[reqID]; exists {
+		if target, ok := r.Clients[pending.ClientID]; ok {
+			r.server.send(target, spliceObject(msg.Raw, requestKeys[:1]))
+		}
+		if pending.Path != "" && msg.Event == "response_file" {
+			r.collectFile(pending, msg)
+		}
+		if msg.More {
+			pending.answered = true
+			pending.Deadline = time.Now().Add(RequestTimeout)
+			r.deadlines.Push(reqID, pending.Deadline)
+			r.armExpiry()
+			return
+		}
+		delete(r.PendingRequests, reqID)
+	}
+}
+
+func (r *Room) createNewRequest(client *Client, msg *Message) {
+	reqID := r.NextRequestID
+	r.NextRequestID++
+
+	if r.Host == nil {
+		r.sendJSON(client, map[string]any{"event": "error", "message": "No host available"})
+		return
+	}
+
+	pending := &PendingRequest{
+		ClientID:  client.ID,
+		RequestID: reqID,
+		Deadline:  time.Now().Add(RequestTimeout),
+	}
+	if msg.Event == "request_file" {
+		pending.Path = msg.Path
+	}
+	pending.raw = spliceObject(msg.Raw, requestKeys, jsonField("request_id", reqID), client.fromField)
+	r.PendingRequests[reqID] = pending
+	r.deadlines.Push(reqID, pending.Deadline)
+	r.armExpiry()
+
+	r.server.send(r.Host, pending.raw)
+}
+
+// Sent for every edit, encoding a struct is several times faster than a map
+type updateAck struct {
+	Event   string `json:"event"`
+	Path    string `json:"path"`
+	Version int    `json:"version"`
+	Hash    string `json:"hash,omitempty"`
+	Trace   *Trace `json:"trace,omitempty"`
+}
+
+// Sequences client's changes: transforms them over the changes made after
+// the version they are based on, applies them and sends them to everyone
+// else with the new version. Changes without version are applied as is
+func (r *Room) updateContent(client *Client, msg *Message) {
+	var update struct {
+		Version *int            `json:"version"`
+		Changes json.RawMessage `json:"changes"`
+	}
+	if err := json.Unmarshal(msg.Raw, &update); err != nil {
+		return
+	}
+	changes, list, err := parseChanges(update.Changes)
+	if err != nil {
+		return
+	}
+
+	state := r.docs.State(msg.Path)
+	base := state.Version
+	if update.Version != nil {
+		base = *update.Version
+	}
+	concurrent, ok := state.since(base)
+	if !ok {
+		// Too far behind (or ahead), client has to get the file again.
+		// Others' file and history stay as they are
+		r.sendJSON(client, map[string]any{"event": "update_reject", "path": msg.Path, "version": state.Version})
+		return
+	}
+
+	// Missed edits are sent as they were made, client transforms them over
+	// this one like any other
+	r.autoSubscribe(client, msg.Path, &base)
+
+	transformed := len(concurrent) > 0
+	if transformed {
+		concurrent = append([]lineOp(nil), concurrent...)
+	}
+	var applied []Change
+	for _, change := range changes {
+		op := opFromChange(change)
+		for j := range concurrent {
+			concurrent[j], op = transform(concurrent[j], op)
+		}
+		r.docs.Apply(msg.Path, op, client.session)
+		r.journalRecord(&journalRecord{Path: msg.Path, Version: state.Version, Edit: true, Op: op, Author: client.session})
+		if transformed {
+			applied = op.changes(applied)
+		}
+	}
+
+	fields := [][]byte{client.fromField, client.nameField, jsonField("version", state.Version)}
+	ack := &updateAck{Event: "update_ack", Path: msg.Path, Version: state.Version}
+	if state.Doc != nil && state.Version%CheckpointInterval == 0 {
+		hash := state.Doc.Hash()
+		fields = append(fields, jsonField("hash", hash))
+		ack.Hash = hash
+	}
+
+	if trace := traceField(msg); trace != nil {
+		fields = append(fields, trace)
+		ack.Trace = msg.Trace
+	}
+
+	var bytes []byte
+	if transformed {
+		var value any = applied
+		if !list && len(applied) == 1 {
+			value = applied[0]
+		}
+		bytes = spliceObject(msg.Raw, updateChangedKeys, append(fields, jsonField("changes", value))...)
+	} else {
+		bytes = spliceObject(msg.Raw, updateKeys, fields...)
+	}
+	r.broadcastFile(client.ID, msg.Path, bytes)
+	r.sendJSON(client, ack)
+}
+
+// Answers sync_file with the lines that differ from client's copy. Only
+// cached files can be synced, and only at the current version, otherwise
+// client tries again at the next checkpoint
+func (r *Room) syncFile(client *Client, msg *Message) {
+	var sync struct {
+		Version int      `json:"version"`
+		Lines   int      `json:"lines"`
+		Head    []string `json:"head"`
+		Tail    []string `json:"tail"`
+	}
+	if err := json.Unmarshal(msg.Raw, &sync); err != nil || sync.Lines < 1 {
+		return
+	}
+	doc, version, ok := r.docs.Get(msg.Path)
+	if !ok || version != sync.Version {
+		return
+	}
+
+	change := syncChange(doc.Slice(0, doc.Lines()), sync.Lines, sync.Head, sync.Tail)
+	r.sendJSON(client, map[string]any{
+		"event":   "sync_content",
+		"path":    msg.Path,
+		"version": version,
+		"changes": change,
+		"hash":    doc.Hash(),
+	})
+}
+
+// Collects parts of host's response_file and caches the file after the
+// last one. Parts that don't continue the previous one stop collecting
+func (r *Room) collectFile(pending *PendingRequest, msg *Message) {
+	var part struct {
+		Content string `json:"content"`
+		Offset  int    `json:"offset"`
+		// Version of the file host sent
+		Version int `json:"version"`
+	}
+	err := json.Unmarshal(msg.Raw, &part)
+	if err != nil || msg.Path != pending.Path || part.Offset != len(pending.content) ||
+		len(pending.content)+len(part.Content) > MaxDocumentCacheSize {
+		pending.Path, pending.content = "", nil
+		return
+	}
+
+	if !msg.More && pending.content == nil {
+		// Whole file in one part, no need to copy it
+		r.putDoc(pending.Path, part.Content, part.Version)
+		return
+	}
+	pending.content = append(pending.content, part.Content...)
+	if !msg.More {
+		r.putDoc(pending.Path, string(pending.content), part.Version)
+		pending.content = nil
+	}
+}
+
+// Part of a cached file, as the host would send it
+type filePart struct {
+	Event   string `json:"event"`
+	Path    string `json:"path"`
+	Content string `json:"content"`
+	Offset  int    `json:"offset"`
+	Version int    `json:"version"`
+	More    bool   `json:"more,omitempty"`
+}
+
+// Answers request_file from the document cache, returns false if path
+// isn't cached
+func (r *Room) serveCachedFile(client *Client, path string) bool {
+	doc, version, ok := r.docs.Get(path)
+	if !ok {
+		return false
+	}
+
+	parts := splitContent(doc.Content(), FileChunkSize)
+	offset := 0
+	for i, part := range parts {
+		r.sendJSON(client, &filePart{
+			Event:   "response_file",
+			Path:    path,
+			Content: part,
+			Offset:  offset,
+			Version: version,
+			More:    i < len(parts)-1,
+		})
+		offset += len(part)
+	}
+	return true
+}
+
+// Makes sure that expiry fires for the earliest deadline
+func (r *Room) armExpiry() {
+	if r.expiry != nil {
+		return
+	}
+	next, ok := r.deadlines.Peek()
+	if !ok {
+		return
+	}
+	r.expiryTimer.Reset(time.Until(next.At))
+	r.expiry = r.expiryTimer.C
+}
+
+// Times out every request whose deadline has passed, and waits at least
+// RequestTimeoutResolution before the next batch
+func (r *Room) expireRequests(now time.Time) {
+	r.expired = r.deadlines.PopExpired(now, r.expired[:0])
+	for _, d := range r.expired {
+		// Streamed requests leave older deadlines behind
+		if req, ok := r.PendingRequests[d.RequestID]; ok && req.Deadline.Equal(d.At) {
+			r.handleTimeout(d.RequestID)
+		}
+	}
+
+	next, ok := r.deadlines.Peek()
+	if !ok {
+		return
+	}
+	r.expiryTimer.Reset(max(time.Until(next.At), RequestTimeoutResolution))
+	r.expiry = r.expiryTimer.C
+}
+
+func (r *Room) removeClient(client *Client) {
+	if _, ok := r.Clients[client.ID]; !ok {
+		return
+	}
+
+	delete(r.Clients, client.ID)
+	close(client.Send)
+
+	for id, req := range r.PendingRequests {
+		if req.ClientID == client.ID {
+			delete(r.PendingRequests, id)
+		}
+	}
+
+	if client.IsHost {
+		r.Host = nil
+		r.stopHandoff()
+		if standby := r.standby(); standby != nil {
+			logger.Infof("Host %s left, standby %s (ID: %d) is the new host", client.Name, standby.Name, standby.ID)
+			r.handOff(standby)
+		} else {
+			r.awaitHost(client)
+			logger.Infof("Host %s left. Waiting for new host...", client.Name)
+
+			r.broadcast(-1, map[string]any{
+				"event": "host_left",
+			})
+			r.failPending("Host left")
+		}
+	}
+
+	r.dropCursors(client.ID)
+	r.broadcast(-1, map[string]any{"event": "user_left", "id": client.ID, "name": client.Name})
+}
+
+// Keeps the files for HostGrace after host left, in case it comes back and
+// resumes with its session. Otherwise the next host can have different
+// files
+func (r *Room) awaitHost(host *Client) {
+	grace := r.server.HostGrace
+	if grace <= 0 || host.session == "" {
+		r.clearDocs()
+		return
+	}
+	r.leftHost = host.session
+	r.graceTimer.Reset(grace)
+	r.grace = r.graceTimer.C
+}
+
+// Returns the standby client that joined first, nil if there's none
+func (r *Room) standby() *Client {
+	var next *Client
+	for _, c := range r.Clients {
+		if c.standby && (next == nil || c.ID < next.ID) {
+			next = c
+		}
+	}
+	return next
+}
+
+// Makes standby client the host. It gets the cached files first, so that
+// it can answer requests once it's told it's the host, and versions carry
+// on so that nobody has to get their files again. Requests the old host
+// didn't answer are sent to the new one
+// Files left to send to a new host
+type handoff struct {
+	host  *Client
+	paths []string
+}
+
+// Makes host the host and sends it every cached file as handoff_file parts,
+// then new_host and the requests the old host didn't answer. Files are
+// queued as host's queue drains, so that handoff can't overflow it
+func (r *Room) handOff(host *Client) {
+	host.IsHost = true
+	host.standby = false
+	r.Host = host
+
+	paths := make([]string, 0, len(r.docs.docs))
+	for path, state := range r.docs.docs {
+		if state.Doc != nil {
+			paths = append(paths, path)
+		}
+	}
+	sort.Strings(paths)
+	r.handoff = &handoff{host: host, paths: paths}
+	r.continueHandoff()
+}
+
+// Sends files of the handoff while they fit in host's queue, and finishes
+// it once all are sent
+func (r *Room) continueHandoff() {
+	h := r.handoff
+	host := h.host
+	for len(h.paths) > 0 {
+		// Files dropped meanwhile are skipped, edits of the others go to
+		// the host like to any client
+		doc, version, ok := r.docs.Get(h.paths[0])
+		if !ok {
+			h.paths = h.paths[1:]
+			continue
+		}
+		// All parts of a file go at once, so that no edit gets between
+		// them. Empty queue takes any file
+		parts := splitContent(doc.Content(), HandoffChunkSize)
+		free := cap(host.Send) - len(host.Send) - handoffHeadroom
+		if len(parts) > free && len(host.Send) > 0 {
+			r.handoffTimer.Reset(handoffPollInterval)
+			r.handoffWait = r.handoffTimer.C
+			return
+		}
+		offset := 0
+		for i, part := range parts {
+			r.sendJSON(host, &filePart{
+				Event:   "handoff_file",
+				Path:    h.paths[0],
+				Content: part,
+				Offset:  offset,
+				Version: version,
+				More:    i < len(parts)-1,
+			})
+			offset += len(part)
+		}
+		h.paths = h.paths[1:]
+	}
+	r.handoff = nil
+	r.broadcast(-1, map[string]any{"event": "new_host", "host_id": host.ID, "name": host.Name})
+
+	ids := make([]int, 0, len(r.PendingRequests))
+	for id := range r.PendingRequests {
+		ids = append(ids, id)
+	}
+	sort.Ints(ids)
+	for _, id := range ids {
+		req := r.PendingRequests[id]
+		client, ok := r.Clients[req.ClientID]
+		switch {
+		case req.ClientID == host.ID:
+			// New host doesn't ask itself
+			delete(r.PendingRequests, id)
+		case req.answered && req.Path == "":
+			// Parts already delivered can't be taken back. Files start
+			// over from offset 0, so they can be sent again
+			if ok {
+				r.sendJSON(client, map[string]any{"event": "error", "message": "Host left"})
+			}
+			delete(r.PendingRequests, id)
+		default:
+			req.answered = false
+			req.content = nil
+			req.Deadline = time.Now().Add(RequestTimeout)
+			r.deadlines.Push(id, req.Deadline)
+			r.server.send(host, req.raw)
+		}
+	}
+	r.armExpiry()
+}
+
+// Forgets the handoff when its host leaves
+func (r *Room) stopHandoff() {
+	if r.handoff == nil {
+		return
+	}
+	r.handoff = nil
+	stopTimer(r.handoffTimer)
+	r.handoffWait = nil
+}
+
+// Tells every requester that their request won't be answered
+func (r *Room) failPending(message string) {
+	for id, req := range r.PendingRequests {
+		if client, ok := r.Clients[req.ClientID]; ok {
+			r.sendJSON(client, map[string]any{"event": "error", "message": message})
+		}
+		delete(r.PendingRequests, id)
+	}
+}
+
+func (r *Room) handleTimeout(reqID int) {
+	req, ok := r.PendingRequests[reqID]
+	if !ok {
+		return
+	}
+	client, ok := r.Clients[req.ClientID]
+	if ok {
+		r.sendJSON(client, map[string]any{"event": "error", "message": "Timeout! Host failed to respond"})
+	}
+	delete(r.PendingRequests, reqID)
+}
+
+func (r *Room) sendJSON(client *Client, data any) {
+	r.server.sendJSON(client, data)
+}
+
+func (r *Room) broadcast(senderID int, data map[string]any) {
+	bytes, err := json.Marshal(data)
+	if err != nil {
+		logger.Errorf("Error marshaling: %v", err)
+		return
+	}
+	r.broadcastRaw(senderID, append(bytes, '\n'))
+}
+
+// Same as broadcast, but for already encoded, newline terminated message
+func (r *Room) broadcastRaw(senderID int, bytes []byte) {
+	logger.Payload("BROADCAST to", "all", bytes)
+
+	for _, c := range r.Clients {
+		if c.ID != senderID {
+			r.server.enqueue(c, bytes)
+		}
+	}
+}
+
+// Drops sender's undelivered cursor positions from every client
+func (r *Room) dropCursors(senderID int) {
+	delete(r.cursors, senderID)
+	for _, c := range r.Clients {
+		c.dropCursor(senderID)
+		delete(c.cursorShown, senderID)
+	}
+}
@@ -1,18 +1,55 @@
 package main
 
 import (
-	"bufio"
 	"encoding/json"
+	"errors"
 	"flag"
 	"fmt"
 	"log"
 	"net"
+	"net/http"
+	"os"
+	"sync"
+	"sync/atomic"
 	"time"
 )
 
 const (
 	RequestTimeout = 5 * time.Second
 	MaxBufferSize  = 5 * 1024 * 1024
+	// Read buffer of a connection, enough for typical messages so that
+	// idle connections stay small
+	ReadBufferSize = 4 * 1024
+	// Reliable messages a client's queue holds
+	clientQueueSize = 1024
+	// Longest room id accepted in handshake
+	MaxRoomIDLength = 256
+	// Longer session ids are ignored
+	MaxSessionLength = 64
+	// Defaults for writer coalescing
+	DefaultMaxBatchSize  = 64
+	DefaultMaxFlushDelay = 0
+	// Min time between cursor updates sent to a client
+	DefaultCursorInterval = 25 * time.Millisecond
+	// How long a write to a client may take
+	DefaultSendTimeout = 5 * time.Second
+	// How long files are kept for a host that left without a standby
+	DefaultHostGrace = 30 * time.Second
+)
+
+const (
+	overflowDisconnectName = "disconnect"
+	overflowResyncName     = "resync"
+)
+
+var (
+	// Set by server on forwarded messages, clients can't spoof these
+	originKeys  = []string{"from_id", "name", "trace"}
+	requestKeys = []string{"request_id", "from_id"}
+	// Server sets version, checkpoint hash, trace and, if they were
+	// transformed, changes
+	updateKeys        = []string{"from_id", "name", "version", "hash", "trace"}
+	updateChangedKeys = []string{"from_id", "name", "version", "hash", "trace", "changes"}
 )
 
 type Client struct {
@@ -20,40 +57,290 @@ type Client struct {
 	ID     int
 	Name   string
 	IsHost bool
-	// Channel buffer for all messages, ONLY WRITE TO THIS
+	// Takes over if the host leaves, set by handshake
+	standby bool
+	// Set by handshake, see Envelope.Session
+	session string
+	// Subscribed files and their viewports, nil gets every file. Owned by
+	// the room's goroutine like cursorShown, which tells whether sender's
+	// last cursor was in the viewport
+	subs        map[string]viewport
+	cursorShown map[int]bool
+	// Pre-encoded "from_id" and "name" members spliced into forwarded messages
+	fromField []byte
+	nameField []byte
+	// Reliable lane, channel buffer for all messages except cursors, ONLY
+	// WRITE TO THIS (through Server.enqueue)
 	Send chan []byte
+	// What happens when Send is full, set by handshake
+	overflow OverflowPolicy
+	// Set when Send overflowed with OverflowResync. Reliable messages are
+	// dropped until writer has written the queue and told client to resync
+	resync atomic.Bool
+	// Best-effort lane, latest undelivered cursor_move of each sender. Older
+	// positions are overwritten instead of queued, so they can't fill Send
+	cursorMu    sync.Mutex
+	cursors     map[int][]byte
+	cursorReady chan struct{}
+	// Set when client was disconnected for overflowing Send
+	dropped bool
+	// How messages are written to this client, see framing.go
+	framing  atomic.Int32
+	compress atomic.Bool
+	Stats    LaneStats
+}
+
+type Lane int
+
+const (
+	// Edits, writes and requests/responses, losing one desyncs clients
+	LaneReliable Lane = iota
+	// Presence, only the latest one matters
+	LaneBestEffort
+)
+
+func laneOf(event string) Lane {
+	if event == "cursor_move" {
+		return LaneBestEffort
+	}
+	return LaneReliable
 }
 
-type PendingRequest struct {
-	ClientID  int
-	RequestID int
-	Timer     *time.Timer
+// What server does with a client whose reliable lane is full. Routing never
+// waits for a client, so either the client goes or its messages do
+type OverflowPolicy int
+
+const (
+	// Client is disconnected and has to rejoin
+	OverflowDisconnect OverflowPolicy = iota
+	// Messages are dropped until the queue has been written, then client
+	// gets a resync event and requests its files again. Hosts are always
+	// disconnected, they have nowhere to get the files from
+	OverflowResync
+)
+
+func ParseOverflowPolicy(name string) (OverflowPolicy, error) {
+	switch name {
+	case overflowDisconnectName:
+		return OverflowDisconnect, nil
+	case overflowResyncName:
+		return OverflowResync, nil
+	}
+	return OverflowDisconnect, fmt.Errorf("unknown overflow policy %q", name)
+}
+
+// Told to a client after its messages were dropped with OverflowResync
+var resyncMessage = []byte(`{"event":"resync"}` + "\n")
+
+// Overflow counters of the lanes, safe to read from any goroutine
+type LaneStats struct {
+	// Reliable messages that found the queue full
+	ReliableFull atomic.Uint64
+	// Clients disconnected because their reliable queue was full
+	ReliableDisconnects atomic.Uint64
+	// Times a client's reliable messages were dropped and it had to resync
+	Resyncs atomic.Uint64
+	// Clients disconnected because a write took longer than SendTimeout
+	WriteTimeouts atomic.Uint64
+	// Cursor positions overwritten by newer ones before delivery
+	CursorsConflated atomic.Uint64
+}
+
+func NewClient(conn net.Conn) *Client {
+	return &Client{
+		Conn:        conn,
+		Send:        make(chan []byte, clientQueueSize),
+		cursors:     make(map[int][]byte),
+		cursorReady: make(chan struct{}, 1),
+	}
+}
+
+// Replaces sender's pending cursor position and wakes up writer. Returns
+// true if an undelivered position was overwritten
+func (c *Client) queueCursor(senderID int, msg []byte) bool {
+	c.cursorMu.Lock()
+	_, replaced := c.cursors[senderID]
+	c.cursors[senderID] = msg
+	c.cursorMu.Unlock()
+
+	select {
+	case c.cursorReady <- struct{}{}:
+	default:
+		// Writer has been already notified
+	}
+	return replaced
+}
+
+// Forgets sender's pending cursor, so that it can't be delivered after
+// cursor_leave or user_left
+func (c *Client) dropCursor(senderID int) {
+	c.cursorMu.Lock()
+	delete(c.cursors, senderID)
+	c.cursorMu.Unlock()
+}
+
+// Moves pending cursor positions to batch
+func (c *Client) takeCursors(batch net.Buffers) net.Buffers {
+	c.cursorMu.Lock()
+	for id, msg := range c.cursors {
+		batch = append(batch, msg)
+		delete(c.cursors, id)
+	}
+	c.cursorMu.Unlock()
+	return batch
 }
 
 type Server struct {
-	Clients         map[int]*Client
-	Host            *Client
-	PendingRequests map[int]*PendingRequest
-	NextClientID    int
-	NextRequestID   int
-	actions         chan func()
+	// Rooms by id, each has its own actor loop
+	roomsMu sync.Mutex
+	rooms   map[string]*Room
+	// Room of clients that don't give one in handshake, never removed
+	DefaultRoom *Room
+	// Max number of queued messages written to a client in one syscall
+	MaxBatchSize int
+	// How long writer waits for more messages before flushing a batch
+	// that is not full, zero only sends what is already queued
+	MaxFlushDelay time.Duration
+	// Min time between cursor_move deliveries to a client, positions that
+	// arrive in between are conflated
+	CursorInterval time.Duration
+	// How long a write to a client may take before disconnecting it
+	SendTimeout time.Duration
+	// How long a room keeps its files after the host left without a
+	// standby, so that the host can resume. Zero forgets them right away
+	HostGrace time.Duration
+	// Default policy for clients that don't choose one in handshake
+	Overflow OverflowPolicy
+	Stats    LaneStats
+	Metrics  *Metrics
+	// Directory of room journals, empty keeps files only in memory. Guarded
+	// by roomsMu, set with UseJournal
+	journalDir string
+	// Done channels of stopped rooms by id, until the id is used again. A
+	// room started again waits for the old one, so that it doesn't read a
+	// journal that is still being written
+	stopping map[string]chan struct{}
 }
 
 func NewServer() *Server {
-	return &Server{
-		Clients:         make(map[int]*Client),
-		PendingRequests: make(map[int]*PendingRequest),
-		actions:         make(chan func(), 1024),
+	s := &Server{
+		rooms:          make(map[string]*Room),
+		stopping:       make(map[string]chan struct{}),
+		MaxBatchSize:   DefaultMaxBatchSize,
+		MaxFlushDelay:  DefaultMaxFlushDelay,
+		CursorInterval: DefaultCursorInterval,
+		SendTimeout:    DefaultSendTimeout,
+		HostGrace:      DefaultHostGrace,
+		Metrics:        NewMetrics(),
+	}
+	s.DefaultRoom = s.room("")
+	return s
+}
+
+// Returns room with id, starting it if it doesn't exist yet
+func (s *Server) room(id string) *Room {
+	s.roomsMu.Lock()
+	defer s.roomsMu.Unlock()
+	return s.roomLocked(id)
+}
+
+func (s *Server) roomLocked(id string) *Room {
+	room, ok := s.rooms[id]
+	if !ok {
+		room = newRoom(s, id)
+		room.journalDir = s.journalDir
+		room.previous = s.stopping[id]
+		delete(s.stopping, id)
+		s.rooms[id] = room
+		go room.run()
+	}
+	return room
+}
+
+// Journals rooms' files in dir from now on, the default room loads its
+// journal right away
+func (s *Server) UseJournal(dir string) {
+	s.roomsMu.Lock()
+	s.journalDir = dir
+	s.roomsMu.Unlock()
+	room := s.DefaultRoom
+	room.actions <- func() { room.openJournal(dir) }
+}
+
+// Returns room with id and reserves it for a connection until leaveRoom
+func (s *Server) joinRoom(id string) *Room {
+	s.roomsMu.Lock()
+	defer s.roomsMu.Unlock()
+
+	room := s.roomLocked(id)
+	room.refs++
+	return room
+}
+
+// Releases connection's reservation, stopping the room when the last
+// connection has left
+func (s *Server) leaveRoom(room *Room) {
+	s.roomsMu.Lock()
+	room.refs--
+	empty := room.refs == 0 && room != s.DefaultRoom
+	if empty {
+		delete(s.rooms, room.ID)
+		s.stopping[room.ID] = room.done
+	}
+	s.roomsMu.Unlock()
+
+	// Nobody else can send to the room anymore
+	if empty {
+		room.inbox <- roomEvent{kind: eventClose}
 	}
 }
 
+// Number of running rooms
+func (s *Server) RoomCount() int {
+	s.roomsMu.Lock()
+	defer s.roomsMu.Unlock()
+	return len(s.rooms)
+}
+
 func main() {
 	portPtr := flag.String("port", "8080", "")
+	batchPtr := flag.Int("batch-size", DefaultMaxBatchSize, "max messages per write to a client")
+	delayPtr := flag.Duration("flush-delay", DefaultMaxFlushDelay, "max time to wait for more messages before writing")
+	cursorPtr := flag.Duration("cursor-interval", DefaultCursorInterval, "min time between cursor updates sent to a client")
+	sendTimeoutPtr := flag.Duration("send-timeout", DefaultSendTimeout, "how long a write to a client may take before disconnecting it")
+	overflowPtr := flag.String("overflow", overflowDisconnectName, "what happens to a client whose queue is full: disconnect or resync")
+	logLevelPtr := flag.String("log-level", "info", "off, error, info or debug (logs message payloads)")
+	logSamplePtr := flag.Int("log-sample", DefaultLogSample, "log only every Nth message payload at debug level")
+	logPreviewPtr := flag.Int("log-preview", DefaultLogPreview, "max bytes of a payload to log")
+	hostGracePtr := flag.Duration("host-grace", DefaultHostGrace, "how long files are kept for a host that left without a standby")
+	metricsPtr := flag.String("metrics", "", "address to serve Prometheus metrics on, e.g. :9090 (off if empty)")
+	journalPtr := flag.String("journal", "", "directory to journal rooms' files in, so that clients can resume after a restart (off if empty)")
 	flag.Parse()
+
+	logLevel, err := ParseLogLevel(*logLevelPtr)
+	if err != nil {
+		log.Fatal(err)
+	}
+	logger.Configure(logLevel, *logSamplePtr, *logPreviewPtr)
+	overflow, err := ParseOverflowPolicy(*overflowPtr)
+	if err != nil {
+		log.Fatal(err)
+	}
 	address := ":" + *portPtr
 
 	server := NewServer()
-	go server.run()
+	server.MaxBatchSize = max(*batchPtr, 1)
+	server.MaxFlushDelay = *delayPtr
+	server.CursorInterval = *cursorPtr
+	server.SendTimeout = *sendTimeoutPtr
+	server.HostGrace = *hostGracePtr
+	server.Overflow = overflow
+	if *journalPtr != "" {
+		if err := os.MkdirAll(*journalPtr, 0o755); err != nil {
+			log.Fatal(err)
+		}
+		server.UseJournal(*journalPtr)
+	}
 
 	listener, err := net.Listen("tcp", address)
 	if err != nil {
@@ -62,251 +349,287 @@ func main() {
 	defer listener.Close()
 	fmt.Printf("Listening on %s\n", address)
 
+	if *metricsPtr != "" {
+		metricsListener, err := net.Listen("tcp", *metricsPtr)
+		if err != nil {
+			log.Fatal(err)
+		}
+		mux := http.NewServeMux()
+		mux.HandleFunc("/metrics", server.ServeMetrics)
+		go func() {
+			logger.Errorf("Metrics listener stopped: %v", http.Serve(metricsListener, mux))
+		}()
+		fmt.Printf("Serving metrics on %s/metrics\n", *metricsPtr)
+	}
+
 	for {
 		conn, err := listener.Accept()
 		if err != nil {
-			log.Println("Accept error:", err)
+			logger.Errorf("Accept error: %v", err)
 			continue
 		}
 		go server.handleConnection(conn)
 	}
 }
 
-func (s *Server) run() {
-	for action := range s.actions {
-		action()
-	}
-}
-
 func (s *Server) handleConnection(conn net.Conn) {
-	client := &Client{
-		Conn: conn,
-		Send: make(chan []byte, 1024),
-	}
-
-	// Joining
-	s.actions <- func() {
-		client.ID = s.NextClientID
-		s.NextClientID++
-		client.IsHost = false
-		s.Clients[client.ID] = client
-	}
+	client := NewClient(conn)
+	// Set by handshake, until then this goroutine owns the client
+	var room *Room
 
 	// Writer goroutine
 	done := make(chan struct{})
 	go func() {
-		defer conn.Close()
-		for msg := range client.Send {
-			_, err := conn.Write(msg)
-			if err != nil {
-				break
-			}
-		}
+		s.writeLoop(client)
 		close(done)
 	}()
 
-	// Reader
-	scanner := bufio.NewScanner(conn)
-	// 64 KB by default
-	scanner.Buffer(make([]byte, 0, 64*1024), MaxBufferSize)
+	// Reader, longer messages are collected in buffers that are only kept
+	// while they are small
+	reader := newFrameReader(conn, ReadBufferSize, MaxBufferSize)
+	peer := conn.RemoteAddr().String()
+
+	for {
+		line, owned, err := reader.Next()
+		if err != nil {
+			break
+		}
+		msg, err := parseMessage(line, owned)
+		if err != nil {
+			continue
+		}
+		logger.Payload("RECEIVED from", peer, msg.Raw)
+		s.Metrics.Received(msg.Event, len(msg.Raw))
+
+		if room != nil {
+			now := time.Now()
+			if msg.Trace != nil {
+				msg.Trace.Received = unixMillis(now)
+			}
+			// Send message to the room's "manager"
+			room.inbox <- roomEvent{kind: eventMessage, client: client, msg: msg, at: now}
+			continue
+		}
 
-	for scanner.Scan() {
-		var msg map[string]any
-		if err := json.Unmarshal(scanner.Bytes(), &msg); err != nil {
+		// Handshake (joins a room and adds necessary info to client)
+		if msg.Event != "handshake" {
+			s.sendJSON(client, map[string]any{"event": "error", "message": "Set name first!"})
 			continue
 		}
-		log.Printf("RECEIVED: %q\n", scanner.Bytes())
-		// Send task to the "manager"
-		s.actions <- func() {
-			s.processMessage(client, msg)
+		if len(msg.Room) > MaxRoomIDLength {
+			s.sendJSON(client, map[string]any{"event": "error", "message": "Room id is too long"})
+			continue
+		}
+		if msg.Name == "" {
+			continue
+		}
+		// Writer switches right away, clients accept both framings anyway
+		if msg.Framing == framingLengthName {
+			client.framing.Store(int32(FramingLength))
+			// Compressed messages need frames
+			client.compress.Store(msg.Compression == compressionZlibName)
+		}
+		client.overflow = s.Overflow
+		if policy, err := ParseOverflowPolicy(msg.Overflow); err == nil {
+			client.overflow = policy
 		}
+		room = s.joinRoom(msg.Room)
+		room.inbox <- roomEvent{kind: eventJoin, client: client, msg: msg}
 	}
 
 	// Leave/disconnect
-	s.actions <- func() {
-		s.removeClient(client)
+	if room == nil {
+		// Never joined, just stop the writer
+		close(client.Send)
+		return
 	}
+	room.inbox <- roomEvent{kind: eventLeave, client: client}
+	s.leaveRoom(room)
 }
 
-func (s *Server) processMessage(client *Client, msg map[string]any) {
-	event, _ := msg["event"].(string)
+// Drains client's Send queue, writing everything that is already queued with
+// one (vectored) write instead of one syscall per message. Conflated cursor
+// positions are written at most once per CursorInterval
+func (s *Server) writeLoop(client *Client) {
+	defer client.Conn.Close()
 
-	// Handshake (add necessary info to client)
-	if event == "handshake" {
-		s.handleHandshake(client, msg)
-		return
+	var timer *time.Timer
+	if s.MaxFlushDelay > 0 {
+		timer = time.NewTimer(s.MaxFlushDelay)
+		stopTimer(timer)
 	}
 
-	// Name is required for all other events
-	if client.Name == "" {
-		s.sendJSON(client, map[string]any{"event": "error", "message": "Set name first!"})
-		return
-	}
+	cursorTimer := time.NewTimer(s.CursorInterval)
+	stopTimer(cursorTimer)
+	// Set while pending cursors wait for the interval to pass
+	var cursorWait <-chan time.Time
+	var lastCursors time.Time
 
-	// Route events by type
-	switch event {
-	// To broadcast
-	case "cursor_move", "update_content", "cursor_leave", "remote_write":
-		msg["from_id"] = client.ID
-		msg["name"] = client.Name
-		s.broadcast(client.ID, msg)
-		// Requests to host
-	default:
-		// Request/Response
-		if reqIDFloat, ok := msg["request_id"].(float64); ok {
-			s.resolvePendingRequest(int(reqIDFloat), msg)
-		} else {
-			s.createNewRequest(client, msg)
+	batch := make(net.Buffers, 0, s.MaxBatchSize)
+	// Only used with length-prefixed framing
+	var frames frameWriter
+	for {
+		open := true
+		batch = batch[:0]
+
+		// Everything queued before the overflow is written, the rest is
+		// sent again
+		if client.resync.Load() && len(client.Send) == 0 {
+			client.resync.Store(false)
+			if s.write(client, append(batch, resyncMessage), &frames) != nil {
+				return
+			}
 		}
-	}
-}
 
-func (s *Server) handleHandshake(client *Client, msg map[string]any) {
-	newName, _ := msg["name"].(string)
-
-	wantsHost, _ := msg["host"].(bool)
-
-	if newName != "" && client.Name == "" {
-		client.Name = newName
-
-		// If they asked to be host, and no host exists, make them host.
-		if wantsHost {
-			if s.Host == nil {
-				client.IsHost = true
-				s.Host = client
-				log.Printf("Client %s (ID: %d) registered as HOST", client.Name, client.ID)
-			} else {
-				log.Printf("Client %s requested host, but host already exists (ID: %d)", client.Name, s.Host.ID)
+		select {
+		case msg, ok := <-client.Send:
+			if !ok {
+				return
+			}
+			batch, open = s.fillBatch(client, append(batch, msg), timer)
+		case <-client.cursorReady:
+			if cursorWait != nil {
+				continue
 			}
+			if wait := s.CursorInterval - time.Since(lastCursors); wait > 0 {
+				cursorTimer.Reset(wait)
+				cursorWait = cursorTimer.C
+				continue
+			}
+			// Reliable messages go first
+			batch, open = s.fillBatch(client, batch, nil)
+			batch = client.takeCursors(batch)
+			lastCursors = time.Now()
+		case <-cursorWait:
+			cursorWait = nil
+			batch, open = s.fillBatch(client, batch, nil)
+			batch = client.takeCursors(batch)
+			lastCursors = time.Now()
 		}
 
-		s.broadcast(client.ID, map[string]any{
-			"event":   "user_joined",
-			"id":      client.ID,
-			"name":    client.Name,
-			"is_host": client.IsHost,
-		})
-		// Send info about server state on client
-		s.sendJSON(client, map[string]any{
-			"event":   "handshake_response",
-			"id":      client.ID,
-			"name":    client.Name,
-			"is_host": client.IsHost,
-		})
-	}
-}
-
-// Deletes pending request (successful response :D)
-func (s *Server) resolvePendingRequest(reqID int, msg map[string]any) {
-	if pending, exists := s.PendingRequests[reqID]; exists {
-		if target, ok := s.Clients[pending.ClientID]; ok {
-			delete(msg, "request_id")
-			s.sendJSON(target, msg)
+		if len(batch) > 0 && s.write(client, batch, &frames) != nil {
+			return
+		}
+		if !open {
+			return
 		}
-		pending.Timer.Stop()
-		delete(s.PendingRequests, reqID)
 	}
 }
 
-func (s *Server) createNewRequest(client *Client, msg map[string]any) {
-	reqID := s.NextRequestID
-	s.NextRequestID++
-
-	pending := &PendingRequest{
-		ClientID:  client.ID,
-		RequestID: reqID,
+// Writes batch with client's framing. A write that doesn't finish in
+// SendTimeout fails, so a stuck client can't keep its writer forever
+func (s *Server) write(client *Client, batch net.Buffers, frames *frameWriter) error {
+	// WriteTo consumes the slice it is called on, keep batch for reuse
+	pending := batch
+	if Framing(client.framing.Load()) == FramingLength {
+		pending = frames.Frame(batch, client.compress.Load())
 	}
-
-	pending.Timer = time.AfterFunc(RequestTimeout, func() {
-		s.actions <- func() {
-			s.handleTimeout(reqID)
-		}
-	})
-	s.PendingRequests[reqID] = pending
-
-	msg["request_id"] = reqID
-	msg["from_id"] = client.ID
-
-	if s.Host != nil {
-		s.sendJSON(s.Host, msg)
-	} else {
-		s.sendJSON(client, map[string]any{"event": "error", "message": "No host available"})
-		pending.Timer.Stop()
-		delete(s.PendingRequests, reqID)
+	if s.SendTimeout > 0 {
+		client.Conn.SetWriteDeadline(time.Now().Add(s.SendTimeout))
+	}
+	_, err := pending.WriteTo(client.Conn)
+	if errors.Is(err, os.ErrDeadlineExceeded) {
+		logger.Errorf("Client %s (ID: %d) is too slow, write timed out", client.Name, client.ID)
+		client.Stats.WriteTimeouts.Add(1)
+		s.Stats.WriteTimeouts.Add(1)
 	}
+	return err
 }
 
-func (s *Server) removeClient(client *Client) {
-	if _, ok := s.Clients[client.ID]; !ok {
-		return
+// Adds queued messages to batch until it has MaxBatchSize messages, waiting
+// at most MaxFlushDelay (timer) for new ones. Returns false if Send was closed
+func (s *Server) fillBatch(client *Client, batch net.Buffers, timer *time.Timer) (net.Buffers, bool) {
+	var expired <-chan time.Time
+	if timer != nil {
+		timer.Reset(s.MaxFlushDelay)
+		defer stopTimer(timer)
+		expired = timer.C
 	}
 
-	delete(s.Clients, client.ID)
-	close(client.Send)
+	for len(batch) < s.MaxBatchSize {
+		if expired == nil {
+			select {
+			case msg, ok := <-client.Send:
+				if !ok {
+					return batch, false
+				}
+				batch = append(batch, msg)
+			default:
+				return batch, true
+			}
+			continue
+		}
 
-	for id, req := range s.PendingRequests {
-		if req.ClientID == client.ID {
-			req.Timer.Stop()
-			delete(s.PendingRequests, id)
+		select {
+		case msg, ok := <-client.Send:
+			if !ok {
+				return batch, false
+			}
+			batch = append(batch, msg)
+		case <-expired:
+			return batch, true
 		}
 	}
+	return batch, true
+}
 
-	if client.IsHost {
-		s.Host = nil
-		log.Printf("Host %s left. Waiting for new host...", client.Name)
-
-		s.broadcast(-1, map[string]any{
-			"event": "host_left",
-		})
+// Stops timer and drains it so it can be reset
+func stopTimer(timer *time.Timer) {
+	if !timer.Stop() {
+		select {
+		case <-timer.C:
+		default:
+		}
 	}
-
-	s.broadcast(-1, map[string]any{"event": "user_left", "id": client.ID, "name": client.Name})
 }
 
-func (s *Server) handleTimeout(reqID int) {
-	req, ok := s.PendingRequests[reqID]
-	if !ok {
+// Sends data encoded as json. Messages sent often are structs, maps take
+// several times longer to encode
+func (s *Server) sendJSON(client *Client, data any) {
+	bytes, err := json.Marshal(data)
+	if err != nil {
+		logger.Errorf("Error marshaling: %v", err)
 		return
 	}
-	client, ok := s.Clients[req.ClientID]
-	if ok {
-		s.sendJSON(client, map[string]any{"event": "error", "message": "Timeout! Host failed to respond"})
-	}
-	delete(s.PendingRequests, reqID)
+	s.send(client, append(bytes, '\n'))
 }
 
-func (s *Server) sendJSON(client *Client, data map[string]any) {
-	bytes, err := json.Marshal(data)
-	if err != nil {
-		log.Printf("Error marshaling: %v", err)
+// Queues an encoded, newline terminated message for client
+func (s *Server) send(client *Client, bytes []byte) {
+	logger.Payload("SEND to", client.Name, bytes)
+	s.enqueue(client, bytes)
+}
+
+// Puts message on client's reliable lane without ever waiting. Reliable
+// messages are never silently lost: if the lane is full the client is
+// disconnected (and has to rejoin), or with OverflowResync told to get its
+// files again once the queue has been written
+func (s *Server) enqueue(client *Client, bytes []byte) {
+	if client.dropped || client.resync.Load() {
 		return
 	}
-	bytes = append(bytes, '\n')
-	log.Printf("SEND: %q TO %s\n", bytes, client.Name)
 
 	select {
 	case client.Send <- bytes:
-	case <-time.After(5 * time.Second):
-		log.Println("Client disconnected or slow, failed to send")
+		return
+	default:
 	}
-}
 
-func (s *Server) broadcast(senderID int, data map[string]any) {
-	bytes, err := json.Marshal(data)
-	if err != nil {
-		log.Printf("Error marshaling: %v", err)
+	client.Stats.ReliableFull.Add(1)
+	s.Stats.ReliableFull.Add(1)
+
+	if client.overflow == OverflowResync && !client.IsHost {
+		logger.Infof("Client %s (ID: %d) is too slow, dropping messages until it resyncs", client.Name, client.ID)
+		client.Stats.Resyncs.Add(1)
+		s.Stats.Resyncs.Add(1)
+		client.resync.Store(true)
 		return
 	}
-	bytes = append(bytes, '\n')
-	log.Printf("BROADCASTING: %q\n", bytes)
 
-	for _, c := range s.Clients {
-		if c.ID != senderID {
-			select {
-			case c.Send <- bytes:
-			default:
-				// Buffer full, dropping
-			}
-		}
-	}
+	logger.Errorf("Client %s (ID: %d) is too slow, disconnecting", client.Name, client.ID)
+	client.Stats.ReliableDisconnects.Add(1)
+	s.Stats.ReliableDisconnects.Add(1)
+	client.dropped = true
+	// Reader notices this and removes the client
+	client.Conn.Close()
 }
@@ -2,6 +2,8 @@ package main
 
 import (
 	"bufio"
+	"encoding/json"
+	"errors"
 	"fmt"
 	"io"
 	"log"
@@ -13,9 +15,10 @@ import (
 )
 
 func startTestServer() (*Server, string) {
-	server := NewServer()
-	go server.run()
+	return startTestServerWith(NewServer())
+}
 
+func startTestServerWith(server *Server) (*Server, string) {
 	listener, _ := net.Listen("tcp", "127.0.0.1:0")
 	go func() {
 		for {
@@ -58,8 +61,8 @@ func TestDisconnect(t *testing.T) {
 	time.Sleep(20 * time.Millisecond)
 
 	done := make(chan bool)
-	server.actions <- func() {
-		if len(server.Clients) == 0 {
+	server.DefaultRoom.actions <- func() {
+		if len(server.DefaultRoom.Clients) == 0 {
 			done <- true
 		} else {
 			done <- false
@@ -102,12 +105,17 @@ func TestMessageLimits(t *testing.T) {
 	time.Sleep(50 * time.Millisecond)
 
 	done := make(chan int)
-	server.actions <- func() {
-		done <- len(server.Clients)
+	server.DefaultRoom.actions <- func() {
+		done <- len(server.DefaultRoom.Clients)
 	}
 	if <-done > 0 {
 		t.Error("Server did not drop client for exceeding MaxBufferSize")
 	}
+	conn.SetReadDeadline(time.Now().Add(time.Second))
+	// EOF or reset, as long as it's not a timeout
+	if _, err := io.Copy(io.Discard, conn); errors.Is(err, os.ErrDeadlineExceeded) {
+		t.Error("Server did not close connection exceeding MaxBufferSize")
+	}
 }
 
 func TestHostClaiming(t *testing.T) {
@@ -120,8 +128,8 @@ func TestHostClaiming(t *testing.T) {
 
 	// Verify c1 is host
 	done := make(chan bool)
-	server.actions <- func() {
-		if server.Host != nil && server.Host.Name == "host" && server.Host.IsHost {
+	server.DefaultRoom.actions <- func() {
+		if server.DefaultRoom.Host != nil && server.DefaultRoom.Host.Name == "host" && server.DefaultRoom.Host.IsHost {
 			done <- true
 		} else {
 			done <- false
@@ -137,8 +145,8 @@ func TestHostClaiming(t *testing.T) {
 	bufio.NewReader(c2).ReadString('\n')
 
 	// Verify c1 is still host (c2 failed)
-	server.actions <- func() {
-		if server.Host != nil && server.Host.Name == "host" {
+	server.DefaultRoom.actions <- func() {
+		if server.DefaultRoom.Host != nil && server.DefaultRoom.Host.Name == "host" {
 			done <- true
 		} else {
 			done <- false
@@ -169,8 +177,8 @@ func TestRequestTimeoutCleanup(t *testing.T) {
 
 	// Make sure that request was created
 	done := make(chan bool)
-	server.actions <- func() {
-		if len(server.PendingRequests) > 0 {
+	server.DefaultRoom.actions <- func() {
+		if len(server.DefaultRoom.PendingRequests) > 0 {
 			done <- true
 		} else {
 			done <- false
@@ -181,11 +189,11 @@ func TestRequestTimeoutCleanup(t *testing.T) {
 	}
 
 	// Wait for timeout
-	time.Sleep(RequestTimeout + 50*time.Millisecond)
+	time.Sleep(RequestTimeout + RequestTimeoutResolution + 50*time.Millisecond)
 
 	// Make sure that timeout clears the request
-	server.actions <- func() {
-		if len(server.PendingRequests) == 0 {
+	server.DefaultRoom.actions <- func() {
+		if len(server.DefaultRoom.PendingRequests) == 0 {
 			done <- true
 		} else {
 			done <- false
@@ -210,6 +218,732 @@ func TestUnauthorizedAccess(t *testing.T) {
 	}
 }
 
+func TestBroadcastStampsSender(t *testing.T) {
+	_, addr := startTestServer()
+
+	c1, _ := net.Dial("tcp", addr)
+	defer c1.Close()
+	r1 := bufio.NewReader(c1)
+	fmt.Fprintln(c1, `{"event": "handshake", "name": "vastaanottaja"}`)
+	r1.ReadString('\n')
+
+	c2, _ := net.Dial("tcp", addr)
+	defer c2.Close()
+	fmt.Fprintln(c2, `{"event": "handshake", "name": "lahettaja"}`)
+	bufio.NewReader(c2).ReadString('\n')
+	r1.ReadString('\n') // user_joined
+
+	// Sender tries to pose as someone else
+	fmt.Fprintln(c2, `{"event": "cursor_move", "position": [1,2], "path": "a.c", "name": "roisto", "from_id": 99}`)
+
+	reply, _ := r1.ReadString('\n')
+	var msg struct {
+		Event    string `json:"event"`
+		FromID   int    `json:"from_id"`
+		Name     string `json:"name"`
+		Path     string `json:"path"`
+		Position []int  `json:"position"`
+	}
+	if err := json.Unmarshal([]byte(reply), &msg); err != nil {
+		t.Fatalf("Invalid broadcast %q: %v", reply, err)
+	}
+	if msg.Event != "cursor_move" || msg.Name != "lahettaja" || msg.FromID != 1 || msg.Path != "a.c" || len(msg.Position) != 2 {
+		t.Fatalf("Broadcast was not stamped correctly: %s", reply)
+	}
+	if strings.Count(reply, `"name"`) != 1 {
+		t.Fatalf("Duplicate fields in broadcast: %s", reply)
+	}
+}
+
+func TestRequestResponseRouting(t *testing.T) {
+	_, addr := startTestServer()
+
+	h, _ := net.Dial("tcp", addr)
+	defer h.Close()
+	hr := bufio.NewReader(h)
+	fmt.Fprintln(h, `{"event": "handshake", "name": "host", "host": true}`)
+	hr.ReadString('\n')
+
+	c, _ := net.Dial("tcp", addr)
+	defer c.Close()
+	cr := bufio.NewReader(c)
+	fmt.Fprintln(c, `{"event": "handshake", "name": "requester"}`)
+	cr.ReadString('\n')
+	hr.ReadString('\n') // user_joined
+
+	fmt.Fprintln(c, `{"event": "request_file", "path": "a.c"}`)
+	request, _ := hr.ReadString('\n')
+	var req struct {
+		Event     string `json:"event"`
+		Path      string `json:"path"`
+		RequestID *int   `json:"request_id"`
+		FromID    int    `json:"from_id"`
+	}
+	if err := json.Unmarshal([]byte(request), &req); err != nil || req.RequestID == nil {
+		t.Fatalf("Host got invalid request %q: %v", request, err)
+	}
+	if req.Event != "request_file" || req.Path != "a.c" || req.FromID != 1 {
+		t.Fatalf("Request was not forwarded correctly: %s", request)
+	}
+
+	fmt.Fprintf(h, `{"event": "response_file", "path": "a.c", "content": "x\ny", "request_id": %d}`+"\n", *req.RequestID)
+	response, _ := cr.ReadString('\n')
+	var resp map[string]any
+	if err := json.Unmarshal([]byte(response), &resp); err != nil {
+		t.Fatalf("Invalid response %q: %v", response, err)
+	}
+	if _, ok := resp["request_id"]; ok || resp["content"] != "x\ny" || resp["event"] != "response_file" {
+		t.Fatalf("Response was not forwarded correctly: %s", response)
+	}
+}
+
+func TestStreamedResponse(t *testing.T) {
+	server, addr := startTestServer()
+
+	h, _ := net.Dial("tcp", addr)
+	defer h.Close()
+	hr := bufio.NewReader(h)
+	fmt.Fprintln(h, `{"event": "handshake", "name": "host", "host": true}`)
+	hr.ReadString('\n')
+
+	c, _ := net.Dial("tcp", addr)
+	defer c.Close()
+	cr := bufio.NewReader(c)
+	fmt.Fprintln(c, `{"event": "handshake", "name": "requester"}`)
+	cr.ReadString('\n')
+	hr.ReadString('\n') // user_joined
+
+	fmt.Fprintln(c, `{"event": "request_file", "path": "big.log"}`)
+	request, _ := hr.ReadString('\n')
+	var req struct {
+		RequestID int `json:"request_id"`
+	}
+	json.Unmarshal([]byte(request), &req)
+
+	pending := func() int {
+		n := make(chan int)
+		server.DefaultRoom.actions <- func() { n <- len(server.DefaultRoom.PendingRequests) }
+		return <-n
+	}
+
+	for i := 0; i < 3; i++ {
+		fmt.Fprintf(h, `{"event": "response_file", "path": "big.log", "content": "part%d", "offset": %d, "more": true, "request_id": %d}`+"\n", i, i*5, req.RequestID)
+		part, _ := cr.ReadString('\n')
+		if !strings.Contains(part, fmt.Sprintf(`"content": "part%d"`, i)) {
+			t.Fatalf("Expected part %d, got %s", i, part)
+		}
+		if pending() != 1 {
+			t.Fatalf("Streamed request was resolved after part %d", i)
+		}
+	}
+
+	fmt.Fprintf(h, `{"event": "response_file", "path": "big.log", "content": "end", "offset": 15, "request_id": %d}`+"\n", req.RequestID)
+	if last, _ := cr.ReadString('\n'); !strings.Contains(last, `"content": "end"`) {
+		t.Fatalf("Expected last part, got %s", last)
+	}
+	if pending() != 0 {
+		t.Fatal("Request was not resolved by the last part")
+	}
+}
+
+func TestDocumentCache(t *testing.T) {
+	server, addr := startTestServer()
+
+	h, _ := net.Dial("tcp", addr)
+	defer h.Close()
+	hr := bufio.NewReader(h)
+	fmt.Fprintln(h, `{"event": "handshake", "name": "host", "host": true}`)
+	hr.ReadString('\n')
+
+	c, _ := net.Dial("tcp", addr)
+	defer c.Close()
+	cr := bufio.NewReader(c)
+	fmt.Fprintln(c, `{"event": "handshake", "name": "requester"}`)
+	cr.ReadString('\n')
+	hr.ReadString('\n') // user_joined
+
+	// First request goes to host, streamed in two parts
+	fmt.Fprintln(c, `{"event": "request_file", "path": "a.c"}`)
+	request, _ := hr.ReadString('\n')
+	var req struct {
+		RequestID int `json:"request_id"`
+	}
+	json.Unmarshal([]byte(request), &req)
+	fmt.Fprintf(h, `{"event": "response_file", "path": "a.c", "content": "one\n", "offset": 0, "more": true, "request_id": %d}`+"\n", req.RequestID)
+	fmt.Fprintf(h, `{"event": "response_file", "path": "a.c", "content": "two\nthree", "offset": 4, "request_id": %d}`+"\n", req.RequestID)
+	cr.ReadString('\n')
+	cr.ReadString('\n')
+
+	fmt.Fprintln(c, `{"event": "update_content", "path": "a.c", "changes": {"first": 1, "old_last": 2, "lines": ["TWO", "2"]}}`)
+	hr.ReadString('\n') // broadcast
+	cr.ReadString('\n') // update_ack
+
+	// Second one is answered by server
+	fmt.Fprintln(c, `{"event": "request_file", "path": "a.c"}`)
+	response, _ := cr.ReadString('\n')
+	var file struct {
+		Content string `json:"content"`
+		More    bool   `json:"more"`
+	}
+	if err := json.Unmarshal([]byte(response), &file); err != nil || file.Content != "one\nTWO\n2\nthree" || file.More {
+		t.Fatalf("Expected cached file with the update, got %s", response)
+	}
+
+	// Host must not see the cached request
+	fmt.Fprintln(c, `{"event": "request_files"}`)
+	if next, _ := hr.ReadString('\n'); !strings.Contains(next, "request_files") {
+		t.Fatalf("Host got cached request_file: %s", next)
+	}
+
+	// Cache goes with the host, and nobody is left to answer request_files
+	h.Close()
+	cr.ReadString('\n') // host_left
+	if failed, _ := cr.ReadString('\n'); !strings.Contains(failed, "Host left") {
+		t.Fatalf("Expected pending request to fail, got %s", failed)
+	}
+	cr.ReadString('\n') // user_left
+	cached := make(chan int)
+	server.DefaultRoom.actions <- func() { cached <- len(server.DefaultRoom.docs.docs) }
+	if n := <-cached; n != 0 {
+		t.Fatalf("Expected cache to be cleared when host left, has %d files", n)
+	}
+}
+
+func TestHostFailover(t *testing.T) {
+	server, addr := startTestServer()
+
+	h, _ := net.Dial("tcp", addr)
+	defer h.Close()
+	hr := bufio.NewReader(h)
+	fmt.Fprintln(h, `{"event": "handshake", "name": "host", "host": true}`)
+	hr.ReadString('\n')
+
+	s, _ := net.Dial("tcp", addr)
+	defer s.Close()
+	sr := bufio.NewReader(s)
+	fmt.Fprintln(s, `{"event": "handshake", "name": "standby", "standby": true}`)
+	sr.ReadString('\n')
+	hr.ReadString('\n') // user_joined
+
+	c, _ := net.Dial("tcp", addr)
+	defer c.Close()
+	cr := bufio.NewReader(c)
+	fmt.Fprintln(c, `{"event": "handshake", "name": "guest"}`)
+	cr.ReadString('\n')
+	hr.ReadString('\n') // user_joined
+	sr.ReadString('\n') // user_joined
+
+	var req struct {
+		RequestID int `json:"request_id"`
+	}
+	// Cached file, edited once
+	fmt.Fprintln(c, `{"event": "request_file", "path": "a.c"}`)
+	request, _ := hr.ReadString('\n')
+	json.Unmarshal([]byte(request), &req)
+	fmt.Fprintf(h, `{"event": "response_file", "path": "a.c", "content": "one\ntwo", "offset": 0, "version": 0, "request_id": %d}`+"\n", req.RequestID)
+	cr.ReadString('\n')
+	fmt.Fprintln(c, `{"event": "update_content", "path": "a.c", "version": 0, "changes": {"first": 0, "old_last": 1, "lines": ["ONE"]}}`)
+	cr.ReadString('\n') // update_ack
+	hr.ReadString('\n') // broadcast
+	sr.ReadString('\n') // broadcast
+
+	// Unanswered request and a file the host had started to send
+	fmt.Fprintln(c, `{"event": "request_files"}`)
+	hr.ReadString('\n')
+	fmt.Fprintln(c, `{"event": "request_file", "path": "b.c"}`)
+	request, _ = hr.ReadString('\n')
+	json.Unmarshal([]byte(request), &req)
+	fmt.Fprintf(h, `{"event": "response_file", "path": "b.c", "content": "half", "offset": 0, "more": true, "request_id": %d}`+"\n", req.RequestID)
+	cr.ReadString('\n')
+
+	h.Close()
+	var file struct {
+		Event   string `json:"event"`
+		Path    string `json:"path"`
+		Content string `json:"content"`
+		Version int    `json:"version"`
+	}
+	handoff, _ := sr.ReadString('\n')
+	if err := json.Unmarshal([]byte(handoff), &file); err != nil || file.Event != "handoff_file" ||
+		file.Path != "a.c" || file.Content != "ONE\ntwo" || file.Version != 1 {
+		t.Fatalf("Expected cached file at version 1, got %s", handoff)
+	}
+	if promoted, _ := sr.ReadString('\n'); !strings.Contains(promoted, `"event":"new_host"`) || !strings.Contains(promoted, `"host_id":1`) {
+		t.Fatalf("Expected new_host, got %s", promoted)
+	}
+	for _, want := range []string{`"event": "request_files"`, `"path": "b.c"`} {
+		if again, _ := sr.ReadString('\n'); !strings.Contains(again, want) || !strings.Contains(again, `"from_id":2`) {
+			t.Fatalf("Expected request with %s sent to new host, got %s", want, again)
+		}
+	}
+	if promoted, _ := cr.ReadString('\n'); !strings.Contains(promoted, `"event":"new_host"`) {
+		t.Fatalf("Expected new_host, got %s", promoted)
+	}
+	cr.ReadString('\n') // user_left
+
+	// Versions carry on and the cache still answers
+	fmt.Fprintln(c, `{"event": "update_content", "path": "a.c", "version": 1, "changes": {"first": 1, "old_last": 2, "lines": ["TWO"]}}`)
+	if ack, _ := cr.ReadString('\n'); !strings.Contains(ack, `"version":2`) {
+		t.Fatalf("Expected version 2, got %s", ack)
+	}
+	fmt.Fprintln(c, `{"event": "request_file", "path": "a.c"}`)
+	if cached, _ := cr.ReadString('\n'); !strings.Contains(cached, `"content":"ONE\nTWO"`) {
+		t.Fatalf("Expected cached file, got %s", cached)
+	}
+	pending := make(chan int)
+	server.DefaultRoom.actions <- func() { pending <- len(server.DefaultRoom.PendingRequests) }
+	if n := <-pending; n != 2 {
+		t.Fatalf("Expected both requests pending at new host, has %d", n)
+	}
+}
+
+func TestHandoffFitsHostQueue(t *testing.T) {
+	server := NewServer()
+	// Not running, so it's safe to use from here
+	room := newRoom(server, "handoff")
+	files := clientQueueSize + 100
+	for i := 0; i < files; i++ {
+		room.docs.Put(fmt.Sprintf("%04d.c", i), "x", 0)
+	}
+	host := NewClient(nil)
+	host.ID = 1
+	room.Clients[1] = host
+
+	room.handOff(host)
+	handedOff := 0
+	for room.handoff != nil {
+		if host.dropped || len(host.Send) > clientQueueSize-handoffHeadroom {
+			t.Fatalf("Handoff filled the new host's queue: %d", len(host.Send))
+		}
+		// Host's writer drains the queue, room gets back to the rest
+		for len(host.Send) > 0 {
+			if msg := <-host.Send; strings.Contains(string(msg), "handoff_file") {
+				handedOff++
+			}
+		}
+		room.continueHandoff()
+	}
+	var last []byte
+	for len(host.Send) > 0 {
+		last = <-host.Send
+		if strings.Contains(string(last), "handoff_file") {
+			handedOff++
+		}
+	}
+	if handedOff != files || !strings.Contains(string(last), "new_host") {
+		t.Fatalf("Expected %d files and new_host, got %d and %s", files, handedOff, last)
+	}
+}
+func TestFillBatch(t *testing.T) {
+	server := NewServer()
+	server.MaxBatchSize = 3
+	client := &Client{Send: make(chan []byte, 8)}
+	for i := 0; i < 5; i++ {
+		client.Send <- []byte{byte('0' + i)}
+	}
+
+	batch, open := server.fillBatch(client, nil, nil)
+	if !open || len(batch) != 3 || string(batch[2]) != "2" {
+		t.Fatalf("Expected first 3 messages, got %q", batch)
+	}
+
+	// Only takes what is queued without a delay
+	batch, open = server.fillBatch(client, batch[:0], nil)
+	if !open || len(batch) != 2 {
+		t.Fatalf("Expected remaining 2 messages, got %q", batch)
+	}
+
+	// Waits for late messages with a delay
+	server.MaxFlushDelay = time.Second
+	timer := time.NewTimer(time.Hour)
+	stopTimer(timer)
+	go func() {
+		time.Sleep(10 * time.Millisecond)
+		client.Send <- []byte("late")
+		close(client.Send)
+	}()
+	batch, open = server.fillBatch(client, batch[:0], timer)
+	if open || len(batch) != 1 || string(batch[0]) != "late" {
+		t.Fatalf("Expected late message and closed queue, got %q, %v", batch, open)
+	}
+}
+
+func TestWriterCoalescing(t *testing.T) {
+	server := NewServer()
+	server.MaxBatchSize = 16
+	server.MaxFlushDelay = 2 * time.Millisecond
+	_, addr := startTestServerWith(server)
+
+	recv, _ := net.Dial("tcp", addr)
+	defer recv.Close()
+	r := bufio.NewReader(recv)
+	fmt.Fprintln(recv, `{"event": "handshake", "name": "vastaanottaja"}`)
+	r.ReadString('\n')
+
+	send, _ := net.Dial("tcp", addr)
+	defer send.Close()
+	fmt.Fprintln(send, `{"event": "handshake", "name": "lahettaja"}`)
+	r.ReadString('\n') // user_joined
+
+	const total = 500
+	go func() {
+		w := bufio.NewWriter(send)
+		for i := 0; i < total; i++ {
+			fmt.Fprintf(w, `{"event": "update_content", "path": "a.c", "changes": {"first": %d}}`+"\n", i)
+		}
+		w.Flush()
+	}()
+
+	// Everything arrives whole and in order
+	recv.SetReadDeadline(time.Now().Add(5 * time.Second))
+	for i := 0; i < total; i++ {
+		line, err := r.ReadString('\n')
+		if err != nil {
+			t.Fatalf("Message %d lost: %v", i, err)
+		}
+		if !strings.Contains(line, fmt.Sprintf(`"first": %d}`, i)) {
+			t.Fatalf("Message %d out of order: %s", i, line)
+		}
+	}
+}
+
+func TestCursorConflation(t *testing.T) {
+	_, addr := startTestServer()
+
+	recv, _ := net.Dial("tcp", addr)
+	defer recv.Close()
+	r := bufio.NewReader(recv)
+	fmt.Fprintln(recv, `{"event": "handshake", "name": "hidas"}`)
+	r.ReadString('\n')
+
+	send, _ := net.Dial("tcp", addr)
+	defer send.Close()
+	fmt.Fprintln(send, `{"event": "handshake", "name": "nopea"}`)
+	r.ReadString('\n') // user_joined
+
+	// Receiver doesn't read while all of this is sent
+	const moves = 2000
+	w := bufio.NewWriter(send)
+	for i := 0; i < moves; i++ {
+		fmt.Fprintf(w, `{"event": "cursor_move", "path": "a.c", "position": [%d,0]}`+"\n", i)
+	}
+	fmt.Fprintln(w, `{"event": "update_content", "path": "a.c", "changes": {"first": 0}}`)
+	w.Flush()
+
+	recv.SetReadDeadline(time.Now().Add(5 * time.Second))
+	cursors, gotUpdate, gotLast := 0, false, false
+	for !gotUpdate || !gotLast {
+		line, err := r.ReadString('\n')
+		if err != nil {
+			t.Fatalf("Read failed (update: %v, last cursor: %v): %v", gotUpdate, gotLast, err)
+		}
+		switch {
+		case strings.Contains(line, "update_content"):
+			gotUpdate = true
+		case strings.Contains(line, "cursor_move"):
+			cursors++
+			gotLast = strings.Contains(line, fmt.Sprintf("[%d,0]", moves-1))
+		}
+	}
+	if cursors > moves/10 {
+		t.Errorf("Cursor moves were not conflated, received %d of %d", cursors, moves)
+	}
+}
+
+func TestCursorLeaveDropsPendingCursor(t *testing.T) {
+	server := NewServer()
+	server.CursorInterval = time.Hour
+	_, addr := startTestServerWith(server)
+
+	recv, _ := net.Dial("tcp", addr)
+	defer recv.Close()
+	r := bufio.NewReader(recv)
+	fmt.Fprintln(recv, `{"event": "handshake", "name": "katsoja"}`)
+	r.ReadString('\n')
+
+	send, _ := net.Dial("tcp", addr)
+	defer send.Close()
+	fmt.Fprintln(send, `{"event": "handshake", "name": "karkuri"}`)
+	r.ReadString('\n') // user_joined
+
+	// First one is delivered right away, second waits for the interval
+	fmt.Fprintln(send, `{"event": "cursor_move", "path": "a.c", "position": [1,0]}`)
+	if line, _ := r.ReadString('\n'); !strings.Contains(line, "cursor_move") {
+		t.Fatalf("Expected cursor_move, got %s", line)
+	}
+	fmt.Fprintln(send, `{"event": "cursor_move", "path": "a.c", "position": [2,0]}`)
+	fmt.Fprintln(send, `{"event": "cursor_leave"}`)
+	send.Close()
+
+	recv.SetReadDeadline(time.Now().Add(time.Second))
+	for _, want := range []string{"cursor_leave", "user_left"} {
+		line, _ := r.ReadString('\n')
+		if !strings.Contains(line, want) {
+			t.Fatalf("Expected %s, got %s", want, line)
+		}
+	}
+
+	done := make(chan int)
+	server.DefaultRoom.actions <- func() {
+		pending := 0
+		for _, c := range server.DefaultRoom.Clients {
+			pending += len(c.takeCursors(nil))
+		}
+		done <- pending
+	}
+	if n := <-done; n != 0 {
+		t.Errorf("%d stale cursors still pending after cursor_leave", n)
+	}
+}
+
+func TestReliableLaneDisconnectsFullClient(t *testing.T) {
+	server := NewServer()
+	conn, peer := net.Pipe()
+	client := NewClient(conn)
+	client.Send = make(chan []byte, 1)
+
+	start := time.Now()
+	server.enqueue(client, []byte("first\n"))
+	server.enqueue(client, []byte("second\n"))
+	if time.Since(start) >= 100*time.Millisecond {
+		t.Error("Server waited on a full client")
+	}
+	if !client.dropped || server.Stats.ReliableFull.Load() != 1 || server.Stats.ReliableDisconnects.Load() != 1 {
+		t.Fatal("Full client was not disconnected")
+	}
+	// Connection was closed, so the client has to rejoin
+	if _, err := peer.Read(make([]byte, 1)); err == nil {
+		t.Error("Connection of full client is still open")
+	}
+
+	// Dropped client gets nothing more
+	server.enqueue(client, []byte("third\n"))
+	if n := len(client.Send); n != 1 {
+		t.Errorf("Expected only the first message queued, got %d", n)
+	}
+}
+
+func TestReliableLaneResync(t *testing.T) {
+	server := NewServer()
+	conn, peer := net.Pipe()
+	defer peer.Close()
+	client := NewClient(conn)
+	client.Send = make(chan []byte, 1)
+	client.overflow = OverflowResync
+
+	server.enqueue(client, []byte("first\n"))
+	server.enqueue(client, []byte("second\n"))
+	server.enqueue(client, []byte("third\n"))
+	if client.dropped || !client.resync.Load() || server.Stats.Resyncs.Load() != 1 {
+		t.Fatal("Expected client to resync instead of being disconnected")
+	}
+
+	go server.writeLoop(client)
+	r := bufio.NewReader(peer)
+	// Queue is written first, then the client is told what it missed
+	for _, want := range []string{"first\n", string(resyncMessage)} {
+		if line, _ := r.ReadString('\n'); line != want {
+			t.Fatalf("Expected %q, got %q", want, line)
+		}
+	}
+	server.enqueue(client, []byte("fourth\n"))
+	if line, _ := r.ReadString('\n'); line != "fourth\n" {
+		t.Fatalf("Expected messages after resync, got %q", line)
+	}
+}
+
+func TestWriteDeadlineDisconnects(t *testing.T) {
+	server := NewServer()
+	server.SendTimeout = 20 * time.Millisecond
+	// Nobody reads the other end
+	conn, peer := net.Pipe()
+	defer peer.Close()
+	client := NewClient(conn)
+
+	done := make(chan struct{})
+	go func() {
+		server.writeLoop(client)
+		close(done)
+	}()
+	server.enqueue(client, []byte("stuck\n"))
+
+	select {
+	case <-done:
+	case <-time.After(time.Second):
+		t.Fatal("Writer is still waiting on a stuck client")
+	}
+	if server.Stats.WriteTimeouts.Load() != 1 || client.Stats.WriteTimeouts.Load() != 1 {
+		t.Error("Write timeout was not counted")
+	}
+}
+
+func TestCursorConflationCounted(t *testing.T) {
+	server := NewServer()
+	// Not running, so it's safe to use from here
+	room := newRoom(server, "conflation")
+	client := NewClient(nil)
+	client.ID = 1
+	room.Clients[1] = client
+
+	for i := 0; i < 3; i++ {
+		room.broadcastCursor(0, "a.c", []byte("cursor\n"))
+	}
+	if n := server.Stats.CursorsConflated.Load(); n != 2 {
+		t.Errorf("Expected 2 conflated cursors, got %d", n)
+	}
+	if n := len(client.takeCursors(nil)); n != 1 {
+		t.Errorf("Expected 1 pending cursor, got %d", n)
+	}
+}
+
+func TestRoomsAreIsolated(t *testing.T) {
+	server, addr := startTestServer()
+
+	join := func(room, name string, host bool) (net.Conn, *bufio.Reader, string) {
+		c, _ := net.Dial("tcp", addr)
+		r := bufio.NewReader(c)
+		fmt.Fprintf(c, `{"event": "handshake", "name": %q, "host": %v, "room": %q}`+"\n", name, host, room)
+		reply, _ := r.ReadString('\n')
+		return c, r, reply
+	}
+
+	// Both rooms get their own host
+	a, ar, reply := join("a", "host-a", true)
+	defer a.Close()
+	if !strings.Contains(reply, `"is_host":true`) || !strings.Contains(reply, `"room":"a"`) {
+		t.Fatalf("First client of room a is not host: %s", reply)
+	}
+	b, br, reply := join("b", "host-b", true)
+	defer b.Close()
+	if !strings.Contains(reply, `"is_host":true`) {
+		t.Fatalf("First client of room b is not host: %s", reply)
+	}
+	a2, _, _ := join("a", "guest-a", false)
+	defer a2.Close()
+	ar.ReadString('\n') // user_joined
+
+	// Edits stay in their room
+	fmt.Fprintln(a2, `{"event": "update_content", "path": "a.c", "changes": {"first": 0}}`)
+	if line, _ := ar.ReadString('\n'); !strings.Contains(line, "guest-a") {
+		t.Fatalf("Host of room a didn't get the edit: %s", line)
+	}
+	b.SetReadDeadline(time.Now().Add(50 * time.Millisecond))
+	if line, err := br.ReadString('\n'); err == nil {
+		t.Fatalf("Message leaked into another room: %s", line)
+	}
+
+	// Requests go to the host of the requester's room
+	fmt.Fprintln(a2, `{"event": "request_files"}`)
+	if line, _ := ar.ReadString('\n'); !strings.Contains(line, "request_files") {
+		t.Fatalf("Request didn't reach room's host: %s", line)
+	}
+
+	if n := server.RoomCount(); n != 3 {
+		t.Errorf("Expected default room and rooms a and b, got %d rooms", n)
+	}
+}
+
+func TestEmptyRoomIsRemoved(t *testing.T) {
+	server, addr := startTestServer()
+
+	c, _ := net.Dial("tcp", addr)
+	fmt.Fprintln(c, `{"event": "handshake", "name": "yksin", "room": "tyhja"}`)
+	bufio.NewReader(c).ReadString('\n')
+	if n := server.RoomCount(); n != 2 {
+		t.Fatalf("Room was not created, %d rooms", n)
+	}
+
+	c.Close()
+	deadline := time.Now().Add(time.Second)
+	for server.RoomCount() != 1 && time.Now().Before(deadline) {
+		time.Sleep(5 * time.Millisecond)
+	}
+	if n := server.RoomCount(); n != 1 {
+		t.Errorf("Empty room was not removed, %d rooms", n)
+	}
+}
+
+func TestRoomIDLimit(t *testing.T) {
+	_, addr := startTestServer()
+	conn, _ := net.Dial("tcp", addr)
+	defer conn.Close()
+
+	fmt.Fprintf(conn, `{"event": "handshake", "name": "pitka", "room": %q}`+"\n", strings.Repeat("x", MaxRoomIDLength+1))
+	reply, _ := bufio.NewReader(conn).ReadString('\n')
+	if !strings.Contains(reply, "Room id is too long") {
+		t.Fatalf("Too long room id was accepted: %s", reply)
+	}
+}
+
+func TestRoomRegistry(t *testing.T) {
+	server := NewServer()
+
+	a, b := server.room("a"), server.room("b")
+	if a == b || a == server.DefaultRoom {
+		t.Fatal("Rooms share state")
+	}
+	if server.room("a") != a {
+		t.Fatal("Same id returned a different room")
+	}
+
+	// Every room has its own actor loop
+	done := make(chan string, 2)
+	a.actions <- func() { done <- a.ID }
+	b.actions <- func() { done <- b.ID }
+	got := map[string]bool{<-done: true, <-done: true}
+	if !got["a"] || !got["b"] {
+		t.Errorf("Rooms didn't run their actions: %v", got)
+	}
+}
+
+func TestTraceStamps(t *testing.T) {
+	_, addr := startTestServer()
+
+	editor, _ := net.Dial("tcp", addr)
+	defer editor.Close()
+	er := bufio.NewReader(editor)
+	fmt.Fprintln(editor, `{"event": "handshake", "name": "editor"}`)
+	er.ReadString('\n')
+
+	other, _ := net.Dial("tcp", addr)
+	defer other.Close()
+	or := bufio.NewReader(other)
+	fmt.Fprintln(other, `{"event": "handshake", "name": "other"}`)
+	or.ReadString('\n')
+	er.ReadString('\n')
+
+	var trace struct {
+		Trace *Trace `json:"trace"`
+	}
+	check := func(r *bufio.Reader, event string) {
+		t.Helper()
+		line, _ := r.ReadBytes('\n')
+		trace.Trace = nil
+		if err := json.Unmarshal(line, &trace); err != nil || !strings.Contains(string(line), event) || trace.Trace == nil {
+			t.Fatalf("Expected traced %s, got %s", event, line)
+		}
+		tr := trace.Trace
+		if tr.Origin != 1 || tr.Sent != 2 || tr.Received < tr.Sent || tr.Forwarded < tr.Received {
+			t.Fatalf("Expected server stamps after client's, got %+v", *tr)
+		}
+	}
+
+	// Client's own received time is replaced
+	stamps := `"trace": {"origin": 1, "sent": 2, "received": 1e15}`
+	fmt.Fprintf(editor, `{"event": "update_content", "path": "a.txt", "changes": {"first": 0, "old_last": 0, "lines": ["a"]}, %s}`+"\n", stamps)
+	check(or, `"update_content"`)
+	check(er, `"update_ack"`)
+
+	fmt.Fprintf(editor, `{"event": "cursor_move", "path": "a.txt", "position": [0, 0], %s}`+"\n", stamps)
+	check(or, `"cursor_move"`)
+
+	// Untraced messages stay untraced
+	fmt.Fprintln(editor, `{"event": "cursor_leave"}`)
+	if line, _ := or.ReadString('\n'); strings.Contains(line, "trace") {
+		t.Fatalf("Expected no trace, got %s", line)
+	}
+}
+
 func BenchmarkServerSingle(b *testing.B) {
 	_, addr := startTestServer()
 	conn, _ := net.Dial("tcp", addr)
@@ -218,6 +952,7 @@ func BenchmarkServerSingle(b *testing.B) {
 	fmt.Fprintln(conn, `{"event": "handshake", "name": "benchmark"}`)
 	msg := []byte(`{"event": "cursor_move", "position": [10,10]}` + "\n")
 
+	b.ReportAllocs()
 	b.ResetTimer()
 	for i := 0; i < b.N; i++ {
 		_, err := conn.Write(msg)
@@ -253,6 +988,7 @@ func BenchmarkServerMultiClient(b *testing.B) {
 
 	msg := []byte(`{"event": "cursor_move", "position": [10,10]}` + "\n")
 
+	b.ReportAllocs()
 	b.ResetTimer()
 	b.RunParallel(func(pb *testing.PB) {
 		id := 0
@@ -273,3 +1009,124 @@ func BenchmarkServerMultiClient(b *testing.B) {
 		c.Close()
 	}
 }
+
+// N rooms with M clients each, every client sends edits that are fanned out
+// to the other clients of its room
+func BenchmarkServerRooms(b *testing.B) {
+	for _, size := range []struct{ rooms, clients int }{{1, 4}, {4, 4}, {16, 4}, {64, 4}} {
+		b.Run(fmt.Sprintf("rooms=%d/clients=%d", size.rooms, size.clients), func(b *testing.B) {
+			_, addr := startTestServer()
+
+			conns := make([]net.Conn, 0, size.rooms*size.clients)
+			for room := 0; room < size.rooms; room++ {
+				for i := 0; i < size.clients; i++ {
+					c, err := net.Dial("tcp", addr)
+					if err != nil {
+						b.Fatalf("failed to dial: %v", err)
+					}
+					fmt.Fprintf(c, `{"event": "handshake", "name": "hauva-%d", "room": "huone-%d"}`+"\n", i, room)
+					conns = append(conns, c)
+
+					// Discard stream to keep buffer empty
+					go io.Copy(io.Discard, c)
+				}
+			}
+
+			msg := []byte(`{"event": "update_content", "path": "a.c", "changes": {"first": 1, "old_last": 2, "lines": ["x"]}}` + "\n")
+
+			b.ReportAllocs()
+			b.ResetTimer()
+			b.RunParallel(func(pb *testing.PB) {
+				id := 0
+				for pb.Next() {
+					conns[id%len(conns)].Write(msg)
+					id++
+				}
+			})
+			b.StopTimer()
+
+			duration := b.Elapsed()
+			if duration > 0 {
+				opsPerSec := float64(b.N) / duration.Seconds()
+				b.ReportMetric(opsPerSec, "msg/sec")
+			}
+
+			for _, c := range conns {
+				c.Close()
+			}
+		})
+	}
+}
+
+// Requests that go through the server to the host and back, with many
+// requests in flight
+func BenchmarkRequestRoundTrip(b *testing.B) {
+	_, addr := startTestServer()
+
+	host, _ := net.Dial("tcp", addr)
+	defer host.Close()
+	hr := bufio.NewReader(host)
+	fmt.Fprintln(host, `{"event": "handshake", "name": "host", "host": true}`)
+	hr.ReadString('\n')
+
+	conn, _ := net.Dial("tcp", addr)
+	defer conn.Close()
+	cr := bufio.NewReader(conn)
+	fmt.Fprintln(conn, `{"event": "handshake", "name": "requester"}`)
+	cr.ReadString('\n')
+	hr.ReadString('\n') // user_joined
+
+	// Host answers every request
+	go func() {
+		w := bufio.NewWriter(host)
+		for {
+			line, err := hr.ReadBytes('\n')
+			if err != nil {
+				return
+			}
+			var req struct {
+				RequestID int `json:"request_id"`
+			}
+			json.Unmarshal(line, &req)
+			fmt.Fprintf(w, `{"event": "response_file", "path": "a.c", "content": "x", "request_id": %d}`+"\n", req.RequestID)
+			if hr.Buffered() == 0 {
+				w.Flush()
+			}
+		}
+	}()
+
+	// Limits in flight requests, so that none of them time out
+	inFlight := make(chan struct{}, 256)
+	go func() {
+		w := bufio.NewWriter(conn)
+		for i := 0; i < b.N; i++ {
+			select {
+			case inFlight <- struct{}{}:
+			default:
+				w.Flush()
+				inFlight <- struct{}{}
+			}
+			w.WriteString(`{"event": "request_file", "path": "a.c"}` + "\n")
+		}
+		w.Flush()
+	}()
+
+	b.ReportAllocs()
+	b.ResetTimer()
+	for i := 0; i < b.N; i++ {
+		line, err := cr.ReadString('\n')
+		if err != nil {
+			b.Fatal(err)
+		}
+		if !strings.Contains(line, "response_file") {
+			b.Fatalf("Expected response, got %s", line)
+		}
+		<-inFlight
+	}
+	b.StopTimer()
+
+	duration := b.Elapsed()
+	if duration > 0 {
+		b.ReportMetric(float64(b.N)/duration.Seconds(), "req/sec")
+	}
+}
@@ -0,0 +1,228 @@
+package main
+
+import (
+	"encoding/json"
+	"sort"
+)
+
+// Clients that ask for subscriptions in handshake only get edits of the
+// files they subscribe to, and cursors in the lines they are looking at.
+// Others (and the host, for edits) get everything like before. Clients
+// subscribe with the version they have, and get the edits they missed
+// meanwhile as one update_content
+
+// Lines of a subscribed file a client is looking at, both inclusive. Last
+// below zero is the whole file
+type viewport struct {
+	first, last int
+}
+
+var wholeFile = viewport{0, -1}
+
+func (v viewport) contains(line int) bool {
+	return line >= v.first && (v.last < 0 || line <= v.last)
+}
+
+// Starts routing only subscribed files to client
+func (c *Client) useSubscriptions() {
+	if c.subs == nil {
+		c.subs = make(map[string]viewport)
+		c.cursorShown = make(map[int]bool)
+	}
+}
+
+// Reports if client gets edits of path
+func (c *Client) wantsFile(path string) bool {
+	if c.subs == nil || c.IsHost {
+		return true
+	}
+	_, ok := c.subs[path]
+	return ok
+}
+
+// Reports if client gets cursors at line of path
+func (c *Client) wantsCursor(path string, line int) bool {
+	if c.subs == nil {
+		return true
+	}
+	view, ok := c.subs[path]
+	return ok && view.contains(line)
+}
+
+// Last cursor_move of a client as forwarded, sent to clients that start
+// looking at it
+type lastCursor struct {
+	path string
+	msg  []byte
+	// Parsed only when someone has subscriptions
+	line   int
+	parsed bool
+}
+
+// Returns line of the cursor's position, -1 if it has none
+func (c *lastCursor) Line() int {
+	if !c.parsed {
+		var cursor struct {
+			Position []float64 `json:"position"`
+		}
+		c.line = -1
+		if err := json.Unmarshal(c.msg, &cursor); err == nil && len(cursor.Position) > 0 {
+			c.line = int(cursor.Position[0])
+		}
+		c.parsed = true
+	}
+	return c.line
+}
+
+// Handles subscribe, which starts a subscription or moves its viewport,
+// and unsubscribe
+func (r *Room) handleSubscription(client *Client, msg *Message) {
+	if msg.Event == "unsubscribe" {
+		if client.subs != nil {
+			delete(client.subs, msg.Path)
+		}
+		return
+	}
+
+	var sub struct {
+		// Version client has, edits after it are sent back
+		Version *int `json:"version"`
+		First   *int `json:"first"`
+		Last    *int `json:"last"`
+	}
+	if err := json.Unmarshal(msg.Raw, &sub); err != nil || msg.Path == "" {
+		return
+	}
+	view := wholeFile
+	if sub.First != nil && sub.Last != nil && *sub.First <= *sub.Last {
+		view = viewport{max(*sub.First, 0), *sub.Last}
+	}
+	r.subscribe(client, msg.Path, view, sub.Version)
+}
+
+// Subscribes client to path, sending the edits made after version if it's
+// a new subscription. Cursors that came into view are sent right away
+func (r *Room) subscribe(client *Client, path string, view viewport, version *int) {
+	client.useSubscriptions()
+	_, subscribed := client.subs[path]
+	client.subs[path] = view
+	if !subscribed && version != nil {
+		r.catchUp(client, path, *version)
+	}
+
+	for id, cursor := range r.cursors {
+		if id != client.ID && !client.cursorShown[id] && client.wantsCursor(cursor.path, cursor.Line()) {
+			client.queueCursor(id, cursor.msg)
+			client.cursorShown[id] = true
+		}
+	}
+}
+
+// Subscribes client to the whole file when it starts editing or requests
+// a file it isn't subscribed to. Edits after base are sent first, so that
+// client has them before its update_ack
+func (r *Room) autoSubscribe(client *Client, path string, base *int) {
+	if client.subs == nil || client.IsHost {
+		return
+	}
+	if _, ok := client.subs[path]; !ok {
+		r.subscribe(client, path, wholeFile, base)
+	}
+}
+
+// Sends edits of path made after version like client would have got them:
+// edits of others in update_content and edits of its own session (made
+// before it reconnected) as update_ack. Sends update_reject if they aren't
+// known anymore
+func (r *Room) catchUp(client *Client, path string, version int) {
+	state, ok := r.docs.docs[path]
+	if !ok {
+		state = &docState{}
+	}
+	ops, ok := state.since(version)
+	if !ok {
+		r.sendJSON(client, map[string]any{"event": "update_reject", "path": path, "version": state.Version})
+		return
+	}
+	authors := state.authors[len(state.authors)-len(ops):]
+	mine := func(i int) bool { return client.session != "" && authors[i] == client.session }
+
+	version = state.Version - len(ops)
+	for i := 0; i < len(ops); {
+		own := mine(i)
+		changes := []Change{}
+		for ; i < len(ops) && mine(i) == own; i++ {
+			changes = ops[i].changes(changes)
+			version++
+		}
+		if own {
+			r.sendJSON(client, &updateAck{Event: "update_ack", Path: path, Version: version})
+			continue
+		}
+		r.sendJSON(client, map[string]any{
+			"event":   "update_content",
+			"path":    path,
+			"version": version,
+			"changes": changes,
+		})
+	}
+}
+
+// Catches client up on the files it had before reconnecting, and subscribes
+// it to them
+func (r *Room) resume(client *Client, versions map[string]int) {
+	paths := make([]string, 0, len(versions))
+	for path := range versions {
+		paths = append(paths, path)
+	}
+	sort.Strings(paths)
+	for _, path := range paths {
+		version := versions[path]
+		if client.subs != nil {
+			r.subscribe(client, path, wholeFile, &version)
+		} else {
+			r.catchUp(client, path, version)
+		}
+	}
+}
+
+// Same as broadcastRaw, but only to clients that want edits of path
+func (r *Room) broadcastFile(senderID int, path string, bytes []byte) {
+	logger.Payload("BROADCAST to", path, bytes)
+
+	for _, c := range r.Clients {
+		if c.ID != senderID && c.wantsFile(path) {
+			r.server.enqueue(c, bytes)
+		}
+	}
+}
+
+// Conflates cursor_move so that only sender's latest position is delivered.
+// Subscribed clients get positions in their viewports, and the first one
+// outside of it so that they don't keep drawing the cursor where it was
+func (r *Room) broadcastCursor(senderID int, path string, bytes []byte) {
+	cursor := r.cursors[senderID]
+	if cursor == nil {
+		cursor = &lastCursor{}
+		r.cursors[senderID] = cursor
+	}
+	*cursor = lastCursor{path: path, msg: bytes}
+
+	for _, c := range r.Clients {
+		if c.ID == senderID {
+			continue
+		}
+		if c.subs != nil {
+			show := c.wantsCursor(path, cursor.Line())
+			shown := c.cursorShown[senderID]
+			c.cursorShown[senderID] = show
+			if !show && !shown {
+				continue
+			}
+		}
+		if c.queueCursor(senderID, bytes) {
+			c.Stats.CursorsConflated.Add(1)
+			r.server.Stats.CursorsConflated.Add(1)
+		}
+	}
+}
@@ -0,0 +1,119 @@
+package main
+
+import (
+	"bufio"
+	"fmt"
+	"net"
+	"strings"
+	"testing"
+)
+
+func TestSubscriptionRouting(t *testing.T) {
+	_, addr := startTestServer()
+
+	h, _ := net.Dial("tcp", addr)
+	defer h.Close()
+	hr := bufio.NewReader(h)
+	fmt.Fprintln(h, `{"event": "handshake", "name": "host", "host": true}`)
+	hr.ReadString('\n')
+
+	s, _ := net.Dial("tcp", addr)
+	defer s.Close()
+	sr := bufio.NewReader(s)
+	fmt.Fprintln(s, `{"event": "handshake", "name": "subscriber", "subscriptions": true}`)
+	sr.ReadString('\n')
+	hr.ReadString('\n') // user_joined
+
+	e, _ := net.Dial("tcp", addr)
+	defer e.Close()
+	er := bufio.NewReader(e)
+	fmt.Fprintln(e, `{"event": "handshake", "name": "editor"}`)
+	er.ReadString('\n')
+	hr.ReadString('\n') // user_joined
+	sr.ReadString('\n') // user_joined
+
+	fmt.Fprintln(s, `{"event": "subscribe", "path": "a.c", "version": 0}`)
+	// Subscribed once the host has the next message
+	fmt.Fprintln(s, `{"event": "request_files"}`)
+	hr.ReadString('\n')
+	// Editor and host get everything, subscriber only a.c
+	fmt.Fprintln(e, `{"event": "update_content", "path": "b.c", "version": 0, "changes": {"first": 0, "old_last": 0, "lines": ["b"]}}`)
+	fmt.Fprintln(e, `{"event": "update_content", "path": "a.c", "version": 0, "changes": {"first": 0, "old_last": 0, "lines": ["a"]}}`)
+	for _, path := range []string{"b.c", "a.c"} {
+		if got, _ := hr.ReadString('\n'); !strings.Contains(got, path) {
+			t.Fatalf("Expected host to get %s, got %s", path, got)
+		}
+		er.ReadString('\n') // update_ack
+	}
+	if got, _ := sr.ReadString('\n'); !strings.Contains(got, `"path": "a.c"`) {
+		t.Fatalf("Expected only a.c, got %s", got)
+	}
+
+	// Edits while unsubscribed come back in one update_content
+	fmt.Fprintln(s, `{"event": "unsubscribe", "path": "a.c"}`)
+	fmt.Fprintln(s, `{"event": "request_files"}`)
+	hr.ReadString('\n')
+	fmt.Fprintln(e, `{"event": "update_content", "path": "a.c", "version": 1, "changes": {"first": 0, "old_last": 1, "lines": ["A"]}}`)
+	fmt.Fprintln(e, `{"event": "update_content", "path": "a.c", "version": 2, "changes": {"first": 1, "old_last": 1, "lines": ["B"]}}`)
+	er.ReadString('\n')
+	er.ReadString('\n')
+	hr.ReadString('\n')
+	hr.ReadString('\n')
+	fmt.Fprintln(s, `{"event": "subscribe", "path": "a.c", "version": 1, "first": 0, "last": 10}`)
+	want := `{"changes":[{"first":0,"old_last":1,"lines":["A"]},{"first":1,"old_last":1,"lines":["B"]}],"event":"update_content","path":"a.c","version":3}`
+	if got, _ := sr.ReadString('\n'); strings.TrimSpace(got) != want {
+		t.Fatalf("Expected catch-up %s, got %s", want, got)
+	}
+
+	// Editing a file subscribes to it, missed edits arrive before the ack
+	fmt.Fprintln(s, `{"event": "update_content", "path": "b.c", "version": 0, "changes": {"first": 0, "old_last": 0, "lines": ["s"]}}`)
+	if got, _ := sr.ReadString('\n'); !strings.Contains(got, `"lines":["b"]`) || !strings.Contains(got, `"version":1`) {
+		t.Fatalf("Expected missed edit of b.c, got %s", got)
+	}
+	if got, _ := sr.ReadString('\n'); !strings.Contains(got, `"update_ack"`) || !strings.Contains(got, `"version":2`) {
+		t.Fatalf("Expected update_ack at version 2, got %s", got)
+	}
+	fmt.Fprintln(e, `{"event": "update_content", "path": "b.c", "version": 2, "changes": {"first": 0, "old_last": 0, "lines": ["e"]}}`)
+	if got, _ := sr.ReadString('\n'); !strings.Contains(got, `"path": "b.c"`) {
+		t.Fatalf("Expected edit of subscribed b.c, got %s", got)
+	}
+}
+
+func TestCursorViewport(t *testing.T) {
+	server := NewServer()
+	// Not running, so it's safe to use from here
+	room := newRoom(server, "viewport")
+	client := NewClient(nil)
+	client.ID = 1
+	room.Clients[1] = client
+	room.subscribe(client, "a.c", viewport{10, 20}, nil)
+
+	cursor := func(path string, line int) []byte {
+		return []byte(fmt.Sprintf(`{"event":"cursor_move","path":%q,"position":[%d,0]}`+"\n", path, line))
+	}
+	for _, c := range []struct {
+		path      string
+		line      int
+		delivered bool
+	}{
+		{"a.c", 15, true},
+		// Leaving the viewport is delivered once
+		{"a.c", 30, true},
+		{"a.c", 40, false},
+		{"b.c", 15, false},
+		{"a.c", 20, true},
+		{"b.c", 15, true},
+	} {
+		room.broadcastCursor(0, c.path, cursor(c.path, c.line))
+		if got := len(client.takeCursors(nil)) == 1; got != c.delivered {
+			t.Fatalf("Cursor at %s:%d: expected delivered %v", c.path, c.line, c.delivered)
+		}
+	}
+
+	// Cursors that come into view are sent right away
+	room.broadcastCursor(0, "a.c", cursor("a.c", 40))
+	room.subscribe(client, "a.c", viewport{30, 50}, nil)
+	if got := client.takeCursors(nil); len(got) != 1 || !strings.Contains(string(got[0]), "[40,0]") {
+		t.Fatalf("Expected cursor at line 40, got %q", got)
+	}
+}
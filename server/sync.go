@@ -0,0 +1,90 @@
+package main
+
+import (
+	"crypto/sha256"
+	"encoding/hex"
+	"strings"
+)
+
+const (
+	// Every this many versions update_content carries hash of the file, so
+	// that clients notice when they have diverged
+	CheckpointInterval = 64
+	// Lines per block of sync_file hashes
+	SyncBlockLines = 64
+	// Hex characters of a block hash
+	blockHashSize = 16
+)
+
+// Clients that miss a checkpoint send hashes of their line blocks with
+// sync_file, counted both from the start and from the end of the file.
+// Blocks that match from either end are the same, so only the lines between
+// them are sent back. An edit in the middle of a large file costs a couple of
+// blocks instead of the whole file, even if it added or removed lines
+
+// Returns sha256 of the content like utils.get_buf_sha256 does
+func (d *Document) Hash() string {
+	h := sha256.New()
+	first := true
+	for _, chunk := range d.chunks {
+		for _, line := range chunk {
+			if !first {
+				h.Write([]byte{'\n'})
+			}
+			h.Write([]byte(line))
+			first = false
+		}
+	}
+	return hex.EncodeToString(h.Sum(nil))
+}
+
+// Returns a copy of lines [first, last)
+func (d *Document) Slice(first, last int) []string {
+	out := make([]string, 0, max(last-first, 0))
+	line := 0
+	for _, chunk := range d.chunks {
+		if line >= last {
+			break
+		}
+		if start := max(first-line, 0); start < len(chunk) {
+			out = append(out, chunk[start:min(last-line, len(chunk))]...)
+		}
+		line += len(chunk)
+	}
+	return out
+}
+
+func blockHash(lines []string) string {
+	sum := sha256.Sum256([]byte(strings.Join(lines, "\n")))
+	return hex.EncodeToString(sum[:])[:blockHashSize]
+}
+
+// Returns the change that turns a client's copy into lines. The copy has
+// clientLines lines, head holds hashes of its blocks from the start and tail
+// from the end
+func syncChange(lines []string, clientLines int, head, tail []string) Change {
+	n := len(lines)
+
+	prefix := 0
+	for i := 0; i < len(head) && prefix < n; i++ {
+		end := min(prefix+SyncBlockLines, n)
+		if blockHash(lines[prefix:end]) != head[i] {
+			break
+		}
+		prefix = end
+	}
+	// Client's last block may have been shorter
+	prefix = min(prefix, clientLines)
+
+	suffix := 0
+	for i := 0; i < len(tail) && suffix < n-prefix; i++ {
+		start := max(n-suffix-SyncBlockLines, 0)
+		if blockHash(lines[start:n-suffix]) != tail[i] {
+			break
+		}
+		suffix = n - start
+	}
+	suffix = min(suffix, n-prefix, clientLines-prefix)
+
+	return Change{First: prefix, OldLast: clientLines - suffix, Lines: lines[prefix : n-suffix]}
+}
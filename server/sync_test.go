@@ -0,0 +1,136 @@
+package main
+
+import (
+	"bufio"
+	"crypto/sha256"
+	"encoding/hex"
+	"encoding/json"
+	"fmt"
+	"math/rand"
+	"net"
+	"strings"
+	"testing"
+)
+
+// Block hashes like the client sends them
+func blockHashes(lines []string) (head, tail []string) {
+	for i := 0; i < len(lines); i += SyncBlockLines {
+		head = append(head, blockHash(lines[i:min(i+SyncBlockLines, len(lines))]))
+	}
+	for i := len(lines); i > 0; i -= SyncBlockLines {
+		tail = append(tail, blockHash(lines[max(i-SyncBlockLines, 0):i]))
+	}
+	return head, tail
+}
+
+func TestDocumentHash(t *testing.T) {
+	content := strings.Repeat("line\n", 2000) + "end"
+	sum := sha256.Sum256([]byte(content))
+	if got := NewDocument(content).Hash(); got != hex.EncodeToString(sum[:]) {
+		t.Fatalf("Expected sha256 of content, got %s", got)
+	}
+}
+
+func TestSyncChangeRepairs(t *testing.T) {
+	rng := rand.New(rand.NewSource(1))
+	for i := 0; i < 500; i++ {
+		server := randomDoc(rng, 1+rng.Intn(1000))
+		client := copyDoc(server)
+		edits := 1 + rng.Intn(3)
+		for j := 0; j < edits; j++ {
+			client.Apply(opFromChange(randomChange(rng, client, "diverged")))
+		}
+
+		lines := server.Slice(0, server.Lines())
+		head, tail := blockHashes(client.Slice(0, client.Lines()))
+		change := syncChange(lines, client.Lines(), head, tail)
+		client.Replace(change.First, change.OldLast, change.Lines)
+
+		if client.Content() != server.Content() {
+			t.Fatalf("Case %d: %+v didn't repair the copy", i, change)
+		}
+		// One edit touches at most the block it's in from either end
+		if edits == 1 && len(change.Lines) > 2*SyncBlockLines+2 {
+			t.Fatalf("Case %d: expected a few blocks, got %d of %d lines", i, len(change.Lines), len(lines))
+		}
+	}
+}
+
+func TestSyncFile(t *testing.T) {
+	server, addr := startTestServer()
+	doc := randomDoc(rand.New(rand.NewSource(0)), 1000)
+	done := make(chan struct{})
+	server.DefaultRoom.actions <- func() {
+		server.DefaultRoom.docs.Put("a.txt", doc.Content(), 0)
+		close(done)
+	}
+	<-done
+
+	c, _ := net.Dial("tcp", addr)
+	defer c.Close()
+	r := bufio.NewReader(c)
+	fmt.Fprintln(c, `{"event": "handshake", "name": "eilinen"}`)
+	r.ReadString('\n')
+
+	// Client's copy lost a line in the middle
+	stale := copyDoc(doc)
+	stale.Replace(500, 501, nil)
+	head, tail := blockHashes(stale.Slice(0, stale.Lines()))
+	request, _ := json.Marshal(map[string]any{
+		"event": "sync_file", "path": "a.txt", "version": 0,
+		"lines": stale.Lines(), "head": head, "tail": tail,
+	})
+	fmt.Fprintf(c, "%s\n", request)
+
+	var reply struct {
+		Event   string `json:"event"`
+		Version int    `json:"version"`
+		Changes Change `json:"changes"`
+		Hash    string `json:"hash"`
+	}
+	line, _ := r.ReadBytes('\n')
+	if err := json.Unmarshal(line, &reply); err != nil || reply.Event != "sync_content" {
+		t.Fatalf("Expected sync_content, got %s", line)
+	}
+	if n := len(reply.Changes.Lines); n > 2*SyncBlockLines {
+		t.Fatalf("Expected only diverged blocks, got %d lines", n)
+	}
+	stale.Replace(reply.Changes.First, reply.Changes.OldLast, reply.Changes.Lines)
+	if stale.Hash() != reply.Hash || reply.Hash != doc.Hash() {
+		t.Fatal("Expected synced copy to match the server")
+	}
+}
+
+func TestCheckpointHash(t *testing.T) {
+	server, addr := startTestServer()
+	done := make(chan struct{})
+	server.DefaultRoom.actions <- func() {
+		server.DefaultRoom.docs.State("a.txt").Version = CheckpointInterval - 1
+		server.DefaultRoom.docs.Put("a.txt", "a\nb", CheckpointInterval-1)
+		close(done)
+	}
+	<-done
+
+	editor, _ := net.Dial("tcp", addr)
+	defer editor.Close()
+	er := bufio.NewReader(editor)
+	fmt.Fprintln(editor, `{"event": "handshake", "name": "editor"}`)
+	er.ReadString('\n')
+
+	other, _ := net.Dial("tcp", addr)
+	defer other.Close()
+	or := bufio.NewReader(other)
+	fmt.Fprintln(other, `{"event": "handshake", "name": "other"}`)
+	or.ReadString('\n')
+	// Joining is announced to the editor
+	er.ReadString('\n')
+
+	fmt.Fprintf(editor, `{"event": "update_content", "path": "a.txt", "version": %d, "hash": "spoofed", "changes": {"first": 2, "old_last": 2, "lines": ["c"]}}`+"\n", CheckpointInterval-1)
+	sum := sha256.Sum256([]byte("a\nb\nc"))
+	want := `"hash":"` + hex.EncodeToString(sum[:]) + `"`
+	for _, r := range []*bufio.Reader{or, er} {
+		if line, _ := r.ReadString('\n'); !strings.Contains(line, want) || strings.Contains(line, "spoofed") {
+			t.Fatalf("Expected checkpoint hash, got %s", line)
+		}
+	}
+}
@@ -0,0 +1,52 @@
+package main
+
+import "time"
+
+// How late a request may time out, timeouts within this window are
+// expired together with one wake-up
+const RequestTimeoutResolution = 100 * time.Millisecond
+
+type deadline struct {
+	RequestID int
+	At        time.Time
+}
+
+// Deadlines of the room's requests in expiry order. Every request gets the
+// same RequestTimeout, so deadlines are added in order and a FIFO works as a
+// min-heap with O(1) push and pop. Resolved requests are not removed, their
+// entries are skipped when they come up
+type deadlineQueue struct {
+	items []deadline
+	head  int
+}
+
+func (q *deadlineQueue) Len() int {
+	return len(q.items) - q.head
+}
+
+func (q *deadlineQueue) Push(reqID int, at time.Time) {
+	q.items = append(q.items, deadline{reqID, at})
+}
+
+func (q *deadlineQueue) Peek() (deadline, bool) {
+	if q.Len() == 0 {
+		return deadline{}, false
+	}
+	return q.items[q.head], true
+}
+
+// Removes and returns deadlines that are at or before now
+func (q *deadlineQueue) PopExpired(now time.Time, expired []deadline) []deadline {
+	for q.Len() > 0 && !q.items[q.head].At.After(now) {
+		expired = append(expired, q.items[q.head])
+		q.head++
+	}
+
+	// Reuse the slice once most of it has been popped
+	if q.head > len(q.items)/2 {
+		n := copy(q.items, q.items[q.head:])
+		q.items = q.items[:n]
+		q.head = 0
+	}
+	return expired
+}
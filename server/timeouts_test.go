@@ -0,0 +1,33 @@
+package main
+
+import (
+	"testing"
+	"time"
+)
+
+func TestDeadlineQueue(t *testing.T) {
+	var q deadlineQueue
+	start := time.Now()
+	for i := 0; i < 10; i++ {
+		q.Push(i, start.Add(time.Duration(i)*time.Second))
+	}
+
+	expired := q.PopExpired(start.Add(3*time.Second), nil)
+	if len(expired) != 4 || expired[0].RequestID != 0 || expired[3].RequestID != 3 {
+		t.Fatalf("Expected requests 0-3 to expire, got %v", expired)
+	}
+	if next, ok := q.Peek(); !ok || next.RequestID != 4 || q.Len() != 6 {
+		t.Fatalf("Expected request 4 next of 6, got %v (%d left)", next, q.Len())
+	}
+
+	// Compaction keeps the order
+	q.PopExpired(start.Add(5*time.Second), nil)
+	q.Push(10, start.Add(10*time.Second))
+	expired = q.PopExpired(start.Add(time.Hour), expired[:0])
+	if len(expired) != 5 || expired[0].RequestID != 6 || expired[4].RequestID != 10 {
+		t.Fatalf("Expected requests 6-10 to expire, got %v", expired)
+	}
+	if _, ok := q.Peek(); ok || q.Len() != 0 {
+		t.Fatal("Queue should be empty")
+	}
+}